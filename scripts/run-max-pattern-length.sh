@@ -0,0 +1,110 @@
+#!/bin/sh
+set -eu
+
+SCRIPT_DIR=$(CDPATH= cd -- "$(dirname -- "$0")" && pwd)
+REPO_ROOT=$(CDPATH= cd -- "${SCRIPT_DIR}/.." && pwd)
+cd "${REPO_ROOT}"
+
+DATASET_DIR="${DATASET_DIR:-datasets/swissprot}"
+RESULT_ROOT="${RESULT_ROOT:-results/max_pattern_length}"
+QUERY_STRING_LEN="${QUERY_STRING_LEN:-8}"
+NUM_QUERIES="${NUM_QUERIES:-1000}"
+K_VALUE="${K_VALUE:-10}"
+TRUNCATE_LEN="${TRUNCATE_LEN:--1}"
+LENGTHS="${LENGTHS:-4 8 16 32 0}" # 0 = unbounded
+METHOD="VectorMaton-smart"
+
+STRINGS_FILE="${DATASET_DIR}/strings.txt"
+VECTORS_FILE="${DATASET_DIR}/vectors.txt"
+DATASET_NAME=$(basename "${DATASET_DIR}")
+
+if [ ! -x "./build/main" ]; then
+    echo "Missing executable ./build/main (build the project first)." >&2
+    exit 1
+fi
+
+if [ ! -f "${STRINGS_FILE}" ] || [ ! -f "${VECTORS_FILE}" ]; then
+    echo "Missing dataset files under ${DATASET_DIR} (expected strings.txt and vectors.txt)." >&2
+    exit 1
+fi
+
+RUN_ROOT="${RESULT_ROOT}/${METHOD}/${DATASET_NAME}/len${QUERY_STRING_LEN}_k${K_VALUE}_q${NUM_QUERIES}"
+QUERY_DIR="${RUN_ROOT}/queries"
+mkdir -p "${QUERY_DIR}"
+
+echo "==> Generating queries (${NUM_QUERIES}, |p|=${QUERY_STRING_LEN}, k=${K_VALUE}) on ${DATASET_NAME}"
+(
+    cd "${QUERY_DIR}"
+    python3 "${REPO_ROOT}/scripts/generate_queries.py" \
+        "${REPO_ROOT}/${STRINGS_FILE}" \
+        "${REPO_ROOT}/${VECTORS_FILE}" \
+        "${QUERY_STRING_LEN}" \
+        "${NUM_QUERIES}" \
+        "${K_VALUE}" \
+        "${TRUNCATE_LEN}" \
+        max_pattern_length
+)
+
+QUERY_STRINGS="${QUERY_DIR}/strings_max_pattern_length.txt"
+QUERY_VECTORS="${QUERY_DIR}/vectors_max_pattern_length.txt"
+QUERY_K="${QUERY_DIR}/k_max_pattern_length.txt"
+
+for f in "${QUERY_STRINGS}" "${QUERY_VECTORS}" "${QUERY_K}"; do
+    if [ ! -f "${f}" ]; then
+        echo "Query generation failed: missing ${f}" >&2
+        exit 1
+    fi
+done
+
+SUMMARY_CSV="${RUN_ROOT}/summary.csv"
+printf "max_pattern_length,index_size_bytes,build_time_us,max_recall,max_recall_qps,max_recall_time_us\n" > "${SUMMARY_CSV}"
+
+# Runs are sequential so that build times are comparable
+for length in ${LENGTHS}; do
+    OUT_DIR="${RUN_ROOT}/L_${length}"
+    LOG_FILE="${OUT_DIR}/run.log"
+    STATS_FILE="${OUT_DIR}/stats.csv"
+    mkdir -p "${OUT_DIR}"
+
+    echo "==> Running ${METHOD} with --max-pattern-length=${length}"
+    ./build/main \
+        "${STRINGS_FILE}" \
+        "${VECTORS_FILE}" \
+        "${QUERY_STRINGS}" \
+        "${QUERY_VECTORS}" \
+        "${QUERY_K}" \
+        "${METHOD}" \
+        "--max-pattern-length=${length}" \
+        "--statistics-file=${STATS_FILE}" \
+        > "${LOG_FILE}" 2>&1
+
+    if [ ! -f "${STATS_FILE}" ]; then
+        echo "Missing statistics output: ${STATS_FILE}" >&2
+        exit 1
+    fi
+
+    index_size=$(sed -n 's/.*Total index size: \([0-9][0-9]*\) bytes.*/\1/p' "${LOG_FILE}" | tail -n 1)
+    build_time=$(sed -n 's/.*index built took \([0-9][0-9]*\).*/\1/p' "${LOG_FILE}" | tail -n 1)
+
+    max_line=$(awk -F, '
+        NR==2 { best_recall=$3+0; best_time=$2+0 }
+        NR>2 {
+            r=$3+0; t=$2+0
+            if (r > best_recall || (r == best_recall && t < best_time)) {
+                best_recall=r; best_time=t
+            }
+        }
+        END {
+            if (NR >= 2) {
+                qps = (best_time > 0 ? 1000000/best_time : 0)
+                printf "%.10g,%.10g,%.10g", best_recall, qps, best_time
+            }
+        }
+    ' "${STATS_FILE}")
+
+    printf "%s,%s,%s,%s\n" "${length}" "${index_size}" "${build_time}" "${max_line}" >> "${SUMMARY_CSV}"
+done
+
+echo "==> Finished"
+echo "Results saved under: ${RUN_ROOT}"
+echo "Summary: ${SUMMARY_CSV}"
@@ -0,0 +1,134 @@
+#include "cost_model.h"
+#include "state_index.h"
+#include <random>
+
+static double elapsed_us(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+void CostModel::calibrate(const std::vector<float>& vecs, int dim, int num_elements, hnswlib::SpaceInterface<float>* space,
+                          const HnswPolicy& policy, int max_size) {
+    samples.clear();
+    std::mt19937 rng(2024);
+    std::vector<uint32_t> perm(num_elements);
+    std::iota(perm.begin(), perm.end(), 0);
+    std::shuffle(perm.begin(), perm.end(), rng);
+    // Queries from the end of the permutation, sets from its beginning
+    int num_queries = std::min(200, num_elements / 4);
+    if (num_queries == 0) return;
+    std::vector<const float*> queries;
+    for (int q = 0; q < num_queries; q++) queries.emplace_back(vecs.data() + (size_t)perm[num_elements - 1 - q] * dim);
+    max_size = std::min(max_size, num_elements - num_queries);
+    for (int n = 32; n <= max_size; n *= 2) {
+        std::vector<uint32_t> ids(perm.begin(), perm.begin() + n);
+        std::sort(ids.begin(), ids.end());
+        PostingList list(ids);
+        Sample sample;
+        sample.n = n;
+
+        FlatIndex flat(vecs.data(), dim);
+        flat.build(list);
+        size_t found = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (auto q : queries) found += flat.search(q, kK).size();
+        sample.scan_us = elapsed_us(start) / num_queries;
+
+        start = std::chrono::steady_clock::now();
+        HnswIndex hnsw(space, n, vecs.data(), policy.choose(n, dim));
+        hnsw.build(list);
+        sample.build_us = elapsed_us(start) / n;
+        hnsw.set_ef(kSearchEf);
+        start = std::chrono::steady_clock::now();
+        for (auto q : queries) found += hnsw.search(q, kK).size();
+        sample.search_us = elapsed_us(start) / num_queries;
+        if (found == 0) LOG_WARN("Calibration queries returned no results");
+        samples.emplace_back(sample);
+    }
+    fit();
+}
+
+void CostModel::fit() {
+    if (samples.empty()) return;
+    double sn = 0, snn = 0;
+    for (const auto& s : samples) sn += s.scan_us * s.n, snn += double(s.n) * s.n;
+    scan_per_vector = sn / snn;
+    double mx = 0, my = 0;
+    for (const auto& s : samples) mx += std::log2(s.n), my += s.search_us;
+    mx /= samples.size(), my /= samples.size();
+    double sxy = 0, sxx = 0;
+    for (const auto& s : samples) {
+        double x = std::log2(s.n) - mx;
+        sxy += x * (s.search_us - my), sxx += x * x;
+    }
+    search_per_log = sxx > 0 ? std::max(0.0, sxy / sxx) : 0;
+    search_base = my - search_per_log * mx;
+    if (search_base < 0) {
+        double sxy0 = 0, sxx0 = 0;
+        for (const auto& s : samples) sxy0 += std::log2(s.n) * s.search_us, sxx0 += std::log2(s.n) * std::log2(s.n);
+        search_base = 0;
+        search_per_log = sxy0 / sxx0;
+    }
+}
+
+double CostModel::build_time(size_t n) const {
+    if (samples.empty()) return 0;
+    double x = std::log2(std::max<size_t>(n, 1));
+    if (n <= (size_t)samples[0].n) return double(n) * n / samples[0].n * samples[0].build_us;
+    if (samples.size() == 1) return n * samples[0].build_us;
+    size_t k = 1;
+    while (k + 1 < samples.size() && (size_t)samples[k].n < n) k++;
+    const Sample &a = samples[k - 1], &b = samples[k];
+    double slope = (b.build_us - a.build_us) / (std::log2(b.n) - std::log2(a.n));
+    return n * std::max(0.0, a.build_us + slope * (x - std::log2(a.n)));
+}
+
+bool CostModel::wants_graph(size_t n, double inherited_us) const {
+    if (samples.empty()) return n >= (size_t)threshold;
+    if (scan_latency(n) + inherited_us <= latency_target) return false;
+    if (n > (size_t)samples.back().n) return true;
+    return scan_latency(n) > search_latency(n);
+}
+
+int CostModel::choose_threshold(double target) {
+    latency_target = target;
+    if (samples.empty()) return threshold;
+    // Smallest n (on a 5% grid) wanting a graph
+    double n = 1;
+    while (n < 1e9 && !wants_graph(std::ceil(n))) n *= 1.05;
+    threshold = std::ceil(n);
+    return threshold;
+}
+
+void CostModel::log() const {
+    for (const auto& s : samples) {
+        LOG_INFO("Calibration n=", s.n, ": scan ", s.scan_us, "us, HNSW search ", s.search_us, "us (ef ", kSearchEf, "), HNSW build ", s.build_us, "us per vector");
+    }
+    LOG_INFO("Cost model: scan ", scan_per_vector, "us per vector, search ", search_base, " + ", search_per_log,
+             " log2(n) us; latency target ", latency_target, "us, build threshold ", threshold, " (states inheriting no graph)");
+}
+
+void CostModel::save(const std::string& path) const {
+    std::ofstream f(path);
+    f << "threshold " << threshold << "\n";
+    f << "latency_target " << latency_target << "\n";
+    f << "model " << scan_per_vector << " " << search_base << " " << search_per_log << "\n";
+    f << "samples " << samples.size() << "\n";
+    for (const auto& s : samples) f << s.n << " " << s.scan_us << " " << s.search_us << " " << s.build_us << "\n";
+    f << "per_state " << per_state << "\n";
+}
+
+bool CostModel::load(const std::string& path) {
+    std::ifstream f(path);
+    std::string key;
+    size_t num_samples = 0;
+    if (!(f >> key >> threshold >> key >> latency_target >> key >> scan_per_vector >> search_base >> search_per_log >> key >> num_samples)) {
+        return false;
+    }
+    samples.resize(num_samples);
+    for (auto& s : samples) f >> s.n >> s.scan_us >> s.search_us >> s.build_us;
+    if (!f) return false;
+    // Files of older builds end here: their states got graphs by the threshold
+    per_state = false;
+    if (f >> key) f >> per_state;
+    return true;
+}
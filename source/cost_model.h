@@ -0,0 +1,65 @@
+#ifndef COST_MODEL_H
+#define COST_MODEL_H
+
+#include "headers.h"
+#include "hnsw_policy.h"
+
+// Query latency of a brute-force scan vs. an HNSW search as a function of the candidate set size,
+// measured on the actual vectors and hardware. A scan costs scan_per_vector * n, a search
+// search_base + search_per_log * log2(n). Every state decides from the model whether its ids get a
+// graph (wants_graph()): only if scanning them, on top of searching the graphs it inherits, misses
+// the latency target and is slower than a search, so that states answered fast enough by a scan
+// save the graph's memory and construction time.
+class CostModel {
+public:
+    struct Sample {
+        int n;
+        double scan_us;   // per query
+        double search_us; // per query, at kSearchEf
+        double build_us;  // per inserted vector
+    };
+
+    static constexpr int kSearchEf = 64; // mid-range of the recall sweeps
+    static constexpr int kK = 10;
+
+    std::vector<Sample> samples;
+    double scan_per_vector = 0, search_base = 0, search_per_log = 0;
+    double latency_target = 0; // microseconds per query, 0 = break-even with the search
+    int threshold = 0; // smallest n wants_graph(n) holds for, for states that inherit nothing
+    bool per_state = false; // states get graphs by wants_graph() instead of a fixed threshold
+
+    // Time scans and searches over random subsets of 32, 64, ... up to max_size of the
+    // num_elements vectors (queries are other vectors of the data), then fit the model.
+    void calibrate(const std::vector<float>& vecs, int dim, int num_elements, hnswlib::SpaceInterface<float>* space,
+                   const HnswPolicy& policy, int max_size = 4096);
+
+    // Least squares fit of the model to the samples: the scan through the origin, the search
+    // linear in log2(n), through the origin too if its intercept would be negative.
+    void fit();
+
+    double scan_latency(size_t n) const { return scan_per_vector * n; }
+    double search_latency(size_t n) const { return search_base + search_per_log * std::log2(std::max<size_t>(n, 2)); }
+
+    // Microseconds to build a graph of n vectors by insertion on one thread: the cost per vector
+    // is interpolated between the samples in log2(n) (it grows about linearly up to
+    // ef_construction, then with log(n)), extrapolated from the last two samples above them and
+    // proportional to n below them. 0 without samples.
+    double build_time(size_t n) const;
+
+    // Whether a state of n ids that also searches inherited_us microseconds of inherited graphs
+    // per query needs a graph over its n ids: the scan and the inherited searches take longer than
+    // latency_target, and the scan is slower than a search. The fit is not extrapolated past the
+    // largest sample: a larger set gets a graph over the target, as its scan only gets slower.
+    bool wants_graph(size_t n, double inherited_us = 0) const;
+
+    // Set latency_target and return the threshold, the smallest n wanting a graph on its own.
+    int choose_threshold(double target);
+
+    // Log the samples, the fitted model and the threshold.
+    void log() const;
+
+    void save(const std::string& path) const;
+    bool load(const std::string& path);
+};
+
+#endif
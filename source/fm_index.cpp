@@ -0,0 +1,330 @@
+#include "fm_index.h"
+
+void BitVector::assign(int n) {
+    words.assign(n / 64 + 1, 0);
+    ranks.assign(n / 64 + 1, 0);
+}
+
+void BitVector::build_ranks() {
+    for (size_t w = 1; w < words.size(); w++) {
+        ranks[w] = ranks[w - 1] + __builtin_popcountll(words[w - 1]);
+    }
+}
+
+void WaveletMatrix::build(std::vector<uint32_t> values, int bits) {
+    int n = values.size();
+    levels.assign(bits, Level());
+    std::vector<uint32_t> next(n);
+    for (int b = 0; b < bits; b++) {
+        // Level b holds bit (bits - 1 - b) of every value; values with a 0 bit move first (stably)
+        Level& level = levels[b];
+        int shift = bits - 1 - b;
+        level.assign(n);
+        for (int i = 0; i < n; i++) {
+            if (values[i] >> shift & 1) level.set(i);
+        }
+        level.build_ranks();
+        int z = 0;
+        for (int i = 0; i < n; i++) {
+            if (!(values[i] >> shift & 1)) next[z++] = values[i];
+        }
+        level.zeros = z;
+        for (int i = 0; i < n; i++) {
+            if (values[i] >> shift & 1) next[z++] = values[i];
+        }
+        values.swap(next);
+    }
+}
+
+uint32_t WaveletMatrix::access(int i) const {
+    uint32_t c = 0;
+    for (const Level& level : levels) {
+        if (level.get(i)) {
+            c = c << 1 | 1;
+            i = level.zeros + level.rank1(i);
+        }
+        else {
+            c <<= 1;
+            i -= level.rank1(i);
+        }
+    }
+    return c;
+}
+
+int WaveletMatrix::rank(uint32_t c, int i) const {
+    int l = 0, r = i, bits = levels.size();
+    for (int b = 0; b < bits; b++) {
+        const Level& level = levels[b];
+        if (c >> (bits - 1 - b) & 1) {
+            l = level.zeros + level.rank1(l);
+            r = level.zeros + level.rank1(r);
+        }
+        else {
+            l -= level.rank1(l);
+            r -= level.rank1(r);
+        }
+    }
+    return r - l;
+}
+
+size_t WaveletMatrix::size_bytes() const {
+    size_t res = 0;
+    for (const auto& level : levels) res += sizeof(Level) + level.size_bytes();
+    return res;
+}
+
+void FMIndex::build(const std::vector<std::string>& strs, int n) {
+    if (n < 0) n = strs.size();
+    unsigned long long start_time = currentTime();
+
+    // Concatenate the encoded strings, each followed by a separator
+    std::vector<uint32_t> text;
+    std::vector<char> is_separator;
+    std::vector<uint32_t> encoded;
+    dropped_chars = 0;
+    for (int i = 0; i < n; i++) {
+        dropped_chars += tokenizer.encode_new(strs[i], normalizer, encoded);
+        text.insert(text.end(), encoded.begin(), encoded.end());
+        text.emplace_back(0);
+        is_separator.resize(text.size(), 0);
+        is_separator.back() = 1;
+    }
+    int len = text_length = text.size();
+
+    // Symbol codes: 0 for separators, 1.. for the distinct symbols in increasing order
+    uint32_t max_symbol = 0;
+    for (int p = 0; p < len; p++) {
+        if (!is_separator[p]) max_symbol = std::max(max_symbol, text[p]);
+    }
+    std::vector<uint32_t> code_of(max_symbol + 1, 0);
+    for (int p = 0; p < len; p++) {
+        if (!is_separator[p]) code_of[text[p]] = 1;
+    }
+    symbols.clear();
+    for (uint32_t c = 0; c <= max_symbol; c++) {
+        if (code_of[c]) {
+            symbols.emplace_back(c);
+            code_of[c] = symbols.size();
+        }
+    }
+    for (int p = 0; p < len; p++) {
+        text[p] = is_separator[p] ? 0 : code_of[text[p]];
+    }
+    std::vector<uint32_t>().swap(code_of);
+    std::vector<char>().swap(is_separator);
+    int sigma = symbols.size() + 1;
+    C.assign(sigma + 1, 0);
+    for (int p = 0; p < len; p++) C[text[p] + 1]++;
+    for (int c = 0; c < sigma; c++) C[c + 1] += C[c];
+
+    // Suffix array by prefix doubling. The separator of string i gets initial rank i, so every
+    // separator is distinct and no suffix extends past its own string.
+    std::vector<int> sa(len), rk(len), tmp(len);
+    int alpha = n + sigma - 1;
+    for (int p = 0, i = 0; p < len; p++) {
+        rk[p] = text[p] == 0 ? i++ : n + text[p] - 1;
+    }
+    {
+        std::vector<int> cnt(std::max(alpha, len) + 1, 0);
+        for (int p = 0; p < len; p++) cnt[rk[p]]++;
+        for (int i = 1; i < alpha; i++) cnt[i] += cnt[i - 1];
+        for (int p = len - 1; p >= 0; p--) sa[--cnt[rk[p]]] = p;
+        for (int k = 1; k < len; k <<= 1) {
+            // Sort by (rk[p], rk[p + k]): order by the second key first, then a stable counting sort
+            int q = 0;
+            for (int p = len - k; p < len; p++) tmp[q++] = p;
+            for (int i = 0; i < len; i++) {
+                if (sa[i] >= k) tmp[q++] = sa[i] - k;
+            }
+            std::fill(cnt.begin(), cnt.begin() + alpha, 0);
+            for (int p = 0; p < len; p++) cnt[rk[p]]++;
+            for (int i = 1; i < alpha; i++) cnt[i] += cnt[i - 1];
+            for (int i = len - 1; i >= 0; i--) sa[--cnt[rk[tmp[i]]]] = tmp[i];
+            std::swap(tmp, rk);
+            int classes = 1;
+            rk[sa[0]] = 0;
+            for (int i = 1; i < len; i++) {
+                int a = sa[i - 1], b = sa[i];
+                bool same = tmp[a] == tmp[b] && (a + k < len ? tmp[a + k] : -1) == (b + k < len ? tmp[b + k] : -1);
+                rk[b] = same ? classes - 1 : classes++;
+            }
+            if (classes == len) break;
+            alpha = classes;
+        }
+    }
+    // rk is now the inverse suffix array
+
+    // String id of every suffix and the BWT. Only every kDocSample-th suffix of a string, its
+    // first one included, keeps its id.
+    num_strings = n;
+    std::vector<uint32_t> suffix_doc(len);
+    doc_sampled.assign(len);
+    for (int p = 0, i = 0, offset = 0; p < len; p++, offset++) {
+        suffix_doc[rk[p]] = i;
+        if (offset % kDocSample == 0) doc_sampled.set(rk[p]);
+        if (text[p] == 0) i++, offset = -1;
+    }
+    doc_sampled.build_ranks();
+    doc_samples.clear();
+    std::vector<uint32_t> bwt_codes(len);
+    for (int i = 0; i < len; i++) {
+        if (doc_sampled.get(i)) doc_samples.emplace_back(suffix_doc[i]);
+        bwt_codes[i] = sa[i] == 0 ? 0 : text[sa[i] - 1];
+    }
+    doc_samples.shrink_to_fit();
+    int bits = 1;
+    while ((1 << bits) < sigma) bits++;
+    bwt.build(std::move(bwt_codes), bits);
+
+    // LCP array (Kasai et al.), separators never match: lcp[i] = lcp of suffixes sa[i - 1] and sa[i]
+    std::vector<int>& lcp = tmp;
+    for (int p = 0, h = 0; p < len; p++) {
+        if (rk[p] == 0) {
+            h = 0;
+            continue;
+        }
+        int q = sa[rk[p] - 1];
+        while (p + h < len && q + h < len && text[p + h] != 0 && text[p + h] == text[q + h]) h++;
+        lcp[rk[p]] = h;
+        if (h > 0) h--;
+    }
+    std::vector<int>().swap(sa);
+    std::vector<int>().swap(rk);
+    std::vector<uint32_t>().swap(text);
+
+    // The lcp-intervals, reported in post-order by a stack over the LCP array. Every interval
+    // collects the string ids of its suffixes; those spanning one string only are dropped and
+    // their suffixes left to the string's state.
+    struct Frame {
+        int lcp, lb;
+        std::vector<int> children;
+        std::vector<uint32_t> docs;
+    };
+    std::vector<Frame> stack;
+    node_lb.clear();
+    node_rb.clear();
+    node_ids.clear();
+    child.clear();
+    child_begin.assign(1, 0);
+    if (len > 0) stack.push_back({0, 0, {}, {}});
+    for (int i = 1; i <= len; i++) {
+        int cur = i < len ? lcp[i] : -1;
+        // Suffix i - 1 belongs to the deeper of the intervals around it
+        bool leaf_in_new = cur > stack.back().lcp;
+        if (!leaf_in_new) stack.back().docs.emplace_back(suffix_doc[i - 1]);
+        int lb = i - 1, last = -1;
+        std::vector<uint32_t> last_docs;
+        while (!stack.empty() && cur < stack.back().lcp) {
+            Frame f = std::move(stack.back());
+            stack.pop_back();
+            std::sort(f.docs.begin(), f.docs.end());
+            f.docs.erase(std::unique(f.docs.begin(), f.docs.end()), f.docs.end());
+            last = -1;
+            if (f.docs.size() > 1) {
+                last = node_lb.size();
+                node_lb.emplace_back(f.lb);
+                node_rb.emplace_back(i);
+                node_ids.emplace_back(f.docs);
+                child.insert(child.end(), f.children.begin(), f.children.end());
+                child_begin.emplace_back(child.size());
+            }
+            lb = f.lb;
+            if (!stack.empty() && cur <= stack.back().lcp) {
+                Frame& parent = stack.back();
+                if (last != -1) parent.children.emplace_back(last);
+                parent.docs.insert(parent.docs.end(), f.docs.begin(), f.docs.end());
+                last = -1;
+            }
+            else {
+                last_docs = std::move(f.docs);
+            }
+        }
+        if (cur >= 0 && (stack.empty() || cur > stack.back().lcp)) {
+            stack.push_back({cur, lb, {}, std::move(last_docs)});
+            if (last != -1) stack.back().children.emplace_back(last);
+            if (leaf_in_new) stack.back().docs.emplace_back(suffix_doc[i - 1]);
+        }
+    }
+    num_internal = node_lb.size();
+    by_interval.resize(num_internal);
+    for (int v = 0; v < num_internal; v++) by_interval[v] = v;
+    std::sort(by_interval.begin(), by_interval.end(), [&](int a, int b) {
+        return node_lb[a] != node_lb[b] ? node_lb[a] < node_lb[b] : node_rb[a] < node_rb[b];
+    });
+    LOG_DEBUG("FM-index built in ", timeFormatting(currentTime() - start_time).str(), ": text length ", len,
+              ", alphabet size ", symbols.size(), ", internal nodes ", num_internal);
+}
+
+uint32_t FMIndex::code(uint32_t symbol) const {
+    auto it = std::lower_bound(symbols.begin(), symbols.end(), symbol);
+    return it != symbols.end() && *it == symbol ? it - symbols.begin() + 1 : 0;
+}
+
+uint32_t FMIndex::doc(int i) const {
+    // The first suffix of every string is sampled, so the walk never leaves the string
+    while (!doc_sampled.get(i)) {
+        uint32_t c = bwt.access(i);
+        i = C[c] + bwt.rank(c, i);
+    }
+    return doc_samples[doc_sampled.rank1(i)];
+}
+
+int FMIndex::query(const std::string &p) const {
+    std::vector<uint32_t> encoded;
+    tokenizer.encode(p, normalizer, encoded);
+    return query(encoded);
+}
+
+int FMIndex::query(const std::vector<uint32_t> &p) const {
+    if (text_length == 0) return -1;
+    // Backward search for the suffix array interval [l, r) of p
+    int l = 0, r = text_length;
+    for (auto it = p.rbegin(); it != p.rend(); ++it) {
+        uint32_t c = code(*it);
+        if (c == 0) return -1;
+        l = C[c] + bwt.rank(c, l);
+        r = C[c] + bwt.rank(c, r);
+        if (l >= r) return -1;
+    }
+    // Every interval spanning two strings is a branching node, any other one a single string
+    if (r - l > 1) {
+        auto it = std::lower_bound(by_interval.begin(), by_interval.end(), std::make_pair(l, r), [&](int v, const std::pair<int, int>& key) {
+            return std::make_pair(node_lb[v], node_rb[v]) < key;
+        });
+        if (it != by_interval.end() && node_lb[*it] == l && node_rb[*it] == r) return *it;
+    }
+    return string_state(doc(l));
+}
+
+PostingList FMIndex::take_ids(int v) {
+    if (v >= num_internal) return ids(v);
+    return std::move(node_ids[v]);
+}
+
+PostingList FMIndex::ids(int v) const {
+    if (v >= num_internal) return PostingList(std::vector<uint32_t>{uint32_t(v - num_internal)});
+    return node_ids[v];
+}
+
+void FMIndex::successors(int v, std::vector<int> &out) const {
+    if (v >= num_internal) return;
+    out.insert(out.end(), child.begin() + child_begin[v], child.begin() + child_begin[v + 1]);
+}
+
+std::vector<int> FMIndex::build_order() const {
+    std::vector<int> order;
+    order.reserve(num_states());
+    for (int v = num_internal; v < num_states(); v++) order.emplace_back(v);
+    for (int v = 0; v < num_internal; v++) order.emplace_back(v);
+    return order;
+}
+
+size_t FMIndex::size_bytes() const {
+    size_t res = sizeof(FMIndex);
+    res += sizeof(uint32_t) * symbols.size() + sizeof(int) * C.size() + bwt.size_bytes();
+    res += doc_sampled.size_bytes() + sizeof(uint32_t) * doc_samples.size();
+    res += sizeof(int) * (node_lb.size() + node_rb.size() + by_interval.size() + child_begin.size() + child.size());
+    for (const auto& ids : node_ids) res += sizeof(PostingList) + ids.size_bytes();
+    for (const auto& token : tokenizer.vocab) res += sizeof(std::string) + token.capacity();
+    return res;
+}
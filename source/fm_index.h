@@ -0,0 +1,113 @@
+#ifndef FM_INDEX_H
+#define FM_INDEX_H
+
+#include "headers.h"
+#include "pattern_index.h"
+#include "normalizer.h"
+#include "tokenizer.h"
+
+// Bits with rank queries: one 32-bit count of the ones before every 64-bit word.
+struct BitVector {
+    std::vector<uint64_t> words;
+    std::vector<uint32_t> ranks;
+
+    // n zero bits.
+    void assign(int n);
+    void set(int i) { words[i >> 6] |= 1ULL << (i & 63); }
+    // Call after the last set().
+    void build_ranks();
+
+    bool get(int i) const { return words[i >> 6] >> (i & 63) & 1; }
+    // Number of ones in positions [0, i).
+    int rank1(int i) const {
+        return ranks[i >> 6] + __builtin_popcountll(words[i >> 6] & ((1ULL << (i & 63)) - 1));
+    }
+    size_t size_bytes() const { return sizeof(uint64_t) * words.size() + sizeof(uint32_t) * ranks.size(); }
+};
+
+// Sequence of small integers with rank queries, in n * bits bits plus rank samples.
+class WaveletMatrix {
+public:
+    // values must be < 2^bits.
+    void build(std::vector<uint32_t> values, int bits);
+
+    // Value at position i.
+    uint32_t access(int i) const;
+
+    // Number of occurrences of c in positions [0, i).
+    int rank(uint32_t c, int i) const;
+
+    size_t size_bytes() const;
+
+private:
+    struct Level : BitVector {
+        int zeros = 0;
+    };
+    std::vector<Level> levels;
+};
+
+// Pattern index over the suffix array of all strings (each followed by its own separator),
+// stored as the BWT in a wavelet matrix. A pattern is located by backward search, which yields
+// its suffix array interval. The states are the nodes of the generalized suffix tree whose
+// interval spans at least two strings (lcp-intervals, numbered in post-order), followed by one
+// state per string: every other pattern, leaves included, occurs in a single string and maps to
+// that string's state. The number of states grows with the number of strings and of patterns
+// shared between strings, not with the text length.
+// The string id of a suffix is stored for every kDocSample-th position of each string only and
+// found by walking the BWT backwards (LF-mapping) to a sampled suffix. Ids of the branching nodes
+// are merged bottom-up once at build time and handed over by take_ids().
+class FMIndex : public PatternIndex {
+public:
+    Normalizer normalizer;
+    Tokenizer tokenizer;
+    size_t dropped_chars = 0;
+
+    // Index strs[0..n) (n = -1 for all), string i has id i. Replaces any previous contents.
+    void build(const std::vector<std::string>& strs, int n = -1);
+
+    int num_states() const override { return num_internal + num_strings; }
+    int query(const std::string &p) const override;
+    int query(const std::vector<uint32_t> &p) const;
+
+    // The index keeps no copy of the ids of a branching node once they are taken.
+    PostingList take_ids(int v) override;
+    PostingList ids(int v) const;
+
+    // Branching children in the suffix tree. The single-string states below a node are not
+    // listed: their id sets have one id, so they never hold a graph to inherit.
+    void successors(int v, std::vector<int> &out) const override;
+
+    // Single-string states, then branching nodes in post-order.
+    std::vector<int> build_order() const override;
+
+    size_t size_bytes() const override;
+
+    // State of the patterns that occur in string id only.
+    int string_state(uint32_t id) const { return num_internal + id; }
+
+    int alphabet_size() const { return symbols.size(); }
+
+private:
+    static const int kDocSample = 8;
+
+    int text_length = 0; // symbols plus one separator per string
+    int num_strings = 0;
+    int num_internal = 0;
+    std::vector<uint32_t> symbols; // sorted symbols of the text, symbols[c - 1] has code c (0 = separator)
+    std::vector<int> C;            // C[c] = number of text positions with code < c
+    WaveletMatrix bwt;
+    BitVector doc_sampled;         // suffixes whose string id is stored
+    std::vector<uint32_t> doc_samples; // string ids of the sampled suffixes, in suffix order
+    std::vector<int> node_lb, node_rb; // intervals of branching nodes
+    std::vector<int> by_interval;      // branching nodes sorted by (lb, rb)
+    std::vector<int> child_begin, child; // branching children of branching nodes (CSR)
+    std::vector<PostingList> node_ids;
+
+    // Code of a symbol, 0 if it does not occur.
+    uint32_t code(uint32_t symbol) const;
+
+    // String id of the i-th smallest suffix.
+    uint32_t doc(int i) const;
+};
+
+#endif
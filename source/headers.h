@@ -9,6 +9,7 @@
 #include <filesystem>
 #include <string>
 #include <cstring>
+#include <cerrno>
 #include <vector>
 #include <unordered_set>
 #include <queue>
@@ -23,6 +24,9 @@
 #include <functional>
 #include <sstream>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
 #include <numeric>
 #include <chrono>
 #include <ctime>
@@ -40,6 +44,16 @@ inline float distance(const float* a, const float* b, size_t size) {
     return std::sqrt(dist);
 }
 
+// Squared Euclidean distance, the distance state indexes return (as hnswlib's L2Space)
+inline float squared_distance(const float* a, const float* b, size_t size) {
+    float dist = 0.0;
+    for (size_t i = 0; i < size; ++i) {
+        float diff = a[i] - b[i];
+        dist += diff * diff;
+    }
+    return dist;
+}
+
 inline std::stringstream timeFormatting(unsigned long long microSeconds) {
     std::stringstream ret;
     ret << microSeconds << "μs" << " (";
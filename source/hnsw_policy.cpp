@@ -0,0 +1,54 @@
+#include "hnsw_policy.h"
+
+bool parse_option_value(const std::string& token, size_t prefix, size_t& value) {
+    const char* s = token.c_str() + prefix;
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long v = std::strtoull(s, &end, 10);
+    if (*s < '0' || *s > '9' || *end != '\0' || errno == ERANGE || v > std::numeric_limits<int32_t>::max()) {
+        LOG_ERROR("Invalid value in option '", token, "', option ignored");
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+HnswPolicy::HnswPolicy(const std::string& spec) {
+    std::stringstream ss(spec);
+    std::string token;
+    size_t v = 0;
+    while (std::getline(ss, token, ',')) {
+        if (token == "" || token == "fixed") continue;
+        else if (token == "adaptive") adaptive = true;
+        else if (token.find("m=") == 0) {
+            if (parse_option_value(token, 2, v)) fixed.M = std::max<int>(2, v);
+        }
+        else if (token.find("efc=") == 0) {
+            if (parse_option_value(token, 4, v)) fixed.ef_construction = std::max<int>(1, v);
+        }
+        else if (token.find("ef=") == 0) {
+            if (parse_option_value(token, 3, v)) fixed.ef_search = std::max<int>(1, v);
+        }
+        else LOG_WARN("Unknown HNSW parameter option '", token, "' ignored");
+    }
+    if (adaptive && spec != "adaptive") {
+        LOG_WARN("Fixed HNSW parameters are ignored by the adaptive policy");
+    }
+}
+
+std::string HnswPolicy::spec() const {
+    if (adaptive) return "adaptive";
+    return "m=" + std::to_string(fixed.M) + ",efc=" + std::to_string(fixed.ef_construction) + ",ef=" + std::to_string(fixed.ef_search);
+}
+
+HnswPolicy::Params HnswPolicy::choose(size_t n, int dim) const {
+    if (!adaptive) return fixed;
+    Params p;
+    // M = 4 log10(n): 9 for 200 vectors, 16 for 10^4, 24 for 10^6, a quarter more at high dimensions
+    double scale = dim >= 256 ? 1.25 : 1.0;
+    p.M = std::min(48, std::max(8, int(std::round(4 * std::log10(std::max<size_t>(n, 10)) * scale))));
+    // A candidate list wider than the graph itself visits nothing more
+    p.ef_construction = std::min<size_t>(std::min(400, std::max(32, 12 * p.M)), std::max<size_t>(n, p.M));
+    p.ef_search = std::max(10, p.M);
+    return p;
+}
@@ -0,0 +1,38 @@
+#ifndef HNSW_POLICY_H
+#define HNSW_POLICY_H
+
+#include "headers.h"
+
+// Chooses the HNSW parameters of a state's graph from the number of vectors it indexes and the
+// dimension. The fixed policy gives every graph the same parameters (by default the former
+// M = 16, ef_construction = 200). The adaptive policy grows M with log(n), a quarter more from
+// 256 dimensions on, so small states get short link lists and a cheap construction while the
+// huge states near the root get more connectivity.
+class HnswPolicy {
+public:
+    struct Params {
+        int M = 16;
+        int ef_construction = 200;
+        int ef_search = 10; // default search ef of the graph (until VectorMaton::set_ef())
+    };
+
+    bool adaptive = false;
+    Params fixed; // used if !adaptive
+
+    HnswPolicy() {}
+
+    // Parse a comma-separated spec: "fixed" or "adaptive", and for the fixed policy any of
+    // "m=16", "efc=200", "ef=10", e.g. "m=12,efc=100".
+    HnswPolicy(const std::string& spec);
+
+    // Spec string that parses back to this policy (single token, used for persistence).
+    std::string spec() const;
+
+    Params choose(size_t n, int dim) const;
+};
+
+// Number after the first prefix characters of an option token, e.g. 200 in "efc=200" (prefix 4).
+// False, with an error logged, if the rest of the token is not a decimal number that fits.
+bool parse_option_value(const std::string& token, size_t prefix, size_t& value);
+
+#endif
@@ -5,12 +5,57 @@
 #include "post_filtering.h"
 #include "vectormaton.h"
 
-int main(int argc, char * argv[]) {
-    if (argc < 7) {
-        LOG_ERROR("Usage: ./main <string_data_file> <vector_data_file> <string_query_file> <vector_query_file> <k_query_file> <PreFiltering/PostFiltering/VectorMaton-full/VectorMaton-smart> [--debug] [--data-size=N] [--statistics-file=output_statistics.csv] [--load-index=index_files_folder] [--save-index=index_files_folder] [--num-threads=...] [--write-ground-truth=ground_truth.txt] [--set-min-build-threshold=...] [--insert-percentage=...]");
-        return 1;
+// A command line option: --name (value == nullptr), --name=value, or --name with an optional
+// =value (value starting with '['). value is the syntax shown in the usage line.
+struct Option {
+    const char* name;
+    const char* value;
+    std::function<void(const std::string&)> set;
+};
+
+static std::string usage(const std::vector<Option>& options) {
+    std::string res = "Usage: ./main <string_data_file> <vector_data_file> <string_query_file> <vector_query_file> <k_query_file> "
+                      "<PreFiltering/PostFiltering/VectorMaton-full/VectorMaton-smart/VectorMaton-parallel>";
+    for (const auto& option : options) {
+        res += std::string(" [--") + option.name;
+        if (option.value) res += (option.value[0] == '[' ? "" : "=") + std::string(option.value);
+        res += "]";
     }
+    return res;
+}
 
+// Apply the options in argv[1..argc) and remove them, leaving the positional arguments. False
+// (logged) on an unknown option or a missing or unexpected value.
+static bool parse_options(int& argc, char* argv[], const std::vector<Option>& options) {
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.find("--") != 0) {
+            argv[kept++] = argv[i];
+            continue;
+        }
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        auto it = std::find_if(options.begin(), options.end(), [&](const Option& o) { return name == o.name; });
+        if (it == options.end()) {
+            LOG_ERROR("Unknown option ", arg);
+            return false;
+        }
+        if (eq == std::string::npos && it->value && it->value[0] != '[') {
+            LOG_ERROR("Option --", name, " needs a value: --", name, "=", it->value);
+            return false;
+        }
+        if (eq != std::string::npos && !it->value) {
+            LOG_ERROR("Option --", name, " takes no value");
+            return false;
+        }
+        it->set(eq == std::string::npos ? "" : arg.substr(eq + 1));
+    }
+    argc = kept;
+    return true;
+}
+
+int main(int argc, char * argv[]) {
     int data_size = 1000000000; // default: no limit
     std::string statistics_file = "";
     std::string index_in = "";
@@ -19,107 +64,187 @@ int main(int argc, char * argv[]) {
     int num_threads = 8;
     int min_build_threshold = -1;
     float insert_percentage = 0.0;
-    // Parse optional arguments
-    if (argc > 7) {
-        for (int i = 0; i < argc; i++) {
-            if (std::string(argv[i]) == "--debug") {
-                Logger::instance().set_level(Logger::Level::DEBUG);
-                LOG_DEBUG("Debug mode enabled");
-                for (int j = i; j < argc - 1; j++) {
-                    argv[j] = argv[j + 1];
-                }
-                argc--;
-                break;
-            }
-        }
-        for (int i = 0; i < argc; i++) {
-            if (std::string(argv[i]).find("--data-size=") == 0) {
-                data_size = std::stoi(std::string(argv[i]).substr(12));
-                LOG_INFO("Data size limit set to ", data_size);
-                for (int j = i; j < argc - 1; j++) {
-                    argv[j] = argv[j + 1];
-                }
-                argc--;
-                break;
-            }
-        }
-        for (int i = 0; i < argc; i++) {
-            if (std::string(argv[i]).find("--statistics-file=") == 0) {
-                statistics_file = std::string(argv[i]).substr(18);
-                LOG_INFO("Statistics file set to ", statistics_file);
-                for (int j = i; j < argc - 1; j++) {
-                    argv[j] = argv[j + 1];
-                }
-                argc--;
-                break;
-            }
-        }
-        for (int i = 0; i < argc; i++) {
-            if (std::string(argv[i]).find("--load-index=") == 0) {
-                index_in = std::string(argv[i]).substr(13);
-                LOG_INFO("Index files folder (load) set to ", index_in);
-                for (int j = i; j < argc - 1; j++) {
-                    argv[j] = argv[j + 1];
-                }
-                argc--;
-                break;
-            }
-        }
-        for (int i = 0; i < argc; i++) {
-            if (std::string(argv[i]).find("--save-index=") == 0) {
-                index_out = std::string(argv[i]).substr(13);
-                LOG_INFO("Index files folder (save) set to ", index_out);
-                for (int j = i; j < argc - 1; j++) {
-                    argv[j] = argv[j + 1];
-                }
-                argc--;
-                break;
-            }
-        }
-        for (int i = 0; i < argc; i++) {
-            if (std::string(argv[i]).find("--num-threads=") == 0) {
-                auto tmp = std::string(argv[i]).substr(14);
-                num_threads = std::atoi(tmp.c_str());
-                LOG_INFO("Number of threads set to ", num_threads);
-                for (int j = i; j < argc - 1; j++) {
-                    argv[j] = argv[j + 1];
-                }
-                argc--;
-                break;
-            }
-        }
-        for (int i = 0; i < argc; i++) {
-            if (std::string(argv[i]).find("--write-ground-truth=") == 0) {
-                ground_truth_file = std::string(argv[i]).substr(21);
-                LOG_INFO("Ground truth file set to ", ground_truth_file);
-                for (int j = i; j < argc - 1; j++) {
-                    argv[j] = argv[j + 1];
-                }
-                argc--;
-                break;
-            }
-        }
-        for (int i = 0; i < argc; i++) {
-            if (std::string(argv[i]).find("--set-min-build-threshold=") == 0) {
-                auto tmp = std::string(argv[i]).substr(26);
-                min_build_threshold = std::atoi(tmp.c_str());
-                LOG_INFO("Minimum build threshold set to ", min_build_threshold);
-                for (int j = i; j < argc - 1; j++) {
-                    argv[j] = argv[j + 1];
-                }
-                argc--;
-                break;
-            }
+    bool parallel_gsa = false;
+    bool deferred_ids = false;
+    Normalizer normalizer;
+    Tokenizer tokenizer;
+    int max_pattern_length = 0;
+    std::string pattern_index = "gsa";
+    std::string gsa_spill_dir = "";
+    size_t gsa_memory_budget = 1024;
+    int parallel_build_cutoff = -1;
+    int nn_descent_cutoff = 0;
+    int max_fan_in = 1;
+    bool plan_inheritance = false;
+    bool merge_graphs = false;
+    bool derive_graphs = false;
+    double filter_selectivity = 0;
+    std::string query_log = "";
+    int cold_build_threshold = 0;
+    double memory_budget = 0;
+    bool plan_only = false;
+    bool freeze = false;
+    HnswPolicy hnsw_policy;
+    BackendPolicy backend_policy;
+    double latency_target = -1;
+    std::vector<Option> options = {
+        {"debug", nullptr, [&](const std::string&) {
+            Logger::instance().set_level(Logger::Level::DEBUG);
+            LOG_DEBUG("Debug mode enabled");
+        }},
+        {"data-size", "N", [&](const std::string& v) {
+            data_size = std::atoi(v.c_str());
+            LOG_INFO("Data size limit set to ", data_size);
+        }},
+        {"statistics-file", "output_statistics.csv", [&](const std::string& v) {
+            statistics_file = v;
+            LOG_INFO("Statistics file set to ", statistics_file);
+        }},
+        {"load-index", "index_files_folder", [&](const std::string& v) {
+            index_in = v;
+            LOG_INFO("Index files folder (load) set to ", index_in);
+        }},
+        {"save-index", "index_files_folder", [&](const std::string& v) {
+            index_out = v;
+            LOG_INFO("Index files folder (save) set to ", index_out);
+        }},
+        {"num-threads", "N", [&](const std::string& v) {
+            num_threads = std::atoi(v.c_str());
+            LOG_INFO("Number of threads set to ", num_threads);
+        }},
+        {"write-ground-truth", "ground_truth.txt", [&](const std::string& v) {
+            ground_truth_file = v;
+            LOG_INFO("Ground truth file set to ", ground_truth_file);
+        }},
+        {"set-min-build-threshold", "N", [&](const std::string& v) {
+            min_build_threshold = std::atoi(v.c_str());
+            LOG_INFO("Minimum build threshold set to ", min_build_threshold);
+        }},
+        {"insert-percentage", "P", [&](const std::string& v) {
+            insert_percentage = std::atof(v.c_str());
+            LOG_INFO("Insert percentage set to ", insert_percentage);
+        }},
+        {"parallel-gsa", nullptr, [&](const std::string&) {
+            parallel_gsa = true;
+            LOG_INFO("Parallel GSA construction enabled");
+        }},
+        {"deferred-ids", nullptr, [&](const std::string&) {
+            deferred_ids = true;
+            LOG_INFO("Deferred GSA id sets enabled");
+        }},
+        {"normalize", "fold,digits,utf8,drop=none|control|nonalnum|az", [&](const std::string& v) {
+            normalizer = Normalizer(v);
+            LOG_INFO("String normalization set to ", normalizer.spec());
+        }},
+        {"max-pattern-length", "L", [&](const std::string& v) {
+            max_pattern_length = std::atoi(v.c_str());
+            LOG_INFO("Max pattern length set to ", max_pattern_length);
+        }},
+        {"tokenize", "whitespace|identifier", [&](const std::string& v) {
+            tokenizer = Tokenizer(v);
+            LOG_INFO("Tokenization set to ", tokenizer.spec());
+        }},
+        {"pattern-index", "gsa|fm", [&](const std::string& v) {
+            pattern_index = v;
+            LOG_INFO("Pattern index set to ", pattern_index);
+        }},
+        {"gsa-spill-dir", "dir", [&](const std::string& v) {
+            gsa_spill_dir = v;
+            LOG_INFO("External GSA construction, spilling to ", gsa_spill_dir);
+        }},
+        {"gsa-memory-budget", "MB", [&](const std::string& v) {
+            gsa_memory_budget = std::strtoull(v.c_str(), nullptr, 10);
+            LOG_INFO("GSA construction memory budget set to ", gsa_memory_budget, "MB");
+        }},
+        {"parallel-build-cutoff", "N", [&](const std::string& v) {
+            parallel_build_cutoff = std::atoi(v.c_str());
+            LOG_INFO("Parallel graph build cutoff set to ", parallel_build_cutoff);
+        }},
+        {"nn-descent", "N", [&](const std::string& v) {
+            nn_descent_cutoff = std::atoi(v.c_str());
+            LOG_INFO("Graphs of at least ", nn_descent_cutoff, " vectors built by NN-descent");
+        }},
+        {"max-fan-in", "F", [&](const std::string& v) {
+            max_fan_in = std::atoi(v.c_str());
+            LOG_INFO("Maximum number of inherited graphs per state set to ", max_fan_in);
+        }},
+        {"plan-inheritance", nullptr, [&](const std::string&) {
+            plan_inheritance = true;
+            LOG_INFO("Inheritance planning enabled");
+        }},
+        {"merge-graphs", nullptr, [&](const std::string&) {
+            merge_graphs = true;
+            LOG_INFO("Graph merging enabled");
+        }},
+        {"derive-graphs", nullptr, [&](const std::string&) {
+            derive_graphs = true;
+            LOG_INFO("Graphs derived from a global graph");
+        }},
+        {"filter-selectivity", "S", [&](const std::string& v) {
+            filter_selectivity = std::atof(v.c_str());
+            LOG_INFO("States with at least ", filter_selectivity, " of all vectors search the global graph with a filter");
+        }},
+        {"query-log", "patterns.txt", [&](const std::string& v) {
+            query_log = v;
+            LOG_INFO("Query log set to ", query_log);
+        }},
+        {"cold-threshold", "N", [&](const std::string& v) {
+            cold_build_threshold = std::atoi(v.c_str());
+            LOG_INFO("States no logged query reaches build a graph from ", cold_build_threshold, " vectors");
+        }},
+        {"memory-budget", "MB", [&](const std::string& v) {
+            memory_budget = std::atof(v.c_str());
+            LOG_INFO("Index memory budget set to ", memory_budget, "MB");
+        }},
+        {"plan-only", nullptr, [&](const std::string&) {
+            plan_only = true;
+            LOG_INFO("Planning the index only, no graph is built and no query is run");
+        }},
+        {"freeze", nullptr, [&](const std::string&) {
+            freeze = true;
+            LOG_INFO("Graphs are frozen to their compact read-only form before the queries");
+        }},
+        {"hnsw-params", "adaptive|m=M,efc=EF,ef=EF", [&](const std::string& v) {
+            hnsw_policy = HnswPolicy(v);
+            LOG_INFO("HNSW parameter policy set to ", hnsw_policy.spec());
+        }},
+        {"state-index", "flat=N,nsw=N,ivf=N", [&](const std::string& v) {
+            backend_policy = BackendPolicy(v);
+            LOG_INFO("State index backends set to ", backend_policy.spec());
+        }},
+        {"auto-threshold", "[=US]", [&](const std::string& v) {
+            latency_target = v.empty() ? 0 : std::atof(v.c_str());
+            LOG_INFO("Minimum build threshold calibrated at build time, latency target ", latency_target, "us");
+        }},
+    };
+    if (argc < 7) {
+        LOG_ERROR(usage(options));
+        return 1;
+    }
+    if (!parse_options(argc, argv, options)) return 1;
+    if (argc != 7) {
+        LOG_ERROR(usage(options));
+        return 1;
+    }
+    if (pattern_index != "gsa" && pattern_index != "fm") {
+        LOG_ERROR("Unknown pattern index '", pattern_index, "'\n", usage(options));
+        return 1;
+    }
+    if (pattern_index == "fm") {
+        // The FM-index is static and built in one pass, by VectorMaton-full or VectorMaton-smart only
+        if (std::strcmp(argv[argc - 1], "VectorMaton-full") != 0 && std::strcmp(argv[argc - 1], "VectorMaton-smart") != 0) {
+            LOG_ERROR("--pattern-index=fm needs VectorMaton-full or VectorMaton-smart");
+            return 1;
         }
-        for (int i = 0; i < argc; i++) {
-            if (std::string(argv[i]).find("--insert-percentage=") == 0) {
-                insert_percentage = std::stof(std::string(argv[i]).substr(20));
-                LOG_INFO("Insert percentage set to ", insert_percentage);
-                for (int j = i; j < argc - 1; j++) {
-                    argv[j] = argv[j + 1];
-                }
-                argc--;
-                break;
+        std::vector<std::pair<bool, const char*>> gsa_only = {
+            {index_in != "", "load-index"}, {index_out != "", "save-index"}, {insert_percentage > 0, "insert-percentage"},
+            {max_pattern_length > 0, "max-pattern-length"}, {parallel_gsa, "parallel-gsa"}, {deferred_ids, "deferred-ids"},
+            {gsa_spill_dir != "", "gsa-spill-dir"},
+        };
+        for (const auto& option : gsa_only) {
+            if (option.first) {
+                LOG_ERROR("--", option.second, " needs --pattern-index=gsa");
+                return 1;
             }
         }
     }
@@ -129,7 +254,11 @@ int main(int argc, char * argv[]) {
     std::vector<std::string> strings;
     std::ifstream f_strings(argv[1]);
     std::string s;
-    while (f_strings >> s) {
+    // In token mode every line is one string (separators included), otherwise strings are whitespace-separated
+    auto read_string = [&](std::ifstream& f) -> bool {
+        return tokenizer.chars() ? bool(f >> s) : bool(std::getline(f, s));
+    };
+    while (read_string(f_strings)) {
         strings.emplace_back(s);
         if (strings.size() >= data_size) {
             break;
@@ -188,7 +317,7 @@ int main(int argc, char * argv[]) {
     LOG_DEBUG("Query data file (string): ", argv[3]);
     std::vector<std::string> queried_strings;
     std::ifstream f_queried_strings(argv[3]);
-    while (f_queried_strings >> s) {
+    while (read_string(f_queried_strings)) {
         queried_strings.emplace_back(s);
     }
     LOG_DEBUG("Query data file (vector): ", argv[4]);
@@ -224,6 +353,28 @@ int main(int argc, char * argv[]) {
         LOG_DEBUG("Number of query ks: ", queried_k.size());
     }
 
+    if (!tokenizer.chars()) {
+        // Rewrite every string as " t1 t2 ... tn " (normalized tokens), so that the substring semantics
+        // of the baselines and the ground truth coincide with token-sequence matching
+        for (auto& str : strings) str = tokenizer.canonical(str, normalizer);
+        for (auto& str : queried_strings) str = tokenizer.canonical(str, normalizer);
+        LOG_INFO("Tokenized strings into canonical token sequences");
+    }
+    else if (!normalizer.identity()) {
+        // Normalize once up front so that every method, and the ground truth, sees the same strings
+        size_t dropped = 0;
+        std::string normalized;
+        for (auto& str : strings) {
+            dropped += normalizer.apply(str, normalized);
+            str.swap(normalized);
+        }
+        for (auto& str : queried_strings) {
+            normalizer.apply(str, normalized);
+            str.swap(normalized);
+        }
+        LOG_INFO("Normalized strings, dropped ", dropped, " non-indexable characters");
+    }
+
     for (int i = 0; i < queried_vectors.size(); i++) {
         if (queried_vectors[i].size() != vectors[0].size()) {
             LOG_ERROR("Inconsistent query vector dimensions at index ", i, ": expected ", vectors[0].size(), ", got ", queried_vectors[i].size());
@@ -247,6 +398,15 @@ int main(int argc, char * argv[]) {
     }
     vectors = std::vector<std::vector<float>>();
 
+    if (plan_only && std::strncmp(argv[argc - 1], "VectorMaton-", 12) != 0) {
+        LOG_ERROR("--plan-only needs a VectorMaton method");
+        return 1;
+    }
+    if (freeze && std::strncmp(argv[argc - 1], "VectorMaton-", 12) != 0) {
+        LOG_ERROR("--freeze needs a VectorMaton method");
+        return 1;
+    }
+
     std::vector<std::vector<int>> exact_results;
     LOG_INFO("Doing ExactSearch for baseline comparison");
     ExactSearch es;
@@ -254,7 +414,8 @@ int main(int argc, char * argv[]) {
     es.set_strings(strings);
     unsigned long long start_time = currentTime();
     std::vector<std::vector<int>> all_results;
-    for (size_t i = 0; i < queried_strings.size(); ++i) {
+    // The ground truth is not needed to plan an index
+    for (size_t i = 0; i < queried_strings.size() && !plan_only; ++i) {
         auto res = es.query(queried_vectors[i].data(), queried_strings[i], queried_k[i]);
         exact_results.emplace_back(res);
     }
@@ -344,6 +505,8 @@ int main(int argc, char * argv[]) {
         PreFiltering pf;
         pf.set_vectors(base_vectors, dim);
         pf.set_strings(strings);
+        pf.set_normalizer(normalizer);
+        pf.set_tokenizer(tokenizer);
         LOG_INFO("Building PreFiltering index");
         unsigned long long start_time = currentTime();
         pf.build();
@@ -467,10 +630,35 @@ int main(int argc, char * argv[]) {
         VectorMaton vdb;
         vdb.set_vectors(base_vectors, dim);
         vdb.set_strings(strings);
+        if (parallel_gsa) {
+            vdb.set_gsa_threads(num_threads);
+        }
+        vdb.set_deferred_ids(deferred_ids);
+        vdb.set_normalizer(normalizer);
+        vdb.set_tokenizer(tokenizer);
+        vdb.set_max_pattern_length(max_pattern_length);
+        vdb.set_pattern_index(pattern_index);
+        vdb.set_hnsw_policy(hnsw_policy);
+        vdb.set_backend_policy(backend_policy);
+        vdb.set_merge_graphs(merge_graphs);
+        vdb.set_derive_graphs(derive_graphs);
+        vdb.set_filter_selectivity(filter_selectivity);
+        vdb.set_cold_build_threshold(cold_build_threshold);
+        vdb.set_memory_budget(size_t(memory_budget * (1 << 20)));
+        if (query_log != "" && !vdb.load_query_log(query_log)) {
+            LOG_ERROR("Cannot read the query log ", query_log);
+            return 1;
+        }
+        if (gsa_spill_dir != "") {
+            vdb.set_external_gsa(gsa_spill_dir, gsa_memory_budget << 20);
+        }
+        if (plan_only) {
+            return vdb.plan_build(true, num_threads) ? 0 : 1;
+        }
         if (index_in == "") {
             LOG_INFO("Building VectorMaton-full index");
             unsigned long long start_time = currentTime();
-            vdb.build_full();
+            if (!vdb.build_full(num_threads)) return 1;
             LOG_INFO("VectorMaton-full index built took ", timeFormatting(currentTime() - start_time).str());
         }
         else {
@@ -497,6 +685,10 @@ int main(int argc, char * argv[]) {
             }
             LOG_INFO("Insertion took ", timeFormatting(currentTime() - start_time).str());
         }
+        if (freeze) {
+            vdb.freeze();
+            LOG_INFO("Frozen index size: ", vdb.size(), " bytes");
+        }
         LOG_INFO("Processing queries");
         std::vector<std::map<std::string, float>> statistics;
         for (int ef : ef_search) {
@@ -547,14 +739,44 @@ int main(int argc, char * argv[]) {
         VectorMaton vdb;
         vdb.set_vectors(base_vectors, dim);
         vdb.set_strings(strings);
+        if (parallel_gsa) {
+            vdb.set_gsa_threads(num_threads);
+        }
+        vdb.set_deferred_ids(deferred_ids);
+        vdb.set_normalizer(normalizer);
+        vdb.set_tokenizer(tokenizer);
+        vdb.set_max_pattern_length(max_pattern_length);
+        vdb.set_pattern_index(pattern_index);
+        vdb.set_hnsw_policy(hnsw_policy);
+        vdb.set_backend_policy(backend_policy);
+        vdb.set_max_fan_in(max_fan_in);
+        vdb.set_plan_inheritance(plan_inheritance);
+        vdb.set_merge_graphs(merge_graphs);
+        vdb.set_derive_graphs(derive_graphs);
+        vdb.set_filter_selectivity(filter_selectivity);
+        vdb.set_cold_build_threshold(cold_build_threshold);
+        vdb.set_memory_budget(size_t(memory_budget * (1 << 20)));
+        if (query_log != "" && !vdb.load_query_log(query_log)) {
+            LOG_ERROR("Cannot read the query log ", query_log);
+            return 1;
+        }
+        if (gsa_spill_dir != "") {
+            vdb.set_external_gsa(gsa_spill_dir, gsa_memory_budget << 20);
+        }
         if (min_build_threshold > 0) {
             LOG_INFO("Setting minimum build threshold to ", min_build_threshold);
             vdb.set_min_build_threshold(min_build_threshold);
         }
+        if (latency_target >= 0) {
+            vdb.set_auto_threshold(latency_target);
+        }
+        if (plan_only) {
+            return vdb.plan_build(false, num_threads) ? 0 : 1;
+        }
         if (index_in == "") {
             LOG_INFO("Building VectorMaton-smart index");
             unsigned long long start_time = currentTime();
-            vdb.build_smart();
+            if (!vdb.build_smart()) return 1;
             LOG_INFO("VectorMaton-smart index built took ", timeFormatting(currentTime() - start_time).str());
         }
         else {
@@ -581,6 +803,10 @@ int main(int argc, char * argv[]) {
             }
             LOG_INFO("Insertion took ", timeFormatting(currentTime() - start_time).str());
         }
+        if (freeze) {
+            vdb.freeze();
+            LOG_INFO("Frozen index size: ", vdb.size(), " bytes");
+        }
         LOG_INFO("Processing queries");
         std::vector<std::map<std::string, float>> statistics;
         for (int ef : ef_search) {
@@ -631,14 +857,48 @@ int main(int argc, char * argv[]) {
         VectorMaton vdb;
         vdb.set_vectors(base_vectors, dim);
         vdb.set_strings(strings);
+        if (parallel_gsa) {
+            vdb.set_gsa_threads(num_threads);
+        }
+        vdb.set_deferred_ids(deferred_ids);
+        vdb.set_normalizer(normalizer);
+        vdb.set_tokenizer(tokenizer);
+        vdb.set_max_pattern_length(max_pattern_length);
+        vdb.set_pattern_index(pattern_index);
+        vdb.set_hnsw_policy(hnsw_policy);
+        vdb.set_backend_policy(backend_policy);
+        vdb.set_max_fan_in(max_fan_in);
+        vdb.set_plan_inheritance(plan_inheritance);
+        vdb.set_merge_graphs(merge_graphs);
+        vdb.set_derive_graphs(derive_graphs);
+        vdb.set_filter_selectivity(filter_selectivity);
+        vdb.set_cold_build_threshold(cold_build_threshold);
+        vdb.set_memory_budget(size_t(memory_budget * (1 << 20)));
+        if (query_log != "" && !vdb.load_query_log(query_log)) {
+            LOG_ERROR("Cannot read the query log ", query_log);
+            return 1;
+        }
+        if (gsa_spill_dir != "") {
+            vdb.set_external_gsa(gsa_spill_dir, gsa_memory_budget << 20);
+        }
         if (min_build_threshold > 0) {
             LOG_INFO("Setting minimum build threshold to ", min_build_threshold);
             vdb.set_min_build_threshold(min_build_threshold);
         }
+        if (latency_target >= 0) {
+            vdb.set_auto_threshold(latency_target);
+        }
+        if (parallel_build_cutoff >= 0) {
+            vdb.set_parallel_build_cutoff(parallel_build_cutoff);
+        }
+        vdb.set_nn_descent_cutoff(nn_descent_cutoff);
+        if (plan_only) {
+            return vdb.plan_build(false, num_threads) ? 0 : 1;
+        }
         if (index_in == "") {
             LOG_INFO("Building VectorMaton-parallel index");
             unsigned long long start_time = currentTime();
-            vdb.build_parallel(num_threads);
+            if (!vdb.build_parallel(num_threads)) return 1;
             LOG_INFO("VectorMaton-parallel index built took ", timeFormatting(currentTime() - start_time).str());
         }
         else {
@@ -665,6 +925,10 @@ int main(int argc, char * argv[]) {
             }
             LOG_INFO("Insertion took ", timeFormatting(currentTime() - start_time).str());
         }
+        if (freeze) {
+            vdb.freeze();
+            LOG_INFO("Frozen index size: ", vdb.size(), " bytes");
+        }
         LOG_INFO("Processing queries");
         std::vector<std::map<std::string, float>> statistics;
         for (int ef : ef_search) {
@@ -0,0 +1,134 @@
+#include "nn_descent.h"
+#include <random>
+
+void sequential_for(size_t n, const std::function<void(size_t)>& body) {
+    for (size_t i = 0; i < n; i++) body(i);
+}
+
+static inline float l2sqr(const float* a, const float* b, int dim) {
+    float dist = 0;
+    for (int i = 0; i < dim; i++) {
+        float diff = a[i] - b[i];
+        dist += diff * diff;
+    }
+    return dist;
+}
+
+void NNDescent::build(const float* data, int dim, const std::vector<uint32_t>& ids, const ParallelFor& parallel_for) {
+    size_t n = ids.size();
+    degree = n == 0 ? 0 : std::min<size_t>(k, n - 1);
+    graph.assign(n * degree, Neighbor{0, 0, false});
+    iterations = 0;
+    if (degree == 0) return;
+    auto vec = [&](size_t i) { return data + (size_t)ids[i] * dim; };
+
+    if (n <= 4 * (size_t)k) {
+        parallel_for(n, [&](size_t i) {
+            std::vector<Neighbor> all;
+            for (size_t j = 0; j < n; j++) {
+                if (j != i) all.push_back({l2sqr(vec(i), vec(j), dim), (uint32_t)j, false});
+            }
+            std::partial_sort(all.begin(), all.begin() + degree, all.end());
+            std::copy(all.begin(), all.begin() + degree, graph.begin() + i * degree);
+        });
+        return;
+    }
+
+    // Random initial neighbors, every list a max-heap on dist
+    parallel_for(n, [&](size_t i) {
+        std::mt19937 rng(i * 7919 + 17);
+        Neighbor* nb = graph.data() + i * degree;
+        for (int cnt = 0; cnt < degree;) {
+            uint32_t j = rng() % n;
+            if (j == i || std::any_of(nb, nb + cnt, [&](const Neighbor& x) { return x.id == j; })) continue;
+            nb[cnt++] = {l2sqr(vec(i), vec(j), dim), j, true};
+        }
+        std::make_heap(nb, nb + degree);
+    });
+    // bound[i] mirrors the farthest distance in the list of i, so most rejected candidates skip the lock
+    std::vector<std::mutex> locks(n);
+    std::vector<std::atomic<float>> bound(n);
+    for (size_t i = 0; i < n; i++) bound[i].store(graph[i * degree].dist, std::memory_order_relaxed);
+    auto update = [&](uint32_t i, uint32_t j, float d) {
+        if (d >= bound[i].load(std::memory_order_relaxed)) return 0;
+        Neighbor* nb = graph.data() + (size_t)i * degree;
+        std::lock_guard<std::mutex> lock(locks[i]);
+        if (d >= nb[0].dist) return 0;
+        for (int e = 0; e < degree; e++) {
+            if (nb[e].id == j) return 0;
+        }
+        std::pop_heap(nb, nb + degree);
+        nb[degree - 1] = {d, j, true};
+        std::push_heap(nb, nb + degree);
+        bound[i].store(nb[0].dist, std::memory_order_relaxed);
+        return 1;
+    };
+
+    size_t sample = std::max(1, (int)(sample_rate * k));
+    std::vector<std::vector<uint32_t>> fresh(n), old(n), fresh_rev(n), old_rev(n);
+    while (iterations < max_iterations) {
+        iterations++;
+        // The closest sample fresh neighbors of every point become old after this iteration
+        parallel_for(n, [&](size_t i) {
+            fresh[i].clear();
+            old[i].clear();
+            Neighbor* nb = graph.data() + i * degree;
+            std::vector<int> unused;
+            for (int e = 0; e < degree; e++) {
+                if (nb[e].fresh) unused.emplace_back(e);
+                else old[i].emplace_back(nb[e].id);
+            }
+            std::sort(unused.begin(), unused.end(), [&](int a, int b) { return nb[a].dist < nb[b].dist; });
+            if (unused.size() > sample) unused.resize(sample);
+            for (int e : unused) {
+                nb[e].fresh = false;
+                fresh[i].emplace_back(nb[e].id);
+            }
+        });
+        for (size_t i = 0; i < n; i++) {
+            fresh_rev[i].clear();
+            old_rev[i].clear();
+        }
+        for (size_t i = 0; i < n; i++) {
+            for (uint32_t j : fresh[i]) fresh_rev[j].emplace_back(i);
+            for (uint32_t j : old[i]) old_rev[j].emplace_back(i);
+        }
+
+        // Local join: fresh x fresh and fresh x old, in both directions
+        std::atomic<size_t> changes = 0;
+        parallel_for(n, [&](size_t i) {
+            std::mt19937 rng(i * 31 + iterations);
+            std::vector<uint32_t> nw = fresh[i], od = old[i];
+            auto add_sample = [&](std::vector<uint32_t>& out, std::vector<uint32_t> rev) {
+                if (rev.size() > sample) {
+                    std::shuffle(rev.begin(), rev.end(), rng);
+                    rev.resize(sample);
+                }
+                out.insert(out.end(), rev.begin(), rev.end());
+            };
+            add_sample(nw, fresh_rev[i]);
+            add_sample(od, old_rev[i]);
+            std::sort(nw.begin(), nw.end());
+            nw.erase(std::unique(nw.begin(), nw.end()), nw.end());
+            std::sort(od.begin(), od.end());
+            od.erase(std::unique(od.begin(), od.end()), od.end());
+            size_t c = 0;
+            for (size_t x = 0; x < nw.size(); x++) {
+                for (size_t y = x + 1; y < nw.size(); y++) {
+                    float d = l2sqr(vec(nw[x]), vec(nw[y]), dim);
+                    c += update(nw[x], nw[y], d) + update(nw[y], nw[x], d);
+                }
+                for (uint32_t b : od) {
+                    if (b == nw[x]) continue;
+                    float d = l2sqr(vec(nw[x]), vec(b), dim);
+                    c += update(nw[x], b, d) + update(b, nw[x], d);
+                }
+            }
+            changes += c;
+        });
+        if (changes < delta * n * k) break;
+    }
+    parallel_for(n, [&](size_t i) {
+        std::sort(graph.begin() + i * degree, graph.begin() + (i + 1) * degree);
+    });
+}
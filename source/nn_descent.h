@@ -0,0 +1,45 @@
+#ifndef NN_DESCENT_H
+#define NN_DESCENT_H
+
+#include "headers.h"
+
+// Runs body(0), ..., body(n - 1), possibly on several threads.
+using ParallelFor = std::function<void(size_t n, const std::function<void(size_t)>& body)>;
+
+void sequential_for(size_t n, const std::function<void(size_t)>& body);
+
+// Approximate k-nearest-neighbor graph by NN-descent (Dong, Charikar and Li, 2011): every point
+// starts from k random neighbors, then each iteration compares the new neighbors of every point
+// with each other and with its old ones (both directions, sampled), keeping the k closest found.
+// It stops when an iteration changes fewer than delta * n * k entries. Sets of at most 4 k points
+// get their exact neighbors instead.
+class NNDescent {
+public:
+    struct Neighbor {
+        float dist;
+        uint32_t id;  // position in ids
+        bool fresh;   // not yet used in a local join
+        bool operator<(const Neighbor& other) const { return dist < other.dist; }
+    };
+
+    int k;
+    int max_iterations = 12;
+    double sample_rate = 0.5; // new neighbors joined per iteration, as a fraction of k
+    double delta = 0.01;
+    int iterations = 0;       // done by the last build()
+
+    explicit NNDescent(int k) : k(k) {}
+
+    // Neighbors of the points data + ids[i] * dim.
+    void build(const float* data, int dim, const std::vector<uint32_t>& ids, const ParallelFor& parallel_for = sequential_for);
+
+    // The k (or n - 1) neighbors of point i, closest first.
+    const Neighbor* neighbors(size_t i) const { return graph.data() + i * degree; }
+    int num_neighbors() const { return degree; }
+
+private:
+    int degree = 0;               // min(k, n - 1)
+    std::vector<Neighbor> graph;  // degree per point, a max-heap on dist during the build
+};
+
+#endif
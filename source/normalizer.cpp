@@ -0,0 +1,83 @@
+#include "normalizer.h"
+#include <cctype>
+
+Normalizer::Normalizer(const std::string& spec) {
+    std::stringstream ss(spec);
+    std::string token;
+    while (std::getline(ss, token, ',')) {
+        if (token == "") continue;
+        else if (token == "none") drop = DROP_NONE;
+        else if (token == "fold") fold_case = true;
+        else if (token == "digits") map_digits = true;
+        else if (token == "utf8") utf8 = true;
+        else if (token == "drop=none") drop = DROP_NONE;
+        else if (token == "drop=control") drop = DROP_CONTROL;
+        else if (token == "drop=nonalnum") drop = DROP_NON_ALNUM;
+        else if (token == "drop=az") drop = DROP_NON_AZ;
+        else LOG_WARN("Unknown normalization option '", token, "' ignored");
+    }
+}
+
+std::string Normalizer::spec() const {
+    std::vector<std::string> tokens;
+    if (fold_case) tokens.emplace_back("fold");
+    if (map_digits) tokens.emplace_back("digits");
+    if (utf8) tokens.emplace_back("utf8");
+    if (identity()) return "none";
+    if (drop == DROP_NONE) tokens.emplace_back("drop=none");
+    if (drop == DROP_CONTROL) tokens.emplace_back("drop=control");
+    if (drop == DROP_NON_ALNUM) tokens.emplace_back("drop=nonalnum");
+    if (drop == DROP_NON_AZ) tokens.emplace_back("drop=az");
+    std::string res = tokens[0];
+    for (size_t i = 1; i < tokens.size(); i++) res += "," + tokens[i];
+    return res;
+}
+
+bool Normalizer::keep(unsigned char c) const {
+    // c is an ASCII byte here, or the lead byte of a (valid, in utf8 mode) multi-byte sequence
+    switch (drop) {
+        case DROP_NONE:
+            return true;
+        case DROP_CONTROL:
+            return c > ' ' && c != 0x7f;
+        case DROP_NON_ALNUM:
+            return std::isalnum(c) || (c >= 0x80 && utf8);
+        case DROP_NON_AZ:
+            return (c >= 'a' && c <= 'z') || (fold_case && c >= 'A' && c <= 'Z');
+    }
+    return true;
+}
+
+size_t Normalizer::apply(const std::string& s, std::string& out) const {
+    out.clear();
+    out.reserve(s.size());
+    size_t dropped = 0;
+    for (size_t i = 0; i < s.size();) {
+        unsigned char c = s[i];
+        size_t len = 1;
+        if (utf8 && c >= 0x80) {
+            // Length from the lead byte, then check the continuation bytes
+            len = c >= 0xf8 ? 0 : c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc2 ? 2 : 0;
+            bool valid = len > 0 && i + len <= s.size();
+            for (size_t j = 1; valid && j < len; j++) valid = ((unsigned char)s[i + j] & 0xc0) == 0x80;
+            if (!valid) {
+                dropped++, i++;
+                continue;
+            }
+        }
+        if (!keep(c)) {
+            dropped += len, i += len;
+            continue;
+        }
+        if (len == 1) {
+            if (fold_case && c >= 'A' && c <= 'Z') c = c - 'A' + 'a';
+            if (map_digits && c >= '0' && c <= '9') c = '0';
+            out += char(c);
+        }
+        else {
+            out.append(s, i, len);
+        }
+        i += len;
+    }
+    return dropped;
+}
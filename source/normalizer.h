@@ -0,0 +1,43 @@
+#ifndef NORMALIZER_H
+#define NORMALIZER_H
+
+#include "headers.h"
+
+// Per-string normalization applied before a string is indexed or queried.
+// The pipeline is: decode (bytes, or UTF-8 code points if utf8), drop rule, case folding,
+// digit mapping. Every step is idempotent, so normalizing twice is harmless.
+// The default keeps 'a'..'z' only, the alphabet of the original automaton; indexing other
+// bytes is opt-in through another drop rule.
+class Normalizer {
+public:
+    enum Drop {
+        DROP_NONE,      // index every byte
+        DROP_CONTROL,   // drop ASCII control characters (and whitespace)
+        DROP_NON_ALNUM, // keep letters and digits only (non-ASCII code points count as letters in utf8 mode)
+        DROP_NON_AZ     // keep 'a'..'z' only (after case folding)
+    };
+
+    bool fold_case = false;  // ASCII 'A'..'Z' -> 'a'..'z'
+    bool map_digits = false; // every ASCII digit -> '0'
+    bool utf8 = false;       // drop rules see whole code points, malformed sequences are dropped
+    Drop drop = DROP_NON_AZ;
+
+    Normalizer() {}
+
+    // Parse a comma-separated spec, e.g. "fold,digits,utf8,drop=nonalnum", on top of the
+    // defaults. Drop rules: none, control, nonalnum, az (default). "none" is the identity.
+    Normalizer(const std::string& spec);
+
+    // Spec string that parses back to this normalizer (single token, used for persistence).
+    std::string spec() const;
+
+    bool identity() const { return !fold_case && !map_digits && !utf8 && drop == DROP_NONE; }
+
+    // Normalize s into out. Returns the number of dropped bytes.
+    size_t apply(const std::string& s, std::string& out) const;
+
+private:
+    bool keep(unsigned char c) const;
+};
+
+#endif
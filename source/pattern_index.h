@@ -0,0 +1,35 @@
+#ifndef PATTERN_INDEX_H
+#define PATTERN_INDEX_H
+
+#include "headers.h"
+#include "posting_list.h"
+
+// What VectorMaton needs from a substring index: every occurring pattern maps to a state, and
+// all patterns of a state occur in the same strings. The successors of a state are states of
+// longer patterns that extend its patterns, so their id sets are subsets of its id set.
+// Implemented by GeneralizedSuffixAutomaton and FMIndex.
+class PatternIndex {
+public:
+    virtual ~PatternIndex() {}
+
+    // States are numbered 0..num_states()-1.
+    virtual int num_states() const = 0;
+
+    // State of pattern p, -1 if p does not occur.
+    virtual int query(const std::string &p) const = 0;
+
+    // Sorted ids of the strings containing the patterns of state v. The index may hand over
+    // (and drop) its own copy, so call it once per state.
+    virtual PostingList take_ids(int v) = 0;
+
+    // Append the successors of state v to out.
+    virtual void successors(int v, std::vector<int> &out) const = 0;
+
+    // All states, every state after all of its successors.
+    virtual std::vector<int> build_order() const = 0;
+
+    // Bytes used by the index structure (not counting id sets handed over by take_ids()).
+    virtual size_t size_bytes() const = 0;
+};
+
+#endif
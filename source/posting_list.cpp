@@ -0,0 +1,376 @@
+#include "posting_list.h"
+#include <array>
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Unpack 128 B-bit values stored in 4 interleaved 32-bit lanes: value i lives in lane i % 4,
+// and lane l is the bit stream in[l], in[l + 4], in[l + 8], ...
+template <int B>
+void unpack(const uint32_t* in, uint32_t* out) {
+#ifdef __SSE2__
+    if (B == 0) {
+        __m128i zero = _mm_setzero_si128();
+        for (int j = 0; j < 32; j++) _mm_store_si128((__m128i*)out + j, zero);
+        return;
+    }
+    const __m128i mask = _mm_set1_epi32(B == 32 ? 0xffffffffu : (1u << (B % 32)) - 1);
+    const __m128i* pin = (const __m128i*)in;
+    __m128i w = _mm_loadu_si128(pin++);
+    int shift = 0;
+    for (int j = 0; j < 32; j++) {
+        __m128i v = _mm_srli_epi32(w, shift);
+        if (shift + B >= 32) {
+            if (j < 31 || shift + B > 32) w = _mm_loadu_si128(pin++);
+            if (shift + B > 32) v = _mm_or_si128(v, _mm_slli_epi32(w, 32 - shift));
+            shift = shift + B - 32;
+        }
+        else {
+            shift += B;
+        }
+        _mm_store_si128((__m128i*)out + j, _mm_and_si128(v, mask));
+    }
+#else
+    const uint32_t mask = B == 32 ? 0xffffffffu : (1u << (B % 32)) - 1;
+    for (int l = 0; l < 4; l++) {
+        for (int j = 0; j < 32; j++) {
+            if (B == 0) { out[4 * j + l] = 0; continue; }
+            int bit = j * B, word = bit / 32, shift = bit % 32;
+            uint64_t v = in[4 * word + l] >> shift;
+            if (shift + B > 32) v |= uint64_t(in[4 * (word + 1) + l]) << (32 - shift);
+            out[4 * j + l] = uint32_t(v) & mask;
+        }
+    }
+#endif
+}
+
+typedef void (*UnpackFn)(const uint32_t*, uint32_t*);
+
+template <size_t... Bs>
+constexpr std::array<UnpackFn, sizeof...(Bs)> make_unpack_table(std::index_sequence<Bs...>) {
+    return {{&unpack<int(Bs)>...}};
+}
+
+const std::array<UnpackFn, 33> kUnpack = make_unpack_table(std::make_index_sequence<33>());
+
+// Turn (delta - 1) values into ids: out[i] = first + i + (enc[1] + ... + enc[i]), enc[0] = 0.
+void prefix_sum(uint32_t first, uint32_t* out) {
+#ifdef __SSE2__
+    __m128i carry = _mm_set1_epi32(first);
+    __m128i step = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i four = _mm_set1_epi32(4);
+    for (int j = 0; j < PostingList::kBlock / 4; j++) {
+        __m128i x = _mm_load_si128((__m128i*)out + j);
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi32(x, carry);
+        carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+        _mm_store_si128((__m128i*)out + j, _mm_add_epi32(x, step));
+        step = _mm_add_epi32(step, four);
+    }
+#else
+    uint32_t sum = first;
+    for (int i = 0; i < PostingList::kBlock; i++) {
+        sum += out[i];
+        out[i] = sum + i;
+    }
+#endif
+}
+
+} // namespace
+
+PostingList::PostingList(const std::vector<uint32_t>& sorted_ids) : PostingList() {
+    for (auto id : sorted_ids) push_back(id);
+    shrink_to_fit();
+}
+
+PostingList::PostingList(const PostingList& other) : PostingList() {
+    n_ = other.n_, last_ = other.last_, bitmap_ = other.bitmap_;
+    resize(other.len_, false);
+    std::copy(other.data(), other.data() + len_, data());
+}
+
+PostingList::PostingList(PostingList&& other) noexcept : PostingList() {
+    std::swap(n_, other.n_), std::swap(last_, other.last_), std::swap(len_, other.len_);
+    cap_ = other.cap_, bitmap_ = other.bitmap_;
+    if (cap_) heap_ = other.heap_;
+    else std::copy(other.inline_, other.inline_ + kInline, inline_);
+    other.cap_ = 0, other.bitmap_ = 0;
+}
+
+PostingList& PostingList::operator=(PostingList other) noexcept {
+    // other is a copy (or the moved-from list), so swapping leaves it to free the old buffer
+    std::swap(n_, other.n_), std::swap(last_, other.last_), std::swap(len_, other.len_);
+    uint32_t cap = cap_, bitmap = bitmap_;
+    cap_ = other.cap_, bitmap_ = other.bitmap_;
+    other.cap_ = cap, other.bitmap_ = bitmap;
+    uint32_t words[kInline];
+    static_assert(sizeof(words) == sizeof(heap_), "inline ids must fill the pointer");
+    std::memcpy(words, inline_, sizeof(words));
+    std::memcpy(inline_, other.inline_, sizeof(words));
+    std::memcpy(other.inline_, words, sizeof(words));
+    return *this;
+}
+
+void PostingList::release() {
+    if (cap_) delete[] heap_;
+    cap_ = 0;
+}
+
+void PostingList::resize(size_t len, bool grow) {
+    size_t cap = cap_ ? cap_ : kInline;
+    if (len > cap) {
+        size_t new_cap = grow ? std::max(len, 2 * cap) : len;
+        uint32_t* buf = new uint32_t[new_cap];
+        std::copy(data(), data() + len_, buf);
+        release();
+        heap_ = buf, cap_ = new_cap;
+    }
+    if (len > len_) std::fill(data() + len_, data() + len, 0);
+    len_ = len;
+}
+
+void PostingList::shrink_to_fit() {
+    if (!cap_ || cap_ == len_) return;
+    if (len_ <= kInline) {
+        uint32_t* buf = heap_;
+        cap_ = 0;
+        std::copy(buf, buf + len_, inline_);
+        delete[] buf;
+        return;
+    }
+    uint32_t* buf = new uint32_t[len_];
+    std::copy(heap_, heap_ + len_, buf);
+    delete[] heap_;
+    heap_ = buf, cap_ = len_;
+}
+
+void PostingList::push_back(uint32_t id) {
+    if (is_bitmap()) {
+        size_t word = (id - data()[0]) / 32 + 1;
+        if (word >= len_) resize(word + 1);
+        data()[word] |= 1u << ((id - data()[0]) % 32);
+    }
+    else {
+        resize(len_ + 1);
+        data()[len_ - 1] = id;
+        if (n_ + 1 - packed() == kBlock) {
+            n_++, last_ = id;
+            flush_tail();
+            return;
+        }
+    }
+    n_++, last_ = id;
+}
+
+void PostingList::flush_tail() {
+    // The last kBlock words are raw ids: encode them as one block in place
+    uint32_t vals[kBlock];
+    std::copy(data() + len_ - kBlock, data() + len_, vals);
+    size_t start = len_ - kBlock;
+    uint32_t max_enc = 0;
+    for (int i = 1; i < kBlock; i++) max_enc |= vals[i] - vals[i - 1] - 1;
+    int b = max_enc == 0 ? 0 : 32 - __builtin_clz(max_enc);
+    len_ = start;
+    resize(start + 2 + 4 * b);
+    uint32_t* buf = data();
+    buf[start] = vals[0];
+    buf[start + 1] = b;
+    uint32_t* out = buf + start + 2;
+    for (int i = 1; i < kBlock && b > 0; i++) {
+        uint32_t enc = vals[i] - vals[i - 1] - 1;
+        int lane = i % 4, j = i / 4;
+        int bit = j * b, word = bit / 32, shift = bit % 32;
+        out[4 * word + lane] |= enc << shift;
+        if (shift + b > 32) out[4 * (word + 1) + lane] |= enc >> (32 - shift);
+    }
+
+    // Switch to a bitmap when it is the smaller representation
+    size_t bitmap_words = (last_ >> 5) - (buf[0] >> 5) + 2;
+    if (bitmap_words < len_) to_bitmap();
+}
+
+void PostingList::to_bitmap() {
+    if (n_ == 0 || is_bitmap()) return;
+    std::vector<uint32_t> ids = decode();
+    uint32_t base = ids[0] & ~31u;
+    release();
+    len_ = 0;
+    resize(((last_ - base) >> 5) + 2, false);
+    uint32_t* bitmap = data();
+    bitmap[0] = base;
+    for (auto id : ids) bitmap[(id - base) / 32 + 1] |= 1u << ((id - base) % 32);
+    bitmap_ = 1;
+}
+
+bool PostingList::contains(uint32_t id) const {
+    if (n_ == 0 || id > last_) return false;
+    const uint32_t* buf = data();
+    if (is_bitmap()) {
+        if (id < buf[0]) return false;
+        return (buf[(id - buf[0]) / 32 + 1] >> ((id - buf[0]) % 32)) & 1;
+    }
+    size_t pos = 0;
+    for (uint32_t done = 0; done < packed(); done += kBlock) {
+        size_t next = pos + 2 + 4 * buf[pos + 1];
+        // The block holds id if the first id after it (next block or tail) is larger
+        if (next == len_ || buf[next] > id) {
+            if (id < buf[pos]) return false;
+            alignas(16) uint32_t block[kBlock];
+            decode_block(buf + pos, block);
+            return std::binary_search(block, block + kBlock, id);
+        }
+        pos = next;
+    }
+    return std::binary_search(buf + pos, buf + len_, id);
+}
+
+void PostingList::clear() {
+    release();
+    n_ = last_ = len_ = 0;
+    bitmap_ = 0;
+}
+
+size_t PostingList::size_bytes() const {
+    return sizeof(uint32_t) * cap_;
+}
+
+std::vector<uint32_t> PostingList::decode() const {
+    std::vector<uint32_t> ids;
+    ids.reserve(n_);
+    for_each([&](uint32_t id) { ids.emplace_back(id); });
+    return ids;
+}
+
+size_t PostingList::decode_block(const uint32_t* in, uint32_t* out) {
+    uint32_t first = in[0];
+    int b = in[1];
+    kUnpack[b](in + 2, out);
+    out[0] = 0;
+    prefix_sum(first, out);
+    return 2 + 4 * b;
+}
+
+bool PostingList::Reader::next(uint32_t& id) {
+    if (buf_idx_ < buf_len_) {
+        id = buf_[buf_idx_++];
+        return true;
+    }
+    const uint32_t* buf = list_.data();
+    if (list_.is_bitmap()) {
+        while (bits_ == 0) {
+            if (word_ >= list_.len_) return false;
+            bits_ = buf[word_++];
+        }
+        id = buf[0] + uint32_t(word_ - 2) * 32 + __builtin_ctz(bits_);
+        bits_ &= bits_ - 1;
+        return true;
+    }
+    if (done_ < list_.packed()) {
+        pos_ += decode_block(buf + pos_, buf_);
+        done_ += kBlock;
+        buf_len_ = kBlock, buf_idx_ = 1;
+        id = buf_[0];
+        return true;
+    }
+    if (pos_ < list_.len_) {
+        id = buf[pos_++];
+        return true;
+    }
+    return false;
+}
+
+bool PostingList::Reader::next_geq(uint32_t target, uint32_t& id) {
+    if (list_.is_bitmap()) {
+        while (next(id)) {
+            if (id >= target) return true;
+        }
+        return false;
+    }
+    if (buf_idx_ < buf_len_ && buf_[buf_len_ - 1] >= target) {
+        buf_idx_ = std::lower_bound(buf_ + buf_idx_, buf_ + buf_len_, target) - buf_;
+        return next(id);
+    }
+    buf_idx_ = buf_len_ = 0;
+    const uint32_t* buf = list_.data();
+    while (done_ < list_.packed()) {
+        // Skip the block if the first id after it (next block or tail) is still <= target
+        size_t next_pos = pos_ + 2 + 4 * buf[pos_ + 1];
+        if (next_pos == list_.len_ || buf[next_pos] > target) break;
+        pos_ = next_pos;
+        done_ += kBlock;
+    }
+    if (done_ < list_.packed()) {
+        pos_ += decode_block(buf + pos_, buf_);
+        done_ += kBlock;
+        buf_len_ = kBlock;
+        buf_idx_ = std::lower_bound(buf_, buf_ + kBlock, target) - buf_;
+        return next(id);
+    }
+    pos_ = std::lower_bound(buf + pos_, buf + list_.len_, target) - buf;
+    return next(id);
+}
+
+PostingList PostingList::merge(const PostingList& a, const PostingList& b) {
+    if (a.empty()) return b;
+    if (b.empty()) return a;
+    PostingList res;
+    Reader ra(a), rb(b);
+    uint32_t x, y;
+    bool has_x = ra.next(x), has_y = rb.next(y);
+    while (has_x || has_y) {
+        if (!has_y || (has_x && x < y)) {
+            res.push_back(x), has_x = ra.next(x);
+        }
+        else if (!has_x || y < x) {
+            res.push_back(y), has_y = rb.next(y);
+        }
+        else {
+            res.push_back(x), has_x = ra.next(x), has_y = rb.next(y);
+        }
+    }
+    res.shrink_to_fit();
+    return res;
+}
+
+PostingList PostingList::difference(const PostingList& a, const PostingList& b) {
+    if (a.empty() || b.empty() || b.last_ < a.data()[0]) return a; // word 0 is <= every id of a
+    PostingList res;
+    if (b.is_bitmap()) {
+        a.for_each([&](uint32_t x) {
+            if (!b.contains(x)) res.push_back(x);
+        });
+        res.shrink_to_fit();
+        return res;
+    }
+    Reader ra(a), rb(b);
+    uint32_t x, y;
+    bool has_x = ra.next(x), has_y = rb.next(y);
+    while (has_x) {
+        if (has_y && y < x) has_y = rb.next_geq(x, y);
+        if (!has_y || y != x) res.push_back(x);
+        has_x = ra.next(x);
+    }
+    res.shrink_to_fit();
+    return res;
+}
+
+uint64_t PostingList::hash() const {
+    // FNV-1a over the ids, seeded with their number
+    uint64_t h = 14695981039346656037ULL ^ n_;
+    for_each([&](uint32_t id) { h = (h ^ id) * 1099511628211ULL; });
+    return h;
+}
+
+bool PostingList::operator==(const PostingList& other) const {
+    if (n_ != other.n_ || last_ != other.last_) return false;
+    Reader ra(*this), rb(other);
+    uint32_t x, y;
+    while (ra.next(x)) {
+        if (!rb.next(y) || x != y) return false;
+    }
+    return true;
+}
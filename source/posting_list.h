@@ -0,0 +1,126 @@
+#ifndef POSTING_LIST_H
+#define POSTING_LIST_H
+
+#include "headers.h"
+
+// Sorted set of uint32 ids in compressed form. Ids must be appended in increasing order.
+// Every kBlock appended ids are delta-coded and bit-packed into one block (4 interleaved
+// lanes, as in SIMD-BP128, so that a block decodes with SSE2 shifts and a vector prefix sum);
+// the last < kBlock ids stay uncompressed so that appending is cheap. A list whose ids are
+// dense switches to a bitmap once the bitmap is smaller than its packed blocks. Encodings of
+// up to kInline words (lists of one or two ids) are held in the object itself, without a heap
+// buffer; most states of a suffix automaton over distinct strings have such lists.
+class PostingList {
+public:
+    static const int kBlock = 128;
+    static const int kInline = 2;
+
+    PostingList() : cap_(0), bitmap_(0) {}
+    PostingList(const std::vector<uint32_t>& sorted_ids);
+    PostingList(const PostingList& other);
+    PostingList(PostingList&& other) noexcept;
+    PostingList& operator=(PostingList other) noexcept;
+    ~PostingList() { release(); }
+
+    void push_back(uint32_t id);
+    uint32_t back() const { return last_; }
+    size_t size() const { return n_; }
+    bool empty() const { return n_ == 0; }
+    bool is_bitmap() const { return bitmap_; }
+
+    // Remove all ids and release memory.
+    void clear();
+
+    // Release the spare capacity left by appending, e.g. once a list is complete.
+    void shrink_to_fit();
+
+    // Whether id is in the list: O(1) in bitmap mode, else one block decode after skipping the
+    // blocks by their first ids.
+    bool contains(uint32_t id) const;
+
+    // Switch to bitmap mode whatever its size, e.g. for lists probed by contains().
+    void to_bitmap();
+
+    // Heap bytes used by the encoded ids (0 for inline lists).
+    size_t size_bytes() const;
+
+    // Decompress all ids.
+    std::vector<uint32_t> decode() const;
+
+    // Call f(id) for every id in increasing order.
+    template <typename F>
+    void for_each(F&& f) const {
+        const uint32_t* buf = data();
+        if (is_bitmap()) {
+            uint32_t base = buf[0];
+            for (size_t w = 1; w < len_; w++) {
+                uint32_t bits = buf[w];
+                while (bits) {
+                    f(base + uint32_t(w - 1) * 32 + __builtin_ctz(bits));
+                    bits &= bits - 1;
+                }
+            }
+            return;
+        }
+        alignas(16) uint32_t block[kBlock];
+        size_t pos = 0;
+        for (uint32_t done = 0; done < packed(); done += kBlock) {
+            pos += decode_block(buf + pos, block);
+            for (int j = 0; j < kBlock; j++) f(block[j]);
+        }
+        for (; pos < len_; pos++) f(buf[pos]);
+    }
+
+    // Streaming decoder, one block at a time (used by merge/difference).
+    class Reader {
+    public:
+        Reader(const PostingList& list) : list_(list) {}
+        bool next(uint32_t& id);
+        // Move to the first id >= target, skipping whole packed blocks by their first ids.
+        bool next_geq(uint32_t target, uint32_t& id);
+
+    private:
+        const PostingList& list_;
+        size_t pos_ = 0, word_ = 1;
+        uint32_t done_ = 0, bits_ = 0;
+        int buf_len_ = 0, buf_idx_ = 0;
+        alignas(16) uint32_t buf_[kBlock];
+    };
+
+    // a ∪ b
+    static PostingList merge(const PostingList& a, const PostingList& b);
+
+    // a \ b (ids of a are looked up in b directly when b is a bitmap)
+    static PostingList difference(const PostingList& a, const PostingList& b);
+
+    bool operator==(const PostingList& other) const;
+    bool operator!=(const PostingList& other) const { return !(*this == other); }
+
+    // Hash of the ids (not of their encoding), e.g. to find equal lists.
+    uint64_t hash() const;
+
+private:
+    uint32_t n_ = 0, last_ = 0;
+    uint32_t len_ = 0; // words of the encoding
+    uint32_t cap_ : 31, bitmap_ : 1; // cap_ = words of the heap buffer, 0 while inline
+    // Packed blocks followed by the uncompressed tail, or (bitmap mode) base id + bitmap words.
+    // A packed block is: first id, bit width B, then 4 * B words of packed (delta - 1) values.
+    union {
+        uint32_t* heap_;
+        uint32_t inline_[kInline];
+    };
+
+    uint32_t* data() { return cap_ ? heap_ : inline_; }
+    const uint32_t* data() const { return cap_ ? heap_ : inline_; }
+    // Number of ids held in packed blocks (blocks are always full, the tail is shorter)
+    uint32_t packed() const { return n_ - n_ % kBlock; }
+    // Set the number of words to len, zero-filling new words; grows geometrically if grow.
+    void resize(size_t len, bool grow = true);
+    void release();
+    void flush_tail();
+
+    // Decode one packed block into out[kBlock], returns the number of words consumed.
+    static size_t decode_block(const uint32_t* in, uint32_t* out);
+};
+
+#endif
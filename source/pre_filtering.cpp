@@ -3,9 +3,16 @@
 void PreFiltering::build_gsa() {
     LOG_DEBUG("Building Generalized Suffix Automaton (GSA)");
     unsigned long long start_time = currentTime();
+    // Build the structure first, then compute all id sets in one pass over the suffix-link tree
+    gsa.set_deferred_ids(true);
     for (int i = 0; i < num_elements; i++) {
         gsa.add_string(i, strs[i]);
     }
+    gsa.propagate_ids();
+    gsa.freeze();
+    if (gsa.dropped_chars > 0) {
+        LOG_INFO("Normalizer '", gsa.normalizer.spec(), "' dropped ", gsa.dropped_chars, " non-indexable characters");
+    }
     LOG_DEBUG("GSA built in ", timeFormatting(currentTime() - start_time).str());
     LOG_DEBUG("Total GSA states: ", std::to_string(gsa.size()), ", total string IDs in GSA: ", std::to_string(gsa.size_tot()));
 
@@ -29,6 +36,14 @@ void PreFiltering::set_strings(const std::vector<std::string>& strings) {
     strs = strings;
 }
 
+void PreFiltering::set_normalizer(const Normalizer& normalizer) {
+    gsa.normalizer = normalizer;
+}
+
+void PreFiltering::set_tokenizer(const Tokenizer& tokenizer) {
+    gsa.tokenizer = tokenizer;
+}
+
 void PreFiltering::build() {
     build_gsa();
 }
@@ -47,7 +62,7 @@ size_t PreFiltering::size() {
     for (int i = 0; i < num_elements; i++) {
         total_size += sizeof(std::string) + strs[i].capacity(); // size of each string
         total_size += sizeof(float) * dim; // size of each vector
-        total_size += sizeof(uint32_t) * gsa.st[i].ids.capacity(); // size of each GSA state's id vector
+        total_size += gsa.st[i].ids.size_bytes(); // size of each GSA state's id list
     }
     return total_size;
 }
@@ -56,9 +71,9 @@ std::vector<int> PreFiltering::query(const float* vec, const std::string &s, int
     int i = gsa.query(s);
     if (i == -1) return {};
     std::vector<int> results;
-    for (const auto& id : gsa.st[i].ids) {
+    gsa.st[i].ids.for_each([&](uint32_t id) {
         results.push_back(id);
-    }
+    });
     std::sort(results.begin(), results.end(), [&](int a, int b) {
         return distance(vecs.data() + a * dim, vec, dim) < distance(vecs.data() + b * dim, vec, dim);
     });
@@ -17,6 +17,8 @@ class PreFiltering {
 
         void set_vectors(const std::vector<float>& vectors, int dimension);
         void set_strings(const std::vector<std::string>& strings);
+        void set_normalizer(const Normalizer& normalizer);
+        void set_tokenizer(const Tokenizer& tokenizer);
         void build();
         void insert(const std::vector<float>& vec, const std::string& str);
         size_t size();
@@ -18,16 +18,31 @@ GeneralizedSuffixAutomaton::GeneralizedSuffixAutomaton(char* input_file) {
         int m, k;
         f >> st[i].len >> st[i].link >> m >> k;
         for (int j = 0; j < m; j++) {
-            int x, y;
+            long long x;
+            int y;
             f >> x >> y;
-            st[i].next[char(x)] = y;
+            st[i].next[x < 0 ? Symbol(x & 0xff) : Symbol(x)] = y; // older dumps wrote signed chars
         }
-        st[i].ids.resize(k);
         for (int j = 0; j < k; j++) {
-            f >> st[i].ids[j];
+            uint32_t id;
+            f >> id;
+            st[i].ids.push_back(id);
+        }
+    }
+    // Optional trailer (absent in older dumps)
+    std::string key, value;
+    while (f >> key >> value) {
+        if (key == "normalizer") normalizer = Normalizer(value);
+        else if (key == "max_pattern_length") max_pattern_length = std::stoi(value);
+        else if (key == "tokenizer") tokenizer = Tokenizer(value);
+        else if (key == "vocab") {
+            std::vector<std::string> vocab(std::stoul(value));
+            for (auto& token : vocab) f >> token;
+            tokenizer.set_vocab(vocab);
         }
     }
     f.close();
+    last = 0;
 }
 
 GeneralizedSuffixAutomaton::~GeneralizedSuffixAutomaton() {
@@ -40,13 +55,20 @@ int GeneralizedSuffixAutomaton::size() {
 }
 
 void GeneralizedSuffixAutomaton::clear() {
+    frozen = false, ordered = false;
+    prune_states = kMinPruneStates;
+    dropped_chars = 0;
+    symbol_of.clear(), alphabet_size = 0;
+    set_deferred_ids(false);
+    edge_begin.clear(), edge_label.clear(), edge_target.clear();
+    dense_row.clear(), dense_next.clear();
     st.clear();
     st.emplace_back();
     st[0].link = -1;
     last = 0;
 }
 
-void GeneralizedSuffixAutomaton::sa_extend(char c, uint32_t id) {
+void GeneralizedSuffixAutomaton::sa_extend(Symbol c, uint32_t id) {
     if (st[last].next.count(c)) {
         int x = st[last].next[c];
         if (st[x].len == st[last].len + 1) {
@@ -61,9 +83,7 @@ void GeneralizedSuffixAutomaton::sa_extend(char c, uint32_t id) {
                 st[cur].next[e.first] = e.second; // copy map
             }
             st[cur].link = st[x].link;
-            for (auto old_id : st[x].ids) { // copy ids
-                st[cur].ids.emplace_back(old_id);
-            }
+            if (!deferred_ids) st[cur].ids = st[x].ids; // copy ids
             affected_states.emplace_back(cur);
             int p = last;
             while (p != -1 && st[p].next[c] == x) {
@@ -75,9 +95,13 @@ void GeneralizedSuffixAutomaton::sa_extend(char c, uint32_t id) {
         }
 
         // Propagate IDs
+        if (deferred_ids) {
+            id_marks.emplace_back(last, id);
+            return;
+        }
         int p = last;
         while (p != -1) {
-            if (st[p].ids.empty() || st[p].ids.back() != id) st[p].ids.emplace_back(id), affected_states.emplace_back(p); else break;
+            if (st[p].ids.empty() || st[p].ids.back() != id) st[p].ids.push_back(id), affected_states.emplace_back(p); else break;
             p = st[p].link;
         }
         return;
@@ -106,9 +130,7 @@ void GeneralizedSuffixAutomaton::sa_extend(char c, uint32_t id) {
                 st[clone].next[e.first] = e.second; // copy map
             }
             st[clone].link = st[q].link;
-            for (auto old_id : st[q].ids) { // copy ids
-                st[clone].ids.emplace_back(old_id);
-            }
+            if (!deferred_ids) st[clone].ids = st[q].ids; // copy ids
 
             while (p != -1 && st[p].next[c] == q) {
                 st[p].next[c] = clone;
@@ -119,42 +141,770 @@ void GeneralizedSuffixAutomaton::sa_extend(char c, uint32_t id) {
     }
 
     last = cur;
+    if (deferred_ids) {
+        id_marks.emplace_back(last, id);
+        return;
+    }
     p = last;
     while (p != -1) {
-        if (st[p].ids.empty() || st[p].ids.back() != id) st[p].ids.emplace_back(id), affected_states.emplace_back(p); else break;
+        if (st[p].ids.empty() || st[p].ids.back() != id) st[p].ids.push_back(id), affected_states.emplace_back(p); else break;
         p = st[p].link;
     }
 }
 
 void GeneralizedSuffixAutomaton::add_string(uint32_t id, const std::string &s) {
+    std::vector<Symbol> symbols;
+    encode_new(s, symbols);
+    add_symbols(id, symbols);
+}
+
+void GeneralizedSuffixAutomaton::add_symbols(uint32_t id, const std::vector<Symbol> &s) {
     // We'll add characters of s by extending the automaton while resetting 'last' at the start
     // so the string is added as a separate sequence (avoiding cross-string suffixes).
+    if (frozen) thaw();
+    if (max_pattern_length > 0 && st.size() >= prune_states) prune();
     last = 0;
-    st[0].ids.emplace_back(id);
     affected_states.clear();
+    if (deferred_ids) id_marks.emplace_back(0, id); else st[0].ids.push_back(id);
     affected_states.emplace_back(0);
-    for (char c : s) {
-        if (c >= 'a' && c <= 'z') {
-            sa_extend(c, id);
+    for (Symbol c : s) {
+        sa_extend(c, id);
+    }
+}
+
+void GeneralizedSuffixAutomaton::prune() {
+    // Same rule as freeze(): links of kept states are shorter, so they are kept too
+    int n = st.size(), kept = 0;
+    std::vector<int> new_id(n, -1);
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || st[st[i].link].len < max_pattern_length) new_id[i] = kept++;
+    }
+    if (!id_marks.empty()) {
+        // Resolve dropped states to their nearest kept ancestor, shorter states first
+        int max_len = 0;
+        for (int i = 0; i < n; i++) max_len = std::max(max_len, st[i].len);
+        std::vector<int> cnt(max_len + 2, 0), order(n);
+        for (int i = 0; i < n; i++) cnt[st[i].len + 1]++;
+        for (int l = 0; l <= max_len; l++) cnt[l + 1] += cnt[l];
+        for (int i = 0; i < n; i++) order[cnt[st[i].len]++] = i;
+        std::vector<int> target(new_id);
+        for (int v : order) {
+            if (target[v] == -1) target[v] = target[st[v].link];
+        }
+        for (auto& m : id_marks) m.first = target[m.first];
+    }
+    // new_id[i] <= i, so kept states move down in place
+    for (int i = 0; i < n; i++) {
+        if (new_id[i] == -1) continue;
+        auto& next = st[i].next;
+        for (auto it = next.begin(); it != next.end();) {
+            if (new_id[it->second] == -1) it = next.erase(it);
+            else it->second = new_id[it->second], ++it;
+        }
+        if (st[i].link != -1) st[i].link = new_id[st[i].link];
+        if (new_id[i] != i) st[new_id[i]] = std::move(st[i]);
+    }
+    st.resize(kept);
+    last = 0;
+    affected_states.clear();
+    prune_states = std::max(kMinPruneStates, 2 * st.size());
+    LOG_DEBUG("Pruned ", n - kept, " GSA states longer than max_pattern_length=", max_pattern_length, " during construction");
+}
+
+void GeneralizedSuffixAutomaton::encode_new(const std::string &s, std::vector<Symbol> &out) {
+    dropped_chars += tokenizer.encode_new(s, normalizer, out);
+}
+
+std::vector<GeneralizedSuffixAutomaton::Symbol> GeneralizedSuffixAutomaton::encode(const std::string &s) const {
+    std::vector<Symbol> out;
+    tokenizer.encode(s, normalizer, out);
+    return out;
+}
+
+void GeneralizedSuffixAutomaton::freeze(bool renumber) {
+    if (frozen && (!renumber || ordered)) return;
+    int n = st.size();
+    std::vector<int> new_id(n), old_of(n);
+    std::iota(new_id.begin(), new_id.end(), 0);
+    std::iota(old_of.begin(), old_of.end(), 0);
+    std::vector<char> kept_state(n, 1);
+    if (renumber) {
+        // With max_pattern_length, drop states whose shortest string is too long. Their links
+        // and the states on the way to them are shorter, so what is kept stays closed.
+        std::vector<char> keep(n, 1);
+        if (max_pattern_length > 0) {
+            for (int i = 1; i < n; i++) keep[i] = st[st[i].link].len < max_pattern_length;
+        }
+        // BFS discovery order, then a stable counting sort by len. Transitions always
+        // increase len, so the result is a topological order with state 0 kept first.
+        std::vector<int> bfs;
+        std::vector<char> seen(n, 0);
+        bfs.reserve(n);
+        bfs.emplace_back(0);
+        seen[0] = 1;
+        for (size_t h = 0; h < bfs.size(); h++) {
+            for_each_next(bfs[h], [&](Symbol, int u) {
+                if (!seen[u] && keep[u]) seen[u] = 1, bfs.emplace_back(u);
+            });
+        }
+        for (int i = 0; i < n; i++) {
+            if (!seen[i] && keep[i]) bfs.emplace_back(i); // unreachable states (should not happen)
+        }
+        int max_len = 0;
+        for (int i = 0; i < n; i++) max_len = std::max(max_len, st[i].len);
+        std::vector<int> cnt(max_len + 2, 0);
+        for (int v : bfs) cnt[st[v].len + 1]++;
+        for (int l = 0; l <= max_len; l++) cnt[l + 1] += cnt[l];
+        std::fill(new_id.begin(), new_id.end(), -1);
+        for (int v : bfs) new_id[v] = cnt[st[v].len]++;
+
+        int kept = bfs.size();
+        old_of.resize(kept);
+        for (int i = 0; i < n; i++) {
+            kept_state[i] = new_id[i] != -1;
+            if (new_id[i] != -1) old_of[new_id[i]] = i;
+        }
+        if (kept < n) {
+            // Anything pointing at a dropped state moves to its nearest kept suffix-link ancestor
+            std::vector<int> order(n);
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&](int u, int v) { return st[u].len < st[v].len; });
+            for (int v : order) {
+                if (new_id[v] == -1) new_id[v] = new_id[st[v].link];
+            }
+            LOG_DEBUG("Dropped ", n - kept, " GSA states longer than max_pattern_length=", max_pattern_length);
+        }
+        last = new_id[last];
+        for (auto& s : affected_states) s = new_id[s];
+        affected_states.erase(std::unique(affected_states.begin(), affected_states.end()), affected_states.end());
+        for (auto& m : id_marks) m.first = new_id[m.first];
+
+        // Move the states to their new positions in place (dropped ones past the end)
+        std::vector<int> pos(n);
+        for (int i = 0, extra = kept; i < n; i++) {
+            if (kept_state[i] && st[i].link != -1) st[i].link = new_id[st[i].link];
+            pos[i] = kept_state[i] ? new_id[i] : extra++;
+        }
+        for (int i = 0; i < n; i++) {
+            while (pos[i] != i) {
+                int j = pos[i];
+                std::swap(st[i], st[j]);
+                std::swap(pos[i], pos[j]);
+            }
+        }
+    }
+    int kept = old_of.size();
+
+    // Sorted edge lists in the new numbering, read from the hash maps or from the current CSR arrays
+    std::vector<int> begin(kept + 1, 0), target;
+    LabelArray label;
+    std::vector<std::pair<Symbol, int>> edges;
+    size_t num_edges = 0;
+    for (int v = 0; v < kept; v++) num_edges += out_degree(frozen ? old_of[v] : v);
+    label.reserve(num_edges);
+    target.reserve(num_edges);
+    for (int v = 0; v < kept; v++) {
+        int i = frozen ? old_of[v] : v; // hash maps moved with their states, CSR rows did not
+        edges.clear();
+        for_each_next(i, [&](Symbol c, int u) {
+            if (kept_state[u]) edges.emplace_back(c, new_id[u]);
+        });
+        if (!frozen) {
+            std::sort(edges.begin(), edges.end());
+            std::unordered_map<Symbol, int>().swap(st[i].next);
+        }
+        for (const auto& e : edges) label.push_back(e.first), target.emplace_back(e.second);
+        begin[v + 1] = label.size();
+    }
+    st.resize(kept);
+    for (auto& s : st) s.ids.shrink_to_fit(); // id lists are complete until the next insertion
+    edge_begin.swap(begin);
+    edge_label.swap(label);
+    edge_target.swap(target);
+    frozen = true;
+    ordered = renumber;
+    prune_states = SIZE_MAX; // state ids may be referenced from now on
+    build_dense_rows();
+}
+
+void GeneralizedSuffixAutomaton::build_dense_rows() {
+    // Remap the symbols that actually label transitions to 0..alphabet_size-1
+    int n = st.size();
+    Symbol max_symbol = 0;
+    for (size_t e = 0; e < edge_label.size(); e++) max_symbol = std::max(max_symbol, edge_label[e]);
+    symbol_of.assign(size_t(max_symbol) + 1, -1);
+    for (size_t e = 0; e < edge_label.size(); e++) symbol_of[edge_label[e]] = 0;
+    alphabet_size = 0;
+    for (size_t c = 0; c < symbol_of.size(); c++) {
+        if (symbol_of[c] != -1) symbol_of[c] = alphabet_size++;
+    }
+    bool use_dense = alphabet_size <= kMaxDenseAlphabet;
+    if (!use_dense) std::vector<int>().swap(symbol_of);
+
+    dense_row.assign(n, -1);
+    dense_next.clear();
+    if (!use_dense) return;
+    for (int i = 0; i < n; i++) {
+        if (edge_begin[i + 1] - edge_begin[i] < kDenseDegree) continue;
+        dense_row[i] = dense_next.size() / alphabet_size;
+        dense_next.resize(dense_next.size() + alphabet_size, -1);
+        for (int e = edge_begin[i]; e < edge_begin[i + 1]; e++) {
+            dense_next[dense_row[i] * alphabet_size + symbol_of[edge_label[e]]] = edge_target[e];
+        }
+    }
+}
+
+void GeneralizedSuffixAutomaton::set_deferred_ids(bool deferred) {
+    deferred_ids = deferred;
+    if (!deferred) {
+        std::vector<std::pair<int, uint32_t>>().swap(id_marks);
+        std::vector<int>().swap(dfs_in), std::vector<int>().swap(dfs_out), std::vector<int>().swap(mark_begin);
+        std::vector<uint32_t>().swap(mark_ids);
+    }
+}
+
+void GeneralizedSuffixAutomaton::propagate_ids() {
+    if (!deferred_ids) return;
+    int n = st.size();
+    // Marks grouped by state, and the suffix-link tree as child lists
+    std::vector<int> mark_start(n + 1, 0), child_start(n + 1, 0);
+    for (auto& m : id_marks) mark_start[m.first + 1]++;
+    for (int i = 1; i < n; i++) child_start[st[i].link + 1]++;
+    for (int i = 0; i < n; i++) mark_start[i + 1] += mark_start[i], child_start[i + 1] += child_start[i];
+    std::vector<uint32_t> marks(id_marks.size());
+    std::vector<int> children(std::max(0, n - 1));
+    {
+        std::vector<int> pos(mark_start.begin(), mark_start.end() - 1);
+        for (auto& m : id_marks) marks[pos[m.first]++] = m.second;
+        pos.assign(child_start.begin(), child_start.end() - 1);
+        for (int i = 1; i < n; i++) children[pos[st[i].link]++] = i;
+    }
+    std::vector<std::pair<int, uint32_t>>().swap(id_marks);
+
+    // Children have larger len than their link, so decreasing len is a bottom-up order
+    int max_len = 0;
+    for (int i = 0; i < n; i++) max_len = std::max(max_len, st[i].len);
+    std::vector<int> cnt(max_len + 2, 0), order(n);
+    for (int i = 0; i < n; i++) cnt[st[i].len + 1]++;
+    for (int l = 0; l <= max_len; l++) cnt[l + 1] += cnt[l];
+    for (int i = 0; i < n; i++) order[cnt[st[i].len]++] = i;
+
+    uint32_t max_id = 0;
+    for (auto id : marks) max_id = std::max(max_id, id);
+    std::vector<int> last_seen(marks.empty() ? 0 : size_t(max_id) + 1, -1); // last state an id was collected for
+    std::vector<uint32_t> ids;
+    for (int t = n - 1; t >= 0; t--) {
+        int v = order[t];
+        ids.clear();
+        auto collect = [&](uint32_t id) {
+            if (last_seen[id] != v) last_seen[id] = v, ids.emplace_back(id);
+        };
+        for (int j = mark_start[v]; j < mark_start[v + 1]; j++) collect(marks[j]);
+        for (int j = child_start[v]; j < child_start[v + 1]; j++) st[children[j]].ids.for_each(collect);
+        std::sort(ids.begin(), ids.end());
+        st[v].ids = PostingList(ids);
+    }
+    set_deferred_ids(false);
+}
+
+void GeneralizedSuffixAutomaton::index_ids() {
+    int n = st.size();
+    std::vector<int> child_start(n + 1, 0), children(std::max(0, n - 1));
+    for (int i = 1; i < n; i++) child_start[st[i].link + 1]++;
+    for (int i = 0; i < n; i++) child_start[i + 1] += child_start[i];
+    {
+        std::vector<int> pos(child_start.begin(), child_start.end() - 1);
+        for (int i = 1; i < n; i++) children[pos[st[i].link]++] = i;
+    }
+    // Iterative DFS over the suffix-link tree
+    dfs_in.assign(n, 0), dfs_out.assign(n, 0);
+    std::vector<std::pair<int, int>> stack = {{0, child_start[0]}};
+    int timer = 0;
+    dfs_in[0] = timer++;
+    while (!stack.empty()) {
+        auto& [v, j] = stack.back();
+        if (j < child_start[v + 1]) {
+            int u = children[j++];
+            dfs_in[u] = timer++;
+            stack.emplace_back(u, child_start[u]);
         }
         else {
-            LOG_WARN("Non-alphabetic character '", c, "' in the ", id, "-th string: did you pre-process data correctly?");
+            dfs_out[v] = timer;
+            stack.pop_back();
+        }
+    }
+    mark_begin.assign(n + 1, 0);
+    for (auto& m : id_marks) mark_begin[dfs_in[m.first] + 1]++;
+    for (int i = 0; i < n; i++) mark_begin[i + 1] += mark_begin[i];
+    mark_ids.resize(id_marks.size());
+    std::vector<int> pos(mark_begin.begin(), mark_begin.end() - 1);
+    for (auto& m : id_marks) mark_ids[pos[dfs_in[m.first]]++] = m.second;
+}
+
+PostingList GeneralizedSuffixAutomaton::materialize_ids(int v) const {
+    std::vector<uint32_t> ids(mark_ids.begin() + mark_begin[dfs_in[v]], mark_ids.begin() + mark_begin[dfs_out[v]]);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    return PostingList(ids);
+}
+
+void GeneralizedSuffixAutomaton::thaw() {
+    if (!frozen) return;
+    for (int i = 0; i < st.size(); i++) {
+        for (int e = edge_begin[i]; e < edge_begin[i + 1]; e++) {
+            st[i].next[edge_label[e]] = edge_target[e];
+        }
+    }
+    std::vector<int>().swap(edge_begin);
+    edge_label.clear();
+    std::vector<int>().swap(edge_target);
+    std::vector<int>().swap(dense_row);
+    std::vector<int>().swap(dense_next);
+    std::vector<int>().swap(symbol_of);
+    alphabet_size = 0;
+    frozen = false;
+}
+
+int GeneralizedSuffixAutomaton::next_state(int v, Symbol c) const {
+    if (!frozen) {
+        auto it = st[v].next.find(c);
+        return it == st[v].next.end() ? -1 : it->second;
+    }
+    if (dense_row[v] != -1) {
+        int sym = c < symbol_of.size() ? symbol_of[c] : -1;
+        return sym == -1 ? -1 : dense_next[dense_row[v] * alphabet_size + sym];
+    }
+    if (edge_begin[v + 1] - edge_begin[v] > 2 * kDenseDegree) {
+        // Large token alphabets: binary search
+        int lo = edge_begin[v], hi = edge_begin[v + 1];
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (edge_label[mid] < c) lo = mid + 1; else hi = mid;
+        }
+        return lo < edge_begin[v + 1] && edge_label[lo] == c ? edge_target[lo] : -1;
+    }
+    // Few edges: a linear scan over the sorted labels stays within one or two cache lines
+    for (int e = edge_begin[v]; e < edge_begin[v + 1]; e++) {
+        if (edge_label[e] == c) return edge_target[e];
+        if (edge_label[e] > c) break;
+    }
+    return -1;
+}
+
+void GeneralizedSuffixAutomaton::LabelArray::push_back(Symbol c) {
+    int width = c < (1u << 8) ? 1 : c < (1u << 16) ? 2 : 4;
+    if (width > width_) {
+        // Re-encode the labels so far in the wider width
+        std::vector<uint8_t> wider(size_ * width);
+        for (size_t i = 0; i < size_; i++) {
+            Symbol old = (*this)[i];
+            std::memcpy(wider.data() + i * width, &old, width); // little-endian
         }
+        bytes_.swap(wider);
+        width_ = width;
+    }
+    bytes_.resize(bytes_.size() + width_);
+    std::memcpy(bytes_.data() + size_ * width_, &c, width_);
+    size_++;
+}
+
+int GeneralizedSuffixAutomaton::out_degree(int v) const {
+    return frozen ? edge_begin[v + 1] - edge_begin[v] : st[v].next.size();
+}
+
+void GeneralizedSuffixAutomaton::build_parallel(const std::vector<std::string>& strs, int num_threads, int n) {
+    if (n < 0) n = strs.size();
+    int num_shards = std::max(1, std::min(num_threads, n));
+    std::vector<std::vector<Symbol>> encoded;
+    if (!tokenizer.chars()) {
+        // Token ids must agree across shards: encode everything with the shared dictionary first
+        encoded.resize(n);
+        for (int i = 0; i < n; i++) encode_new(strs[i], encoded[i]);
+    }
+    std::vector<std::unique_ptr<GeneralizedSuffixAutomaton>> shards(num_shards);
+    #pragma omp parallel for num_threads(num_threads) schedule(dynamic)
+    for (int t = 0; t < num_shards; t++) {
+        int lo = (long long)n * t / num_shards, hi = (long long)n * (t + 1) / num_shards;
+        shards[t] = std::make_unique<GeneralizedSuffixAutomaton>();
+        shards[t]->set_deferred_ids(deferred_ids);
+        shards[t]->normalizer = normalizer;
+        // Shards keep every state (merge() needs complete automata), freeze() prunes the result
+        for (int i = lo; i < hi; i++) {
+            if (encoded.empty()) shards[t]->add_string(i, strs[i]); else shards[t]->add_symbols(i, encoded[i]);
+        }
+        shards[t]->freeze(false);
+    }
+    for (auto& shard : shards) dropped_chars += shard->dropped_chars;
+    LOG_DEBUG("Built ", num_shards, " GSA shards, merging");
+
+    // Pairwise merge rounds, shards stay ordered by id range
+    while (shards.size() > 1) {
+        int num_pairs = shards.size() / 2;
+        std::vector<std::unique_ptr<GeneralizedSuffixAutomaton>> merged(num_pairs + shards.size() % 2);
+        #pragma omp parallel for num_threads(num_threads) schedule(dynamic)
+        for (int t = 0; t < num_pairs; t++) {
+            merged[t] = std::make_unique<GeneralizedSuffixAutomaton>();
+            merged[t]->merge(*shards[2 * t], *shards[2 * t + 1]);
+            shards[2 * t].reset();
+            shards[2 * t + 1].reset();
+        }
+        if (shards.size() % 2) merged.back() = std::move(shards.back());
+        shards.swap(merged);
+    }
+    take(*shards[0]);
+    shards.clear();
+
+    // Shard marks refer to shard states: re-derive them by walking every string in the result
+    if (deferred_ids) mark_strings(strs, n, num_threads, encoded);
+}
+
+bool GeneralizedSuffixAutomaton::build_external(const std::vector<std::string>& strs, size_t memory_budget, const std::string& spill_dir, int n) {
+    namespace fs = std::filesystem;
+    if (n < 0) n = strs.size();
+    std::error_code error;
+    fs::create_directories(spill_dir, error);
+    if (error) {
+        LOG_ERROR("Cannot create the GSA spill directory ", spill_dir, ": ", error.message());
+        return false;
+    }
+    // Chunks are built with hash-map transitions (~kBuildBytesPerSymbol bytes per symbol), then
+    // frozen and spilled
+    size_t chunk_symbols = std::max<size_t>(1, memory_budget / kBuildBytesPerSymbol);
+    std::vector<std::string> files;
+    std::vector<Symbol> encoded;
+    for (int lo = 0; lo < n;) {
+        GeneralizedSuffixAutomaton chunk;
+        chunk.set_deferred_ids(true);
+        size_t symbols = 0;
+        int hi = lo;
+        while (hi < n && (hi == lo || symbols < chunk_symbols)) {
+            encode_new(strs[hi], encoded); // token ids come from the shared dictionary
+            chunk.add_symbols(hi, encoded);
+            chunk.id_marks.clear();
+            symbols += encoded.size() + 1;
+            hi++;
+        }
+        chunk.freeze(false);
+        files.emplace_back((fs::path(spill_dir) / ("gsa_chunk" + std::to_string(files.size()) + ".bin")).string());
+        if (!chunk.write_structure(files.back())) return false;
+        LOG_DEBUG("GSA chunk ", files.size(), ": strings [", lo, ", ", hi, "), ", chunk.size(), " states spilled to ", files.back());
+        lo = hi;
+    }
+
+    // Pairwise merge rounds over the spilled chunks, keeping them ordered by id range. Each merge
+    // reads the transitions of its two inputs and streams its result back to disk.
+    int round = 0;
+    while (files.size() > 1) {
+        std::vector<std::string> merged;
+        for (size_t t = 0; t + 1 < files.size(); t += 2) {
+            GeneralizedSuffixAutomaton a, b;
+            if (!a.read_structure(files[t], false) || !b.read_structure(files[t + 1], false)) return false;
+            merged.emplace_back((fs::path(spill_dir) / ("gsa_merge" + std::to_string(round) + "_" + std::to_string(t / 2) + ".bin")).string());
+            if (!merge_to_file(a, b, merged.back())) return false;
+            fs::remove(files[t], error);
+            fs::remove(files[t + 1], error);
+        }
+        if (files.size() % 2) merged.emplace_back(files.back());
+        files.swap(merged);
+        round++;
+    }
+    if (files.size() == 1) {
+        if (!read_structure(files[0])) return false;
+        fs::remove(files[0], error);
+    }
+    last = 0;
+    affected_states.clear();
+    LOG_DEBUG("External GSA build merged ", round, " rounds, ", st.size(), " states");
+
+    // Ids were not kept in the chunks: derive them from the final automaton
+    bool eager = !deferred_ids;
+    set_deferred_ids(true);
+    mark_strings(strs, n, 1, {});
+    if (eager) propagate_ids();
+    return true;
+}
+
+void GeneralizedSuffixAutomaton::mark_strings(const std::vector<std::string>& strs, int n, int num_threads, const std::vector<std::vector<Symbol>>& encoded) {
+    // Record (state, id) for the root and every prefix end of every string, as add_string does in deferred mode
+    int num_parts = std::max(1, std::min(num_threads, n));
+    std::vector<std::vector<std::pair<int, uint32_t>>> marks(num_parts);
+    #pragma omp parallel for num_threads(num_threads) schedule(dynamic)
+    for (int t = 0; t < num_parts; t++) {
+        int lo = (long long)n * t / num_parts, hi = (long long)n * (t + 1) / num_parts;
+        for (int i = lo; i < hi; i++) {
+            marks[t].emplace_back(0, i);
+            int v = 0;
+            for (Symbol c : encoded.empty() ? encode(strs[i]) : encoded[i]) {
+                v = next_state(v, c);
+                marks[t].emplace_back(v, i);
+            }
+        }
+    }
+    id_marks.clear();
+    for (auto& m : marks) {
+        id_marks.insert(id_marks.end(), m.begin(), m.end());
+        std::vector<std::pair<int, uint32_t>>().swap(m);
+    }
+}
+
+void GeneralizedSuffixAutomaton::take(GeneralizedSuffixAutomaton& other) {
+    st.swap(other.st);
+    edge_begin.swap(other.edge_begin);
+    edge_label.swap(other.edge_label);
+    edge_target.swap(other.edge_target);
+    dense_row.swap(other.dense_row);
+    dense_next.swap(other.dense_next);
+    symbol_of.swap(other.symbol_of);
+    alphabet_size = other.alphabet_size;
+    frozen = other.frozen;
+    ordered = other.ordered;
+    last = 0;
+    affected_states.clear();
+}
+
+namespace {
+// Header of a spill file. It is followed by one record per state: len and link (if with_states),
+// the out-degree, then the labels (width bytes each) and targets of the state's edges.
+struct SpillHeader {
+    int n = 0, edges = 0, width = 1, with_states = 0;
+};
+}
+
+bool GeneralizedSuffixAutomaton::write_structure(const std::string& path) const {
+    std::ofstream f(path, std::ios::binary);
+    int n = st.size(), width = edge_label.width();
+    SpillHeader h{n, edge_begin[n], width, 1};
+    f.write((const char*)&h, sizeof(h));
+    for (int v = 0; v < n && f; v++) {
+        int record[3] = {st[v].len, st[v].link, out_degree(v)};
+        f.write((const char*)record, sizeof(record));
+        f.write((const char*)edge_label.data() + size_t(width) * edge_begin[v], width * record[2]);
+        f.write((const char*)(edge_target.data() + edge_begin[v]), sizeof(int) * record[2]);
+    }
+    f.close();
+    if (!f) {
+        LOG_ERROR("Failed to write GSA structure to ", path);
+        return false;
+    }
+    return true;
+}
+
+bool GeneralizedSuffixAutomaton::read_structure(const std::string& path, bool with_states) {
+    std::ifstream f(path, std::ios::binary);
+    SpillHeader h;
+    f.read((char*)&h, sizeof(h));
+    bool ok = f && h.n > 0 && h.edges >= 0 && (h.width == 1 || h.width == 2 || h.width == 4);
+    if (ok) {
+        st.assign(with_states ? h.n : 0, State());
+        edge_begin.assign(h.n + 1, 0);
+        edge_label.resize(h.edges, h.width);
+        edge_target.resize(h.edges);
+    }
+    for (int v = 0, e = 0; ok && v < h.n; v++) {
+        int record[3] = {0, -1, 0}; // len, link, out-degree
+        if (h.with_states) f.read((char*)record, sizeof(int) * 2);
+        f.read((char*)(record + 2), sizeof(int));
+        ok = f && record[2] >= 0 && record[2] <= h.edges - e;
+        if (!ok) break;
+        f.read((char*)edge_label.data() + size_t(h.width) * e, h.width * record[2]);
+        f.read((char*)(edge_target.data() + e), sizeof(int) * record[2]);
+        if (with_states) st[v].len = record[0], st[v].link = record[1];
+        e += record[2];
+        edge_begin[v + 1] = e;
+        ok = f && (v + 1 < h.n || e == h.edges);
+    }
+    if (!ok) {
+        LOG_ERROR("Failed to read GSA structure from ", path);
+        return false;
+    }
+    frozen = true;
+    ordered = false;
+    if (with_states) {
+        build_dense_rows();
+        if (!h.with_states) derive_links();
+    }
+    return true;
+}
+
+template <class Emit>
+int GeneralizedSuffixAutomaton::merge_pairs(const GeneralizedSuffixAutomaton& a, const GeneralizedSuffixAutomaton& b, Emit emit) {
+    // States of the merged automaton are the reachable pairs (state in a, state in b), -1 meaning
+    // "does not occur": two strings share an endpos set in the union iff they share one in each part.
+    // Pair ids live in an open-addressing table (key 0 is never used) kept at most half full.
+    int size_a = a.edge_begin.size() - 1, size_b = b.edge_begin.size() - 1;
+    std::vector<uint64_t> keys(16);
+    std::vector<int> values(16);
+    while (keys.size() < 2 * size_t(size_a + size_b)) keys.resize(keys.size() * 2);
+    values.resize(keys.size());
+    std::vector<std::pair<int, int>> pairs;
+    auto slot = [&](uint64_t key) {
+        size_t mask = keys.size() - 1, h = (key * 0x9E3779B97F4A7C15ULL >> 20) & mask;
+        while (keys[h] != 0 && keys[h] != key) h = (h + 1) & mask;
+        return h;
+    };
+    auto get_id = [&](int x, int y) {
+        uint64_t key = (uint64_t(uint32_t(x + 1)) << 32) | uint32_t(y + 1);
+        size_t h = slot(key);
+        if (keys[h] == key) return values[h];
+        int id = pairs.size();
+        keys[h] = key, values[h] = id;
+        pairs.emplace_back(x, y);
+        if (2 * pairs.size() > keys.size()) {
+            std::vector<uint64_t> old_keys(keys.size() * 2, 0);
+            std::vector<int> old_values(values.size() * 2);
+            old_keys.swap(keys), old_values.swap(values);
+            for (size_t i = 0; i < old_keys.size(); i++) {
+                if (old_keys[i] == 0) continue;
+                size_t g = slot(old_keys[i]);
+                keys[g] = old_keys[i], values[g] = old_values[i];
+            }
+        }
+        return id;
+    };
+    std::vector<Symbol> labels;
+    std::vector<int> targets;
+    get_id(0, 0);
+    for (size_t u = 0; u < pairs.size(); u++) {
+        auto [x, y] = pairs[u];
+        labels.clear();
+        targets.clear();
+        // Union of the sorted edge lists of x and y
+        int i = x == -1 ? 0 : a.edge_begin[x], i_end = x == -1 ? 0 : a.edge_begin[x + 1];
+        int j = y == -1 ? 0 : b.edge_begin[y], j_end = y == -1 ? 0 : b.edge_begin[y + 1];
+        while (i < i_end || j < j_end) {
+            Symbol c;
+            int tx = -1, ty = -1;
+            if (j == j_end || (i < i_end && a.edge_label[i] < b.edge_label[j])) {
+                c = a.edge_label[i], tx = a.edge_target[i++];
+            }
+            else if (i == i_end || b.edge_label[j] < a.edge_label[i]) {
+                c = b.edge_label[j], ty = b.edge_target[j++];
+            }
+            else {
+                c = a.edge_label[i], tx = a.edge_target[i++], ty = b.edge_target[j++];
+            }
+            labels.emplace_back(c);
+            targets.emplace_back(get_id(tx, ty));
+        }
+        emit(x, y, labels, targets);
+    }
+    return pairs.size();
+}
+
+void GeneralizedSuffixAutomaton::merge(const GeneralizedSuffixAutomaton& a, const GeneralizedSuffixAutomaton& b) {
+    st.clear();
+    st.reserve(a.edge_begin.size() + b.edge_begin.size() - 2);
+    edge_begin.assign(1, 0);
+    edge_label.clear();
+    edge_target.clear();
+    merge_pairs(a, b, [&](int x, int y, const std::vector<Symbol>& labels, const std::vector<int>& targets) {
+        st.emplace_back();
+        for (Symbol c : labels) edge_label.push_back(c);
+        edge_target.insert(edge_target.end(), targets.begin(), targets.end());
+        edge_begin.emplace_back(edge_label.size());
+        // ids of a come first, so concatenation keeps them sorted
+        if (x != -1 && !a.st.empty()) st.back().ids = a.st[x].ids;
+        if (y != -1 && !b.st.empty()) b.st[y].ids.for_each([&](uint32_t id) { st.back().ids.push_back(id); });
+    });
+    // The result is written directly in the frozen layout (in discovery order)
+    frozen = true;
+    ordered = false;
+    build_dense_rows();
+    derive_links();
+    last = 0;
+}
+
+bool GeneralizedSuffixAutomaton::merge_to_file(const GeneralizedSuffixAutomaton& a, const GeneralizedSuffixAutomaton& b, const std::string& path) {
+    std::ofstream f(path, std::ios::binary);
+    SpillHeader h;
+    h.width = std::max(a.edge_label.width(), b.edge_label.width());
+    f.write((const char*)&h, sizeof(h)); // rewritten once the counts are known
+    std::vector<uint8_t> bytes;
+    h.n = merge_pairs(a, b, [&](int, int, const std::vector<Symbol>& labels, const std::vector<int>& targets) {
+        int degree = labels.size();
+        bytes.resize(size_t(h.width) * degree);
+        for (int i = 0; i < degree; i++) std::memcpy(bytes.data() + size_t(h.width) * i, &labels[i], h.width); // little-endian
+        f.write((const char*)&degree, sizeof(degree));
+        f.write((const char*)bytes.data(), bytes.size());
+        f.write((const char*)targets.data(), sizeof(int) * degree);
+        h.edges += degree;
+    });
+    f.seekp(0);
+    f.write((const char*)&h, sizeof(h));
+    f.close();
+    if (!f) {
+        LOG_ERROR("Failed to write merged GSA structure to ", path);
+        return false;
+    }
+    return true;
+}
+
+void GeneralizedSuffixAutomaton::derive_links() {
+    int n = st.size();
+    // len = longest path from the root; remember the parent on that path (the "solid" edge)
+    std::vector<int> solid_parent(n, -1), in_degree(n, 0);
+    std::vector<Symbol> solid_char(n, 0);
+    for (int v : edge_target) in_degree[v]++;
+    std::vector<int> order = {0};
+    for (size_t h = 0; h < order.size(); h++) {
+        int u = order[h];
+        for_each_next(u, [&](Symbol c, int v) {
+            if (st[u].len + 1 > st[v].len) {
+                st[v].len = st[u].len + 1, solid_parent[v] = u, solid_char[v] = c;
+            }
+            if (--in_degree[v] == 0) order.emplace_back(v);
+        });
+    }
+
+    // Suffix links in len order: walk the links of the solid parent like sa_extend does
+    std::sort(order.begin(), order.end(), [&](int u, int v) { return st[u].len < st[v].len; });
+    st[0].link = -1;
+    for (int v : order) {
+        if (v == 0) continue;
+        Symbol c = solid_char[v];
+        int q = st[solid_parent[v]].link;
+        while (q != -1 && next_state(q, c) == v) q = st[q].link;
+        st[v].link = q == -1 ? 0 : next_state(q, c);
     }
 }
 
 int GeneralizedSuffixAutomaton::query(const std::string &p) const {
+    return query(encode(p));
+}
+
+int GeneralizedSuffixAutomaton::query(const std::vector<Symbol> &p) const {
+    if (max_pattern_length > 0 && p.size() > max_pattern_length) return -1;
     int v = 0;
-    for (char c : p) {
-        auto it = st[v].next.find(c);
-        if (it == st[v].next.end()) return -1;
-        v = it->second;
+    for (Symbol c : p) {
+        v = next_state(v, c);
+        if (v == -1) return -1;
     }
     // v is the state representing all end positions of strings that contain p
     // return its stored IDs
     return v;
 }
 
+size_t GeneralizedSuffixAutomaton::size_bytes() const {
+    size_t sa_size = 0;
+    for (auto& s : st) {
+        sa_size += s.next.bucket_count() * sizeof(void*);
+        sa_size += (sizeof(std::pair<Symbol, int>) + sizeof(void*)) * s.next.size(); // size of adjacency map
+        sa_size += sizeof(s.len) + sizeof(s.link); // size of len and link
+    }
+    sa_size += sizeof(int) * (edge_begin.size() + edge_target.size() + dense_row.size() + dense_next.size() + symbol_of.size());
+    sa_size += edge_label.size_bytes();
+    for (const auto& token : tokenizer.vocab) sa_size += sizeof(std::string) + token.capacity();
+    return sa_size;
+}
+
+size_t GeneralizedSuffixAutomaton::ids_bytes() const {
+    size_t ids_size = 0;
+    for (auto& s : st) {
+        ids_size += s.ids.size_bytes();
+    }
+    return ids_size;
+}
+
 int GeneralizedSuffixAutomaton::size_tot() {
     int tot_size = 0;
     for (size_t i = 0; i < st.size(); ++i) {
@@ -169,15 +919,18 @@ void GeneralizedSuffixAutomaton::print() const {
         const auto &state = st[i];
         std::cout << "State " << i << ": len=" << state.len << ", link=" << state.link << "\n";
         std::cout << "  transitions: ";
-        for (const auto &t : state.next) {
-            std::cout << "'" << t.first << "'->" << t.second << "  ";
-        }
+        for_each_next(i, [&](Symbol c, int v) {
+            if (tokenizer.chars()) std::cout << "'" << char(c) << "'->" << v << "  ";
+            else std::cout << "'" << (c < tokenizer.vocab.size() ? tokenizer.vocab[c] : "?") << "'->" << v << "  ";
+        });
         std::cout << "\n";
         std::cout << "  ids: {";
-        for (size_t j = 0; j < state.ids.size(); ++j) {
-            std::cout << state.ids[j];
-            if (j + 1 < state.ids.size()) std::cout << ", ";
-        }
+        bool first = true;
+        state.ids.for_each([&](uint32_t id) {
+            if (!first) std::cout << ", ";
+            std::cout << id;
+            first = false;
+        });
         std::cout << "}\n";
     }
 }
@@ -193,9 +946,9 @@ std::vector<GeneralizedSuffixAutomaton::Statistics> GeneralizedSuffixAutomaton::
             stats.emplace_back();
         }
         stats[depth].sizes.push_back(static_cast<int>(st[state_id].ids.size()));
-        for (const auto &t : st[state_id].next) {
-            q.emplace(t.second, depth + 1);
-        }
+        for_each_next(state_id, [&](Symbol, int v) {
+            q.emplace(v, depth + 1);
+        });
     }
     for (auto &stat : stats) {
         std::sort(stat.sizes.begin(), stat.sizes.end());
@@ -214,8 +967,38 @@ std::vector<GeneralizedSuffixAutomaton::Statistics> GeneralizedSuffixAutomaton::
     return stats;
 }
 
+PostingList GeneralizedSuffixAutomaton::take_ids(int v) {
+    if (deferred_ids) return materialize_ids(v);
+    PostingList ids = std::move(st[v].ids);
+    st[v].ids.clear();
+    return ids;
+}
+
+void GeneralizedSuffixAutomaton::successors(int v, std::vector<int> &out) const {
+    for_each_next(v, [&](Symbol, int u) {
+        out.emplace_back(u);
+    });
+}
+
+std::vector<int> GeneralizedSuffixAutomaton::build_order() const {
+    auto order = topo_sort();
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
 std::vector<int> GeneralizedSuffixAutomaton::topo_sort() const {
     int n = static_cast<int>(st.size());
+    if (frozen) {
+        // Every transition strictly increases len, so a counting sort by len is a topological order
+        int max_len = 0;
+        for (int i = 0; i < n; i++) max_len = std::max(max_len, st[i].len);
+        std::vector<int> cnt(max_len + 2, 0);
+        for (int i = 0; i < n; i++) cnt[st[i].len + 1]++;
+        for (int l = 0; l <= max_len; l++) cnt[l + 1] += cnt[l];
+        std::vector<int> order(n);
+        for (int i = 0; i < n; i++) order[cnt[st[i].len]++] = i;
+        return order;
+    }
     int* in_degree = new int[n];
     for (int i = 0; i < n; ++i) {
         in_degree[i] = 0;
@@ -260,10 +1043,10 @@ void GeneralizedSuffixAutomaton::build_reverse() {
     deg = new std::atomic<int>[st.size()];
     reverse_next = new std::vector<int>[st.size()];
     for (int i = 0; i < st.size(); i++) {
-        deg[i] = st[i].next.size();
-        for (auto e : st[i].next) {
-            reverse_next[e.second].emplace_back(i);
-        }
+        deg[i] = out_degree(i);
+        for_each_next(i, [&](Symbol, int v) {
+            reverse_next[v].emplace_back(i);
+        });
     }
 }
 
@@ -271,15 +1054,22 @@ void GeneralizedSuffixAutomaton::dump(char* output_file) {
     std::ofstream f(output_file);
     f << st.size() << "\n";
     for (int i = 0; i < st.size(); i++) {
-        f << st[i].len << " " << st[i].link << " " << st[i].next.size() << " " << st[i].ids.size() << "\n";
-        for (auto e : st[i].next) {
-            f << int(e.first) << " " << e.second << " ";
-        }
+        f << st[i].len << " " << st[i].link << " " << out_degree(i) << " " << st[i].ids.size() << "\n";
+        for_each_next(i, [&](Symbol c, int v) {
+            f << int(c) << " " << v << " ";
+        });
         f << "\n";
-        for (auto id : st[i].ids) {
+        st[i].ids.for_each([&](uint32_t id) {
             f << id << " ";
-        }
+        });
         f << "\n";
     }
+    f << "normalizer " << normalizer.spec() << "\n";
+    f << "max_pattern_length " << max_pattern_length << "\n";
+    if (!tokenizer.chars()) {
+        f << "tokenizer " << tokenizer.spec() << "\n";
+        f << "vocab " << tokenizer.vocab.size() << "\n";
+        for (const auto& token : tokenizer.vocab) f << token << "\n";
+    }
     f.close();
 }
\ No newline at end of file
@@ -4,9 +4,50 @@
 #define SA_H
 
 #include "headers.h"
+#include "posting_list.h"
+#include "normalizer.h"
+#include "tokenizer.h"
+#include "pattern_index.h"
 
-class GeneralizedSuffixAutomaton {
+class GeneralizedSuffixAutomaton : public PatternIndex {
 public:
+    // Transition label: a byte of the normalized string, or a token id in token mode.
+    typedef uint32_t Symbol;
+
+    // Labels of the frozen transitions, stored in the narrowest width that holds all of them:
+    // one byte in char mode, two or four bytes for token ids (widened by the first label that
+    // does not fit).
+    class LabelArray {
+    public:
+        size_t size() const { return size_; }
+        int width() const { return width_; }
+        Symbol operator[](size_t i) const {
+            if (width_ == 1) return bytes_[i];
+            if (width_ == 2) {
+                uint16_t c;
+                std::memcpy(&c, bytes_.data() + 2 * i, 2);
+                return c;
+            }
+            uint32_t c;
+            std::memcpy(&c, bytes_.data() + 4 * i, 4);
+            return c;
+        }
+        void push_back(Symbol c);
+        void reserve(size_t n) { bytes_.reserve(n * width_); }
+        void clear() { std::vector<uint8_t>().swap(bytes_), size_ = 0, width_ = 1; }
+        void swap(LabelArray& other) { bytes_.swap(other.bytes_), std::swap(size_, other.size_), std::swap(width_, other.width_); }
+        size_t size_bytes() const { return bytes_.size(); }
+        // Raw storage (width() bytes per label), e.g. for I/O; resize() discards the labels.
+        const uint8_t* data() const { return bytes_.data(); }
+        uint8_t* data() { return bytes_.data(); }
+        void resize(size_t n, int width) { width_ = width, size_ = n, bytes_.assign(n * width, 0); }
+
+    private:
+        std::vector<uint8_t> bytes_;
+        size_t size_ = 0;
+        int width_ = 1;
+    };
+
     struct Statistics {
         double mid, avg; // median and avg of vector set sizes
         std::vector<int> sizes; // vector set sizes (sorted)
@@ -15,12 +56,53 @@ public:
     struct State {
         int len = 0;
         int link = -1;
-        std::unordered_map<char, int> next;
-        std::vector<uint32_t> ids;
+        std::unordered_map<Symbol, int> next;
+        PostingList ids;
     };
     std::vector<State> st;
     std::vector<int> affected_states; // states affected by the last added string, used for insertion
+
+    // Applied to every added string and every queried pattern. Transitions are labelled with
+    // the bytes of the normalized strings, or, in token mode (tokenizer.mode != CHARS), with the
+    // ids of the normalized tokens, so that patterns match contiguous token sequences.
+    Normalizer normalizer;
+    Tokenizer tokenizer;
+    size_t dropped_chars = 0; // characters removed by the normalizer over all added strings
+
+    // If L = max_pattern_length > 0, only substrings of at most L symbols are indexed: the states
+    // whose shortest string is longer than L are dropped (on repetitive corpora, most of the
+    // states that long repeats create), and query() rejects longer patterns. add_string drops
+    // them whenever the automaton has doubled since the last time, so that construction never
+    // holds much more than the pruned automaton, and freeze() drops the rest.
+    //
+    // Adding strings to a pruned automaton keeps every pattern of at most L symbols exact. A
+    // dropped state q = next(p, c) only holds strings longer than L, and so does every string
+    // x + c for x in p. Extending a string where next(p, c) was dropped thus creates or links
+    // states for strings longer than L only; the states of shorter suffixes are reached through
+    // kept transitions exactly as in the full automaton, and get the new id along the same
+    // suffix links.
+    int max_pattern_length = 0;
+
+    // Frozen transition layout (valid only when frozen == true, see freeze()).
+    // Edges of state v are edge_label/edge_target[edge_begin[v], edge_begin[v + 1]), sorted by label.
+    // If the alphabet is small (byte mode), states with many edges additionally own a row of
+    // alphabet_size entries in dense_next (dense_row[v] != -1), indexed by the remapped
+    // symbol_of[symbol] (-1 for symbols never used).
+    bool frozen = false;
+    bool ordered = false; // frozen by freeze(true): states are in (len, BFS) order
+    std::vector<int> edge_begin;
+    LabelArray edge_label;
+    std::vector<int> edge_target;
+    std::vector<int> dense_row;
+    std::vector<int> dense_next;
+    std::vector<int> symbol_of;
+    int alphabet_size = 0;
         
+    // Deferred id mode (see set_deferred_ids()): add_string only records, for every prefix of the
+    // string, the state it ends in. The ids of a state are then the ids recorded in its subtree
+    // of the suffix-link tree.
+    bool deferred_ids = false;
+
     // Used for reverse topological sort.
     std::atomic<int>* deg = nullptr;
     std::vector<int>* reverse_next = nullptr;
@@ -34,10 +116,91 @@ public:
     // Complexity: O(|s|) amortized.
     void add_string(uint32_t id, const std::string &s);
 
+    // Add an already encoded string (see encode()).
+    void add_symbols(uint32_t id, const std::vector<Symbol> &s);
+
+    // Symbols of s after normalization and tokenization, as looked up by query(). Tokens that
+    // are not in the dictionary map to Tokenizer::kUnknown.
+    std::vector<Symbol> encode(const std::string &s) const;
+
+    // In deferred mode, add_string builds only the automaton structure and State::ids stay empty
+    // until propagate_ids() or materialize_ids() is used. Turning it off drops the recorded marks.
+    void set_deferred_ids(bool deferred);
+
+    // Compute State::ids of all states in one bottom-up pass over the suffix-link tree and
+    // leave deferred mode. Complexity: O(marks + total ids) plus sorting each state's ids.
+    void propagate_ids();
+
+    // Prepare materialize_ids(): lays the recorded marks out in DFS order of the suffix-link tree.
+    // Call after freeze(); renumbering states invalidates it.
+    void index_ids();
+
+    // Ids of state v computed on demand from its DFS range (thread-safe, does not touch State::ids).
+    PostingList materialize_ids(int v) const;
+
+    // Number of marks in the DFS range of v (an upper bound of its id count), after index_ids().
+    int num_marks(int v) const { return mark_begin[dfs_out[v]] - mark_begin[dfs_in[v]]; }
+
+    // Convert transitions into the read-only CSR layout above and drop the hash maps.
+    // If renumber is true, states are also renumbered in (len, BFS) order so that
+    // short patterns touch neighbouring states and index order is a topological order
+    // (this also applies to a frozen automaton that is not ordered yet, e.g. after build_parallel).
+    // Must be called before anything else is indexed by state id.
+    void freeze(bool renumber = true);
+
+    // Restore the hash-map transitions (needed before adding strings to a frozen GSA).
+    void thaw();
+
+    // Transition of state v on symbol c, -1 if absent.
+    int next_state(int v, Symbol c) const;
+
+    // Number of transitions leaving state v.
+    int out_degree(int v) const;
+
+    // Call f(c, u) for every transition v --c--> u.
+    template <typename F>
+    void for_each_next(int v, F&& f) const {
+        if (frozen) {
+            for (int e = edge_begin[v]; e < edge_begin[v + 1]; e++) {
+                f(edge_label[e], edge_target[e]);
+            }
+        }
+        else {
+            for (const auto& e : st[v].next) {
+                f(e.first, e.second);
+            }
+        }
+    }
+
+    // Build the automaton of strs[0..n) (n = -1 for all) on num_threads threads: strings are
+    // split into contiguous shards, each shard gets its own automaton, and shard automata are
+    // merged pairwise. Yields the same states, links and sorted ids as calling add_string(i, strs[i])
+    // in order (up to state numbering). The automaton must be empty; the result is frozen but not
+    // ordered.
+    void build_parallel(const std::vector<std::string>& strs, int num_threads, int n = -1);
+
+    // Same result as build_parallel, built out of core: consecutive chunks of about
+    // memory_budget / kBuildBytesPerSymbol symbols (about memory_budget bytes of construction
+    // memory each) are built one at a time, frozen and written to spill_dir, then merged pairwise
+    // from disk. A merge holds the transitions of its two inputs and a table of 32 to 56 bytes per
+    // merged state, and streams its output to disk; the final automaton is then read back alone.
+    // So memory_budget bounds the chunk construction only, not the merges or the final automaton.
+    // Ids are derived from the final automaton (eagerly, or as marks in deferred mode).
+    // False (logged) if a spill file cannot be written or read back; the automaton is then unusable.
+    bool build_external(const std::vector<std::string>& strs, size_t memory_budget, const std::string& spill_dir, int n = -1);
+
     // Query which state that pattern p ends.
-    // Returns the state id.
+    // Returns the state id, -1 if p does not occur or is longer than max_pattern_length.
     // Complexity: O(|p|).
-    int query(const std::string &p) const;
+    int query(const std::string &p) const override;
+    int query(const std::vector<Symbol> &p) const;
+
+    // PatternIndex: the states of the automaton, successors are transition targets. take_ids()
+    // moves State::ids out (or materializes them in deferred mode, see index_ids()).
+    int num_states() const override { return st.size(); }
+    PostingList take_ids(int v) override;
+    void successors(int v, std::vector<int> &out) const override;
+    std::vector<int> build_order() const override;
 
     // The number of states (reflecting space consumption of GSA).
     int size();
@@ -45,6 +208,12 @@ public:
     // The number of total ids of states (reflecting total space consumption).
     int size_tot();
 
+    // Bytes used by the automaton structure (lengths, links and transitions).
+    size_t size_bytes() const override;
+
+    // Bytes used by the (compressed) id lists of all states.
+    size_t ids_bytes() const;
+
     // Clear all data (start fresh).
     void clear();
 
@@ -60,12 +229,64 @@ public:
     // Build reverse edges for the GSA.
     void build_reverse();
 
-    // Dump the index to disk
+    // Dump the index to disk (followed by the normalizer, max_pattern_length and the tokenizer)
     void dump(char* output_file);
 
 private:
+    static const int kDenseDegree = 12; // states with at least this many edges get a dense row
+    static const int kMaxDenseAlphabet = 256; // no dense rows for larger alphabets (token mode)
+    static const size_t kBuildBytesPerSymbol = 400; // measured peak of add_string with hash-map transitions
+    static const size_t kMinPruneStates = 1 << 16; // add_string does not prune smaller automata
     int last;
-    void sa_extend(char c, uint32_t id);
+    size_t prune_states = kMinPruneStates; // add_string prunes once there are this many states
+    void sa_extend(Symbol c, uint32_t id);
+
+    // Drop the states longer than max_pattern_length from an automaton that is not frozen.
+    // State ids change; marks on dropped states move to their nearest kept suffix-link ancestor.
+    void prune();
+
+    // encode() for a string being added: new tokens enter the dictionary, dropped characters are counted.
+    void encode_new(const std::string &s, std::vector<Symbol> &out);
+
+    // Deferred mode: (state, id) for the root and every prefix end of every added string.
+    std::vector<std::pair<int, uint32_t>> id_marks;
+    // Built by index_ids(): ids of marks sorted by the DFS entry time of their state; the marks of
+    // the subtree of v are mark_ids[mark_begin[dfs_in[v]], mark_begin[dfs_out[v]]).
+    std::vector<int> dfs_in, dfs_out, mark_begin;
+    std::vector<uint32_t> mark_ids;
+
+    // Replace *this by the automaton of the union of a's and b's strings. Both inputs must be
+    // frozen and every id in a must be smaller than every id in b.
+    // The result is written frozen, in discovery order. Inputs without states (see
+    // read_structure()) contribute no ids.
+    void merge(const GeneralizedSuffixAutomaton& a, const GeneralizedSuffixAutomaton& b);
+
+    // merge() into a spill file, state by state, without ids, lengths or links (read_structure()
+    // derives them). False (logged) on a write error.
+    static bool merge_to_file(const GeneralizedSuffixAutomaton& a, const GeneralizedSuffixAutomaton& b, const std::string& path);
+
+    // The states of merge(a, b) in discovery order: emit(x, y, labels, targets) for every pair
+    // (state x of a, state y of b, -1 if none) with its sorted edges. Returns the number of states.
+    template <class Emit>
+    static int merge_pairs(const GeneralizedSuffixAutomaton& a, const GeneralizedSuffixAutomaton& b, Emit emit);
+
+    // len and link of every state of a frozen automaton from its transitions alone.
+    void derive_links();
+
+    // Dense rows and symbol_of for the current CSR arrays.
+    void build_dense_rows();
+
+    // Replace the structure (states and transitions) by other's.
+    void take(GeneralizedSuffixAutomaton& other);
+
+    // Deferred mode: id_marks for strs[0..n) walked through the finished automaton.
+    void mark_strings(const std::vector<std::string>& strs, int n, int num_threads, const std::vector<std::vector<Symbol>>& encoded);
+
+    // Binary spill file of the structure of a frozen automaton (no ids). Without states, only the
+    // transitions are read (enough to be a merge() input). False (logged) on an I/O error or a
+    // truncated file.
+    bool write_structure(const std::string& path) const;
+    bool read_structure(const std::string& path, bool with_states = true);
 };
 
 #endif // SA_H
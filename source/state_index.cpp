@@ -0,0 +1,1002 @@
+#include "state_index.h"
+
+static inline float l2sqr(const float* a, const float* b, int dim) {
+    float dist = 0;
+    for (int i = 0; i < dim; i++) {
+        float diff = a[i] - b[i];
+        dist += diff * diff;
+    }
+    return dist;
+}
+
+template <typename T>
+static void write_vector(std::ofstream& f, const std::vector<T>& v, uint64_t n) {
+    f.write((const char*)&n, sizeof(n));
+    f.write((const char*)v.data(), sizeof(T) * n);
+}
+
+template <typename T>
+static void write_vector(std::ofstream& f, const std::vector<T>& v) {
+    write_vector(f, v, v.size());
+}
+
+template <typename T>
+static bool read_vector(std::ifstream& f, std::vector<T>& v) {
+    uint64_t n = 0;
+    if (!f.read((char*)&n, sizeof(n))) return false;
+    v.resize(n);
+    return bool(f.read((char*)v.data(), sizeof(T) * n));
+}
+
+// Links of every point from its NN-descent neighbors and the points having it as a neighbor: at
+// most m of them, closest first, by the HNSW heuristic (dist(i, j) is the distance of points i, j).
+static std::vector<std::vector<uint32_t>> prune_knn_graph(const NNDescent& knn, size_t n, size_t m,
+                                                          const std::function<float(uint32_t, uint32_t)>& dist,
+                                                          const ParallelFor& parallel_for) {
+    std::vector<std::vector<std::pair<float, uint32_t>>> cand(n);
+    for (size_t i = 0; i < n; i++) {
+        for (int e = 0; e < knn.num_neighbors(); e++) {
+            const auto& nb = knn.neighbors(i)[e];
+            cand[i].emplace_back(nb.dist, nb.id);
+            cand[nb.id].emplace_back(nb.dist, i);
+        }
+    }
+    std::vector<std::vector<uint32_t>> links(n);
+    parallel_for(n, [&](size_t i) {
+        auto& c = cand[i];
+        std::sort(c.begin(), c.end());
+        c.erase(std::unique(c.begin(), c.end()), c.end());
+        for (const auto& x : c) {
+            if (links[i].size() >= m) break;
+            bool good = true;
+            for (uint32_t r : links[i]) {
+                if (dist(x.second, r) < x.first) {
+                    good = false;
+                    break;
+                }
+            }
+            if (good) links[i].emplace_back(x.second);
+        }
+        std::vector<std::pair<float, uint32_t>>().swap(c);
+    });
+    return links;
+}
+
+static void write_params(std::ofstream& f, const HnswPolicy::Params& p) {
+    int32_t values[3] = {p.M, p.ef_construction, p.ef_search};
+    f.write((const char*)values, sizeof(values));
+}
+
+static bool read_params(std::ifstream& f, HnswPolicy::Params& p) {
+    int32_t values[3];
+    if (!f.read((char*)values, sizeof(values))) return false;
+    p.M = values[0], p.ef_construction = values[1], p.ef_search = values[2];
+    return true;
+}
+
+// Top k of (distance, id) pairs, closest first.
+static std::vector<std::pair<float, hnswlib::labeltype>> top_k(std::vector<std::pair<float, hnswlib::labeltype>>& res, size_t k) {
+    if (res.size() > k) {
+        std::partial_sort(res.begin(), res.begin() + k, res.end());
+        res.resize(k);
+    }
+    else {
+        std::sort(res.begin(), res.end());
+    }
+    return std::move(res);
+}
+
+const char* StateIndex::kind_name(Kind kind) {
+    switch (kind) {
+        case FLAT: return "flat";
+        case NSW: return "nsw";
+        case IVF: return "ivf";
+        case HNSW: return "hnsw";
+        case FROZEN: return "frozen";
+    }
+    return "hnsw";
+}
+
+size_t StateIndex::estimate_bytes(Kind kind, size_t n, int dim, const HnswPolicy::Params& p) {
+    size_t M = std::max(p.M, 2);
+    switch (kind) {
+        case FLAT:
+            return sizeof(FlatIndex) + sizeof(uint32_t) * n;
+        case NSW:
+            return sizeof(NswIndex) + n * (sizeof(uint32_t) * (1 + 2 * M) + sizeof(uint16_t));
+        case IVF: {
+            size_t lists = std::max<size_t>(1, std::sqrt(double(n)));
+            return sizeof(IvfIndex) + lists * (sizeof(float) * dim + sizeof(std::vector<uint32_t>)) + sizeof(uint32_t) * n;
+        }
+        case FROZEN:
+            // Label, offset and links of every node, and the upper levels of the n / (M - 1) nodes above level 0
+            return sizeof(FrozenIndex) + n * (2 * sizeof(uint32_t) + (n <= 65536 ? sizeof(uint16_t) : sizeof(uint32_t)) * 2 * M) +
+                   n * sizeof(uint32_t) * (M + 3) / (M - 1);
+        default:
+            // Level 0 links and label, the level of every element, and its upper level links
+            return 64 + n * (sizeof(uint32_t) * (2 * M + 1) + sizeof(hnswlib::labeltype) + sizeof(unsigned)) +
+                   n * sizeof(uint32_t) * (M + 1) / (M - 1);
+    }
+}
+
+void StateIndex::build_bulk(const PostingList& ids, const ParallelFor&) { build(ids); }
+
+bool StateIndex::seed(const StateIndex&) { return false; }
+
+bool StateIndex::derive(const StateIndex&, const PostingList&) { return false; }
+
+void StateIndex::resize(size_t) {}
+
+std::vector<std::pair<float, hnswlib::labeltype>> StateIndex::search_filtered(const float* q, size_t k, size_t,
+                                                                             const std::function<bool(uint32_t)>& allowed) const {
+    std::vector<std::pair<float, hnswlib::labeltype>> res;
+    for (const auto& r : search(q, size())) {
+        if (allowed(r.second)) res.emplace_back(r);
+        if (res.size() == k) break;
+    }
+    return res;
+}
+
+StateIndex* StateIndex::load(Kind kind, const std::string& path, hnswlib::SpaceInterface<float>* space, const float* data, int dim) {
+    if (kind == HNSW) return new HnswIndex(space, path, data);
+    HnswPolicy::Params p;
+    if (kind == FLAT) {
+        FlatIndex* index = new FlatIndex(data, dim);
+        if (index->load(path)) return index;
+        delete index;
+    }
+    else if (kind == NSW) {
+        NswIndex* index = new NswIndex(data, dim, p);
+        if (index->load(path)) return index;
+        delete index;
+    }
+    else if (kind == FROZEN) {
+        FrozenIndex* index = new FrozenIndex(space, data, dim);
+        if (index->load(path)) return index;
+        delete index;
+    }
+    else {
+        IvfIndex* index = new IvfIndex(data, dim, p);
+        if (index->load(path)) return index;
+        delete index;
+    }
+    LOG_ERROR("Cannot read ", kind_name(kind), " index ", path);
+    return nullptr;
+}
+
+HnswIndex::HnswIndex(hnswlib::SpaceInterface<float>* space, size_t n, const float* data, const HnswPolicy::Params& p) {
+    params = p;
+    hnsw = new hnswlib::HierarchicalNSW<float>(space, n, data, p.M, p.ef_construction);
+    hnsw->setEf(p.ef_search);
+}
+
+HnswIndex::HnswIndex(hnswlib::SpaceInterface<float>* space, const std::string& path, const float* data) {
+    hnsw = new hnswlib::HierarchicalNSW<float>(space, path, data);
+    params.M = hnsw->M_;
+    params.ef_construction = hnsw->ef_construction_;
+    params.ef_search = hnsw->ef_;
+}
+
+void HnswIndex::set_ef(int ef) {
+    params.ef_search = ef;
+    hnsw->setEf(ef);
+}
+
+bool HnswIndex::seed(const StateIndex& part) {
+    if (part.kind() != HNSW) return false;
+    const hnswlib::HierarchicalNSW<float>* src = static_cast<const HnswIndex&>(part).hnsw;
+    size_t n = src->cur_element_count;
+    if (hnsw->cur_element_count != 0 || n > hnsw->max_elements_ || src->size_data_per_element_ != hnsw->size_data_per_element_ ||
+        src->size_links_per_element_ != hnsw->size_links_per_element_) {
+        return false;
+    }
+    // Same layout: level 0 (links and labels) in one block, upper levels per element
+    memcpy(hnsw->data_level0_memory_, src->data_level0_memory_, n * src->size_data_per_element_);
+    for (size_t i = 0; i < n; i++) {
+        int level = src->element_levels_[i];
+        hnsw->element_levels_[i] = level;
+        if (level > 0) {
+            hnsw->linkLists_[i] = (char*)malloc(hnsw->size_links_per_element_ * level);
+            memcpy(hnsw->linkLists_[i], src->linkLists_[i], hnsw->size_links_per_element_ * level);
+        }
+        hnsw->label_lookup_[src->getExternalLabel(i)] = i;
+    }
+    hnsw->cur_element_count = n;
+    hnsw->enterpoint_node_ = src->enterpoint_node_;
+    hnsw->maxlevel_ = src->maxlevel_;
+    return true;
+}
+
+bool HnswIndex::derive(const StateIndex& global, const PostingList& ids) {
+    using hnswlib::tableint;
+    using hnswlib::linklistsizeint;
+    if (global.kind() != HNSW || hnsw->cur_element_count != 0 || ids.size() > hnsw->max_elements_) return false;
+    const hnswlib::HierarchicalNSW<float>* g = static_cast<const HnswIndex&>(global).hnsw;
+    std::vector<uint32_t> labels = ids.decode();
+    size_t n = labels.size();
+    // Node u of this graph is node gid[u] of the global one
+    std::vector<tableint> gid(n);
+    std::unordered_map<tableint, tableint> local;
+    local.reserve(2 * n);
+    for (size_t u = 0; u < n; u++) {
+        auto it = g->label_lookup_.find(labels[u]);
+        if (it == g->label_lookup_.end()) return false;
+        gid[u] = it->second;
+        local[it->second] = u;
+    }
+    if (n == 0) return true;
+    auto dist = [&](tableint a, tableint b) {
+        return hnsw->fstdistfunc_(hnsw->getDataByInternalId(a), hnsw->getDataByInternalId(b), hnsw->dist_func_param_);
+    };
+
+    // Nodes keep their global level; the entry point is the first node of the highest level
+    int maxlevel = -1;
+    tableint ep = 0;
+    for (tableint u = 0; u < n; u++) {
+        memset(hnsw->data_level0_memory_ + u * hnsw->size_data_per_element_, 0, hnsw->size_data_per_element_);
+        hnsw->setExternalLabel(u, labels[u]);
+        hnsw->label_lookup_[labels[u]] = u;
+        int level = g->element_levels_[gid[u]];
+        hnsw->element_levels_[u] = level;
+        if (level > 0) {
+            hnsw->linkLists_[u] = (char*)malloc(hnsw->size_links_per_element_ * level);
+            memset(hnsw->linkLists_[u], 0, hnsw->size_links_per_element_ * level);
+        }
+        if (level > maxlevel) maxlevel = level, ep = u;
+    }
+    hnsw->cur_element_count = n;
+    hnsw->enterpoint_node_ = ep;
+    hnsw->maxlevel_ = maxlevel;
+
+    // Induced links: those between nodes of ids, the closest ones if the degree here is smaller
+    std::vector<std::pair<float, tableint>> nb;
+    for (tableint u = 0; u < n; u++) {
+        for (int level = 0; level <= hnsw->element_levels_[u]; level++) {
+            linklistsizeint* src = g->get_linklist_at_level(gid[u], level);
+            const tableint* adj = (const tableint*)(src + 1);
+            nb.clear();
+            for (int e = 0; e < g->getListCount(src); e++) {
+                auto it = local.find(adj[e]);
+                if (it != local.end()) nb.emplace_back(0, it->second);
+            }
+            size_t cap = level == 0 ? hnsw->maxM0_ : hnsw->maxM_;
+            if (nb.size() > cap) {
+                for (auto& c : nb) c.first = dist(u, c.second);
+                std::partial_sort(nb.begin(), nb.begin() + cap, nb.end());
+                nb.resize(cap);
+            }
+            linklistsizeint* dst = hnsw->get_linklist_at_level(u, level);
+            hnsw->setListCount(dst, nb.size());
+            tableint* out = (tableint*)(dst + 1);
+            for (size_t e = 0; e < nb.size(); e++) out[e] = nb[e].second;
+        }
+    }
+
+    // Induced links can leave any level sparse or disconnected (most of all the upper ones, where
+    // few of the global nodes are kept): repair them all
+    for (int level = maxlevel; level >= 0; level--) {
+        repair_level(level, std::max<size_t>(hnsw->M_, hnsw->ef_construction_ / 4), hnsw->M_);
+    }
+    return true;
+}
+
+void HnswIndex::build_bulk(const PostingList& ids, const ParallelFor& parallel_for) {
+    using hnswlib::tableint;
+    using hnswlib::linklistsizeint;
+    if (hnsw->cur_element_count != 0 || ids.size() > hnsw->max_elements_) {
+        build(ids);
+        return;
+    }
+    std::vector<uint32_t> labels = ids.decode();
+    size_t n = labels.size();
+    if (n == 0) return;
+    // Levels drawn as addPoint draws them; the entry point is the first node of the highest level
+    int maxlevel = -1;
+    tableint ep = 0;
+    for (tableint u = 0; u < n; u++) {
+        memset(hnsw->data_level0_memory_ + u * hnsw->size_data_per_element_, 0, hnsw->size_data_per_element_);
+        hnsw->setExternalLabel(u, labels[u]);
+        hnsw->label_lookup_[labels[u]] = u;
+        int level = hnsw->getRandomLevel(hnsw->mult_);
+        hnsw->element_levels_[u] = level;
+        if (level > 0) {
+            hnsw->linkLists_[u] = (char*)malloc(hnsw->size_links_per_element_ * level);
+            memset(hnsw->linkLists_[u], 0, hnsw->size_links_per_element_ * level);
+        }
+        if (level > maxlevel) maxlevel = level, ep = u;
+    }
+    hnsw->cur_element_count = n;
+    hnsw->enterpoint_node_ = ep;
+    hnsw->maxlevel_ = maxlevel;
+
+    // Every level links the approximate nearest neighbors among its nodes
+    const float* data = (const float*)hnsw->external_data_;
+    int dim = hnsw->data_size_ / sizeof(float);
+    for (int level = 0; level <= maxlevel; level++) {
+        std::vector<tableint> nodes;
+        std::vector<uint32_t> node_labels;
+        for (tableint u = 0; u < n; u++) {
+            if (hnsw->element_levels_[u] < level) continue;
+            nodes.emplace_back(u);
+            node_labels.emplace_back(labels[u]);
+        }
+        size_t m = level == 0 ? hnsw->maxM0_ : hnsw->maxM_;
+        NNDescent knn(m);
+        knn.build(data, dim, node_labels, parallel_for);
+        auto links = prune_knn_graph(knn, nodes.size(), m, [&](uint32_t a, uint32_t b) {
+            return hnsw->fstdistfunc_(hnsw->getDataByInternalId(nodes[a]), hnsw->getDataByInternalId(nodes[b]), hnsw->dist_func_param_);
+        }, parallel_for);
+        for (size_t p = 0; p < nodes.size(); p++) {
+            linklistsizeint* ll = hnsw->get_linklist_at_level(nodes[p], level);
+            hnsw->setListCount(ll, links[p].size());
+            tableint* adj = (tableint*)(ll + 1);
+            for (size_t e = 0; e < links[p].size(); e++) adj[e] = nodes[links[p][e]];
+        }
+    }
+    repair_level(0, std::max<size_t>(hnsw->M_, hnsw->ef_construction_ / 4), 0);
+}
+
+void HnswIndex::repair_level(int level, size_t ef, size_t min_links) {
+    using hnswlib::tableint;
+    using hnswlib::linklistsizeint;
+    size_t n = hnsw->cur_element_count;
+    tableint ep = hnsw->enterpoint_node_;
+    if (n == 0) return;
+    size_t cap = level == 0 ? hnsw->maxM0_ : hnsw->maxM_;
+    auto dist = [&](tableint a, tableint b) {
+        return hnsw->fstdistfunc_(hnsw->getDataByInternalId(a), hnsw->getDataByInternalId(b), hnsw->dist_func_param_);
+    };
+    std::vector<unsigned> visited(n, 0);
+    unsigned stamp = 0;
+    auto search = [&](tableint u, size_t ef) {
+        stamp++;
+        std::priority_queue<std::pair<float, tableint>> top;
+        std::priority_queue<std::pair<float, tableint>, std::vector<std::pair<float, tableint>>, std::greater<>> cand;
+        visited[ep] = stamp;
+        top.emplace(dist(u, ep), ep);
+        cand.emplace(top.top());
+        while (!cand.empty()) {
+            auto c = cand.top();
+            cand.pop();
+            if (top.size() >= ef && c.first > top.top().first) break;
+            linklistsizeint* ll = hnsw->get_linklist_at_level(c.second, level);
+            const tableint* adj = (const tableint*)(ll + 1);
+            for (int e = 0; e < hnsw->getListCount(ll); e++) {
+                tableint v = adj[e];
+                if (visited[v] == stamp) continue;
+                visited[v] = stamp;
+                float d = dist(u, v);
+                if (top.size() < ef || d < top.top().first) {
+                    top.emplace(d, v);
+                    cand.emplace(d, v);
+                    if (top.size() > ef) top.pop();
+                }
+            }
+        }
+        std::vector<std::pair<float, tableint>> res(top.size());
+        for (size_t k = top.size(); k-- > 0; top.pop()) res[k] = top.top();
+        return res;
+    };
+    auto link = [&](tableint u, tableint v) {
+        linklistsizeint* ll = hnsw->get_linklist_at_level(u, level);
+        tableint* adj = (tableint*)(ll + 1);
+        int cnt = hnsw->getListCount(ll);
+        for (int e = 0; e < cnt; e++) {
+            if (adj[e] == v) return true;
+        }
+        if ((size_t)cnt >= cap) return false;
+        adj[cnt] = v;
+        hnsw->setListCount(ll, cnt + 1);
+        return true;
+    };
+    auto repair = [&](tableint u, bool reconnect) {
+        auto cand = search(u, ef);
+        linklistsizeint* ll = hnsw->get_linklist_at_level(u, level);
+        std::vector<tableint> kept((tableint*)(ll + 1), (tableint*)(ll + 1) + hnsw->getListCount(ll));
+        bool linked_back = false;
+        for (const auto& c : cand) {
+            if (hnsw->getListCount(ll) >= std::max<size_t>(min_links, 1) && (!reconnect || linked_back)) break;
+            if (c.second == u || std::find(kept.begin(), kept.end(), c.second) != kept.end()) continue;
+            bool good = true;
+            for (tableint r : kept) {
+                if (dist(c.second, r) < c.first) {
+                    good = false;
+                    break;
+                }
+            }
+            if (!good && !(reconnect && !linked_back)) continue;
+            kept.emplace_back(c.second);
+            link(u, c.second);
+            if (link(c.second, u)) {
+                linked_back = true;
+            }
+            else if (reconnect && !linked_back) {
+                // Replace the farthest link of c
+                linklistsizeint* cl = hnsw->get_linklist_at_level(c.second, level);
+                tableint* adj = (tableint*)(cl + 1);
+                int far = 0;
+                for (int e = 1; e < hnsw->getListCount(cl); e++) {
+                    if (dist(c.second, adj[e]) > dist(c.second, adj[far])) far = e;
+                }
+                adj[far] = u;
+                linked_back = true;
+            }
+        }
+    };
+    for (tableint u = 0; u < n; u++) {
+        if (hnsw->element_levels_[u] < level) continue;
+        if (u != ep && hnsw->getListCount(hnsw->get_linklist_at_level(u, level)) < min_links) repair(u, false);
+    }
+    std::vector<char> reached(n, 0);
+    std::vector<tableint> stack;
+    auto reach = [&](tableint s) {
+        reached[s] = 1;
+        stack.assign(1, s);
+        while (!stack.empty()) {
+            linklistsizeint* ll = hnsw->get_linklist_at_level(stack.back(), level);
+            stack.pop_back();
+            const tableint* adj = (const tableint*)(ll + 1);
+            for (int e = 0; e < hnsw->getListCount(ll); e++) {
+                if (!reached[adj[e]]) reached[adj[e]] = 1, stack.emplace_back(adj[e]);
+            }
+        }
+    };
+    // A reconnection can take the only link into nodes reached before: check again (a few rounds)
+    for (int round = 0; round < 3; round++) {
+        reached.assign(n, 0);
+        reach(ep);
+        bool connected = true;
+        for (tableint u = 0; u < n; u++) {
+            if (reached[u] || hnsw->element_levels_[u] < level) continue;
+            connected = false;
+            repair(u, true);
+            reach(u);
+        }
+        if (connected) break;
+    }
+}
+
+std::vector<std::pair<float, hnswlib::labeltype>> HnswIndex::search(const float* q, size_t k) const {
+    return hnsw->searchKnnCloserFirst(q, k);
+}
+
+std::vector<std::pair<float, hnswlib::labeltype>> HnswIndex::search_filtered(const float* q, size_t k, size_t ef,
+                                                                            const std::function<bool(uint32_t)>& allowed) const {
+    using hnswlib::tableint;
+    using hnswlib::linklistsizeint;
+    std::vector<std::pair<float, hnswlib::labeltype>> res;
+    size_t n = hnsw->cur_element_count;
+    if (n == 0) return res;
+    auto dist = [&](tableint u) { return hnsw->fstdistfunc_(q, hnsw->getDataByInternalId(u), hnsw->dist_func_param_); };
+    // Greedy descent through the upper levels, unfiltered
+    tableint ep = hnsw->enterpoint_node_;
+    float ep_dist = dist(ep);
+    for (int level = hnsw->maxlevel_; level > 0; level--) {
+        for (bool changed = true; changed;) {
+            changed = false;
+            linklistsizeint* ll = hnsw->get_linklist_at_level(ep, level);
+            const tableint* adj = (const tableint*)(ll + 1);
+            for (int e = 0; e < hnsw->getListCount(ll); e++) {
+                float d = dist(adj[e]);
+                if (d < ep_dist) ep_dist = d, ep = adj[e], changed = true;
+            }
+        }
+    }
+    // Level 0 best-first search with ef over all nodes; the allowed ones are the results
+    thread_local std::vector<unsigned> visited;
+    thread_local unsigned stamp = 0;
+    if (visited.size() < n) visited.assign(n, 0), stamp = 0;
+    if (++stamp == 0) std::fill(visited.begin(), visited.end(), 0), stamp = 1;
+    std::priority_queue<std::pair<float, tableint>> top;
+    std::priority_queue<std::pair<float, tableint>, std::vector<std::pair<float, tableint>>, std::greater<>> cand;
+    auto visit = [&](tableint u, float d) {
+        hnswlib::labeltype label = hnsw->getExternalLabel(u);
+        if (allowed(label)) res.emplace_back(d, label);
+    };
+    visited[ep] = stamp;
+    top.emplace(ep_dist, ep);
+    cand.emplace(ep_dist, ep);
+    visit(ep, ep_dist);
+    while (!cand.empty()) {
+        auto c = cand.top();
+        cand.pop();
+        if (top.size() >= ef && c.first > top.top().first) break;
+        linklistsizeint* ll = hnsw->get_linklist0(c.second);
+        const tableint* adj = (const tableint*)(ll + 1);
+        for (int e = 0; e < hnsw->getListCount(ll); e++) {
+            tableint v = adj[e];
+            if (visited[v] == stamp) continue;
+            visited[v] = stamp;
+            float d = dist(v);
+            if (top.size() < ef || d < top.top().first) {
+                top.emplace(d, v);
+                cand.emplace(d, v);
+                if (top.size() > ef) top.pop();
+                visit(v, d);
+            }
+        }
+    }
+    return top_k(res, k);
+}
+
+FrozenIndex::FrozenIndex(hnswlib::SpaceInterface<float>* space, const float* data, int dim)
+    : data(data), dim(dim), dist_func(space->get_dist_func()), dist_param(space->get_dist_func_param()) {}
+
+FrozenIndex::FrozenIndex(const HnswIndex& graph, hnswlib::SpaceInterface<float>* space, const float* data, int dim)
+    : FrozenIndex(space, data, dim) {
+    using hnswlib::tableint;
+    using hnswlib::linklistsizeint;
+    const hnswlib::HierarchicalNSW<float>* hnsw = graph.hnsw;
+    params = graph.params;
+    size_t n = hnsw->cur_element_count;
+    entry_node = hnsw->enterpoint_node_;
+    max_level = std::max(hnsw->maxlevel_, 0);
+    labels.resize(n);
+    offsets.reserve(n + 1);
+    offsets.emplace_back(0);
+    std::vector<uint32_t> links;
+    for (tableint u = 0; u < n; u++) {
+        labels[u] = hnsw->getExternalLabel(u);
+        linklistsizeint* ll = hnsw->get_linklist0(u);
+        const tableint* adj = (const tableint*)(ll + 1);
+        links.insert(links.end(), adj, adj + hnsw->getListCount(ll));
+        offsets.emplace_back(links.size());
+        if (hnsw->element_levels_[u] == 0) continue;
+        upper_nodes.emplace_back(u);
+        upper_offsets.emplace_back(upper_links.size());
+        for (int level = 1; level <= hnsw->element_levels_[u]; level++) {
+            ll = hnsw->get_linklist(u, level);
+            adj = (const tableint*)(ll + 1);
+            upper_links.emplace_back(hnsw->getListCount(ll));
+            upper_links.insert(upper_links.end(), adj, adj + hnsw->getListCount(ll));
+        }
+    }
+    if (n <= 65536) links16.assign(links.begin(), links.end());
+    else links32 = std::move(links);
+}
+
+std::vector<std::pair<float, hnswlib::labeltype>> FrozenIndex::search(const float* q, size_t k) const {
+    if (labels.empty()) return {};
+    return links32.empty() ? search_level0(links16, q, k) : search_level0(links32, q, k);
+}
+
+template <typename Id>
+std::vector<std::pair<float, hnswlib::labeltype>> FrozenIndex::search_level0(const std::vector<Id>& links, const float* q, size_t k) const {
+    // Greedy descent through the upper levels
+    uint32_t ep = entry_node;
+    float ep_dist = dist(q, ep);
+    for (int level = max_level; level > 0; level--) {
+        for (bool changed = true; changed;) {
+            changed = false;
+            size_t j = std::lower_bound(upper_nodes.begin(), upper_nodes.end(), ep) - upper_nodes.begin();
+            const uint32_t* ll = upper_links.data() + upper_offsets[j];
+            for (int l = 1; l < level; l++) ll += ll[0] + 1;
+            for (uint32_t e = 1; e <= ll[0]; e++) {
+                float d = dist(q, ll[e]);
+                if (d < ep_dist) ep_dist = d, ep = ll[e], changed = true;
+            }
+        }
+    }
+    // Level 0 best-first search with max(ef, k)
+    size_t ef = std::max<size_t>(params.ef_search, k), n = labels.size();
+    thread_local std::vector<unsigned> visited;
+    thread_local unsigned stamp = 0;
+    if (visited.size() < n) visited.assign(n, 0), stamp = 0;
+    if (++stamp == 0) std::fill(visited.begin(), visited.end(), 0), stamp = 1;
+    std::priority_queue<std::pair<float, uint32_t>> top;
+    std::priority_queue<std::pair<float, uint32_t>, std::vector<std::pair<float, uint32_t>>, std::greater<>> cand;
+    visited[ep] = stamp;
+    top.emplace(ep_dist, ep);
+    cand.emplace(ep_dist, ep);
+    while (!cand.empty()) {
+        auto c = cand.top();
+        cand.pop();
+        if (top.size() >= ef && c.first > top.top().first) break;
+        for (uint32_t e = offsets[c.second]; e < offsets[c.second + 1]; e++) {
+            uint32_t v = links[e];
+            if (visited[v] == stamp) continue;
+            visited[v] = stamp;
+            float d = dist(q, v);
+            if (top.size() < ef || d < top.top().first) {
+                top.emplace(d, v);
+                cand.emplace(d, v);
+                if (top.size() > ef) top.pop();
+            }
+        }
+    }
+    while (top.size() > k) top.pop();
+    std::vector<std::pair<float, hnswlib::labeltype>> res(top.size());
+    for (size_t r = res.size(); r-- > 0; top.pop()) res[r] = {top.top().first, labels[top.top().second]};
+    return res;
+}
+
+size_t FrozenIndex::size_bytes() const {
+    return sizeof(FrozenIndex) + sizeof(uint16_t) * links16.capacity() +
+           sizeof(uint32_t) * (labels.capacity() + offsets.capacity() + links32.capacity() + upper_nodes.capacity() +
+                               upper_offsets.capacity() + upper_links.capacity());
+}
+
+void FrozenIndex::save(const std::string& path) const {
+    std::ofstream f(path, std::ios::binary);
+    write_params(f, params);
+    int32_t top[2] = {int32_t(entry_node), max_level};
+    f.write((const char*)top, sizeof(top));
+    write_vector(f, labels);
+    write_vector(f, offsets);
+    write_vector(f, links16);
+    write_vector(f, links32);
+    write_vector(f, upper_nodes);
+    write_vector(f, upper_offsets);
+    write_vector(f, upper_links);
+}
+
+bool FrozenIndex::load(const std::string& path) {
+    std::ifstream f(path, std::ios::binary);
+    int32_t top[2];
+    if (!read_params(f, params) || !f.read((char*)top, sizeof(top))) return false;
+    entry_node = top[0], max_level = top[1];
+    return read_vector(f, labels) && read_vector(f, offsets) && read_vector(f, links16) && read_vector(f, links32) &&
+           read_vector(f, upper_nodes) && read_vector(f, upper_offsets) && read_vector(f, upper_links);
+}
+
+void FlatIndex::add(uint32_t id) {
+    std::lock_guard<std::mutex> lock(mtx);
+    ids.emplace_back(id);
+}
+
+std::vector<std::pair<float, hnswlib::labeltype>> FlatIndex::search(const float* q, size_t k) const {
+    std::vector<std::pair<float, hnswlib::labeltype>> res;
+    res.reserve(ids.size());
+    for (uint32_t id : ids) res.emplace_back(l2sqr(data + (size_t)id * dim, q, dim), id);
+    return top_k(res, k);
+}
+
+void FlatIndex::save(const std::string& path) const {
+    std::ofstream f(path, std::ios::binary);
+    write_vector(f, ids);
+}
+
+bool FlatIndex::load(const std::string& path) {
+    std::ifstream f(path, std::ios::binary);
+    return read_vector(f, ids);
+}
+
+NswIndex::NswIndex(const float* data, int dim, const HnswPolicy::Params& p) : data(data), dim(dim) {
+    params = p;
+    max_degree = 2 * p.M;
+}
+
+void NswIndex::make_room(size_t n) {
+    if (n <= labels.size()) return;
+    labels.resize(n);
+    links.resize(n * max_degree);
+    degree.resize(n);
+}
+
+void NswIndex::resize(size_t n) {
+    std::unique_lock<std::shared_mutex> lock(room_mtx);
+    make_room(n);
+}
+
+std::vector<std::pair<float, uint32_t>> NswIndex::search_nodes(const float* q, size_t ef, bool locked) const {
+    typedef std::pair<float, uint32_t> Entry;
+    std::vector<char> visited(labels.size(), 0);
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> candidates; // closest on top
+    std::priority_queue<Entry> best;                                                // farthest on top
+    std::vector<uint32_t> adj;
+    float d = l2sqr(vec(0), q, dim);
+    candidates.emplace(d, 0);
+    best.emplace(d, 0);
+    visited[0] = 1;
+    while (!candidates.empty()) {
+        Entry cur = candidates.top();
+        if (cur.first > best.top().first && best.size() >= ef) break;
+        candidates.pop();
+        const uint32_t* first = links.data() + (size_t)cur.second * max_degree;
+        if (locked) {
+            std::lock_guard<std::mutex> lock(node_mtx[cur.second % kNodeLocks]);
+            adj.assign(first, first + degree[cur.second]);
+        }
+        else {
+            adj.assign(first, first + degree[cur.second]);
+        }
+        for (uint32_t u : adj) {
+            if (visited[u]) continue;
+            visited[u] = 1;
+            float du = l2sqr(vec(u), q, dim);
+            if (best.size() < ef || du < best.top().first) {
+                candidates.emplace(du, u);
+                best.emplace(du, u);
+                if (best.size() > ef) best.pop();
+            }
+        }
+    }
+    std::vector<Entry> res(best.size());
+    for (size_t i = res.size(); i-- > 0; best.pop()) res[i] = best.top();
+    return res;
+}
+
+void NswIndex::select_neighbors(std::vector<std::pair<float, uint32_t>>& cand, size_t m) const {
+    if (cand.size() <= m) return;
+    std::vector<std::pair<float, uint32_t>> kept;
+    for (const auto& c : cand) {
+        if (kept.size() >= m) break;
+        bool good = true;
+        for (const auto& s : kept) {
+            if (l2sqr(vec(c.second), vec(s.second), dim) < c.first) {
+                good = false;
+                break;
+            }
+        }
+        if (good) kept.emplace_back(c);
+    }
+    cand.swap(kept);
+}
+
+void NswIndex::add(uint32_t id) {
+    if (num_nodes == 0) {
+        // Node 0 is where searches start: it is complete before any other add() gets a node
+        std::unique_lock<std::shared_mutex> lock(room_mtx);
+        if (num_nodes == 0) {
+            make_room(1);
+            labels[0] = id;
+            num_nodes = 1;
+            return;
+        }
+    }
+    std::shared_lock<std::shared_mutex> lock(room_mtx);
+    uint32_t node = num_nodes++;
+    if (node >= labels.size()) {
+        lock.unlock();
+        {
+            std::unique_lock<std::shared_mutex> grow(room_mtx);
+            make_room(std::max<size_t>(node + 1, 2 * labels.size()));
+        }
+        lock.lock();
+    }
+    labels[node] = id;
+    auto cand = search_nodes(vec(node), std::max<size_t>(params.ef_construction, params.M), true);
+    select_neighbors(cand, params.M);
+    {
+        // Other nodes link to node only from here on
+        std::lock_guard<std::mutex> guard(node_mtx[node % kNodeLocks]);
+        for (const auto& c : cand) links[(size_t)node * max_degree + degree[node]++] = c.second;
+    }
+    for (const auto& c : cand) {
+        uint32_t u = c.second;
+        std::lock_guard<std::mutex> guard(node_mtx[u % kNodeLocks]);
+        uint32_t* adj = links.data() + (size_t)u * max_degree;
+        if (degree[u] < max_degree) {
+            adj[degree[u]++] = node;
+            continue;
+        }
+        // u is full: reselect its links among the old ones and node
+        std::vector<std::pair<float, uint32_t>> nb;
+        nb.emplace_back(c.first, node);
+        for (int e = 0; e < degree[u]; e++) nb.emplace_back(l2sqr(vec(adj[e]), vec(u), dim), adj[e]);
+        std::sort(nb.begin(), nb.end());
+        select_neighbors(nb, max_degree);
+        degree[u] = nb.size();
+        for (size_t e = 0; e < nb.size(); e++) adj[e] = nb[e].second;
+    }
+}
+
+bool NswIndex::seed(const StateIndex& part) {
+    if (part.kind() != NSW) return false;
+    const NswIndex& src = static_cast<const NswIndex&>(part);
+    if (num_nodes != 0 || src.max_degree != max_degree) return false;
+    size_t room = labels.size();
+    labels = src.labels;
+    links = src.links;
+    degree = src.degree;
+    num_nodes = src.num_nodes.load();
+    make_room(room);
+    return true;
+}
+
+void NswIndex::build_bulk(const PostingList& ids, const ParallelFor& parallel_for) {
+    if (num_nodes != 0) {
+        build(ids);
+        return;
+    }
+    labels = ids.decode();
+    size_t n = labels.size();
+    num_nodes = n;
+    NNDescent knn(max_degree);
+    knn.build(data, dim, labels, parallel_for);
+    auto nb = prune_knn_graph(knn, n, max_degree, [&](uint32_t a, uint32_t b) { return l2sqr(vec(a), vec(b), dim); }, parallel_for);
+    links.assign(n * max_degree, 0);
+    degree.assign(n, 0);
+    for (size_t u = 0; u < n; u++) {
+        degree[u] = nb[u].size();
+        std::copy(nb[u].begin(), nb[u].end(), links.begin() + u * max_degree);
+    }
+    // Searches start at node 0: link every node it cannot reach from the closest one it reaches
+    // (in place of that node's farthest link if it has no room)
+    std::vector<char> reached(n, 0);
+    std::vector<uint32_t> stack;
+    auto reach = [&](uint32_t s) {
+        reached[s] = 1;
+        stack.assign(1, s);
+        while (!stack.empty()) {
+            uint32_t u = stack.back();
+            stack.pop_back();
+            for (int e = 0; e < degree[u]; e++) {
+                uint32_t v = links[(size_t)u * max_degree + e];
+                if (!reached[v]) reached[v] = 1, stack.emplace_back(v);
+            }
+        }
+    };
+    if (n > 0) reach(0);
+    for (uint32_t u = 0; u < n; u++) {
+        if (reached[u]) continue;
+        uint32_t v = search_nodes(vec(u), params.M)[0].second;
+        uint32_t* adj = links.data() + (size_t)v * max_degree;
+        if (degree[v] < max_degree) {
+            adj[degree[v]++] = u;
+        }
+        else {
+            int far = 0;
+            for (int e = 1; e < degree[v]; e++) {
+                if (l2sqr(vec(adj[e]), vec(v), dim) > l2sqr(vec(adj[far]), vec(v), dim)) far = e;
+            }
+            adj[far] = u;
+        }
+        reach(u);
+    }
+}
+
+std::vector<std::pair<float, hnswlib::labeltype>> NswIndex::search(const float* q, size_t k) const {
+    std::vector<std::pair<float, hnswlib::labeltype>> res;
+    if (num_nodes == 0) return res;
+    auto nodes = search_nodes(q, std::max<size_t>(params.ef_search, k));
+    for (size_t i = 0; i < nodes.size() && i < k; i++) res.emplace_back(nodes[i].first, labels[nodes[i].second]);
+    return res;
+}
+
+size_t NswIndex::size_bytes() const {
+    return sizeof(NswIndex) + sizeof(uint32_t) * (labels.capacity() + links.capacity()) + sizeof(uint16_t) * degree.capacity();
+}
+
+void NswIndex::save(const std::string& path) const {
+    std::ofstream f(path, std::ios::binary);
+    write_params(f, params);
+    write_vector(f, labels, num_nodes);
+    write_vector(f, links, (uint64_t)num_nodes * max_degree);
+    write_vector(f, degree, num_nodes);
+}
+
+bool NswIndex::load(const std::string& path) {
+    std::ifstream f(path, std::ios::binary);
+    if (!read_params(f, params)) return false;
+    max_degree = 2 * params.M;
+    if (!read_vector(f, labels) || !read_vector(f, links) || !read_vector(f, degree)) return false;
+    num_nodes = labels.size();
+    return true;
+}
+
+int IvfIndex::nearest_list(const float* v) const {
+    int best = 0;
+    float best_dist = std::numeric_limits<float>::max();
+    for (size_t c = 0; c < lists.size(); c++) {
+        float d = l2sqr(centroids.data() + c * dim, v, dim);
+        if (d < best_dist) best = c, best_dist = d;
+    }
+    return best;
+}
+
+void IvfIndex::build(const PostingList& ids) {
+    std::vector<uint32_t> all = ids.decode();
+    if (all.empty()) return;
+    size_t nlist = std::max<size_t>(1, std::sqrt(double(all.size())));
+    // Initial centroids: evenly spaced ids
+    centroids.resize(nlist * dim);
+    for (size_t c = 0; c < nlist; c++) {
+        std::copy_n(data + (size_t)all[c * all.size() / nlist] * dim, dim, centroids.begin() + c * dim);
+    }
+    lists.assign(nlist, {});
+    std::vector<int> assign(all.size());
+    std::vector<float> sum(nlist * dim);
+    std::vector<int> count(nlist);
+    for (int it = 0; it < kIterations; it++) {
+        for (size_t i = 0; i < all.size(); i++) assign[i] = nearest_list(data + (size_t)all[i] * dim);
+        std::fill(sum.begin(), sum.end(), 0.0f);
+        std::fill(count.begin(), count.end(), 0);
+        for (size_t i = 0; i < all.size(); i++) {
+            const float* v = data + (size_t)all[i] * dim;
+            for (int j = 0; j < dim; j++) sum[assign[i] * dim + j] += v[j];
+            count[assign[i]]++;
+        }
+        for (size_t c = 0; c < nlist; c++) {
+            // An empty list keeps its centroid
+            if (count[c] == 0) continue;
+            for (int j = 0; j < dim; j++) centroids[c * dim + j] = sum[c * dim + j] / count[c];
+        }
+    }
+    for (size_t i = 0; i < all.size(); i++) lists[nearest_list(data + (size_t)all[i] * dim)].emplace_back(all[i]);
+}
+
+void IvfIndex::add(uint32_t id) {
+    std::lock_guard<std::mutex> lock(mtx);
+    const float* v = data + (size_t)id * dim;
+    if (lists.empty()) {
+        centroids.assign(v, v + dim);
+        lists.assign(1, {});
+    }
+    lists[nearest_list(v)].emplace_back(id);
+}
+
+size_t IvfIndex::size() const {
+    size_t res = 0;
+    for (const auto& list : lists) res += list.size();
+    return res;
+}
+
+std::vector<std::pair<float, hnswlib::labeltype>> IvfIndex::search(const float* q, size_t k) const {
+    std::vector<std::pair<float, hnswlib::labeltype>> res;
+    if (lists.empty()) return res;
+    std::vector<std::pair<float, int>> order(lists.size());
+    for (size_t c = 0; c < lists.size(); c++) order[c] = {l2sqr(centroids.data() + c * dim, q, dim), c};
+    size_t nprobe = std::min(lists.size(), std::max<size_t>(1, params.ef_search));
+    std::partial_sort(order.begin(), order.begin() + nprobe, order.end());
+    for (size_t p = 0; p < nprobe; p++) {
+        for (uint32_t id : lists[order[p].second]) res.emplace_back(l2sqr(data + (size_t)id * dim, q, dim), id);
+    }
+    return top_k(res, k);
+}
+
+size_t IvfIndex::size_bytes() const {
+    size_t res = sizeof(IvfIndex) + sizeof(float) * centroids.capacity();
+    for (const auto& list : lists) res += sizeof(list) + sizeof(uint32_t) * list.capacity();
+    return res;
+}
+
+void IvfIndex::save(const std::string& path) const {
+    std::ofstream f(path, std::ios::binary);
+    write_params(f, params);
+    write_vector(f, centroids);
+    uint64_t nlist = lists.size();
+    f.write((const char*)&nlist, sizeof(nlist));
+    for (const auto& list : lists) write_vector(f, list);
+}
+
+bool IvfIndex::load(const std::string& path) {
+    std::ifstream f(path, std::ios::binary);
+    uint64_t nlist = 0;
+    if (!read_params(f, params) || !read_vector(f, centroids) || !f.read((char*)&nlist, sizeof(nlist))) return false;
+    lists.assign(nlist, {});
+    for (auto& list : lists) {
+        if (!read_vector(f, list)) return false;
+    }
+    return true;
+}
+
+BackendPolicy::BackendPolicy(const std::string& spec) {
+    std::stringstream ss(spec);
+    std::string token;
+    while (std::getline(ss, token, ',')) {
+        if (token == "" || token == "hnsw") continue;
+        else if (token.find("flat=") == 0) parse_option_value(token, 5, flat_below);
+        else if (token.find("nsw=") == 0) parse_option_value(token, 4, nsw_below);
+        else if (token.find("ivf=") == 0) parse_option_value(token, 4, ivf_below);
+        else LOG_WARN("Unknown state index option '", token, "' ignored");
+    }
+}
+
+std::string BackendPolicy::spec() const {
+    std::vector<std::string> tokens;
+    if (flat_below > 0) tokens.emplace_back("flat=" + std::to_string(flat_below));
+    if (nsw_below > 0) tokens.emplace_back("nsw=" + std::to_string(nsw_below));
+    if (ivf_below > 0) tokens.emplace_back("ivf=" + std::to_string(ivf_below));
+    if (tokens.empty()) return "hnsw";
+    std::string res = tokens[0];
+    for (size_t i = 1; i < tokens.size(); i++) res += "," + tokens[i];
+    return res;
+}
+
+StateIndex::Kind BackendPolicy::choose(size_t n) const {
+    if (n < flat_below) return StateIndex::FLAT;
+    if (n < nsw_below) return StateIndex::NSW;
+    if (n < ivf_below) return StateIndex::IVF;
+    return StateIndex::HNSW;
+}
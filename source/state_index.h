@@ -0,0 +1,264 @@
+#ifndef STATE_INDEX_H
+#define STATE_INDEX_H
+
+#include "headers.h"
+#include "posting_list.h"
+#include "hnsw_policy.h"
+#include "nn_descent.h"
+
+// Nearest-neighbor index over the vectors of one automaton state. Vectors are not copied: an
+// index stores vector ids and reads the vectors from the shared data array (see set_data()).
+// Distances are squared L2, as in hnswlib, so that results of different states can be merged.
+class StateIndex {
+public:
+    enum Kind {
+        FLAT, // exhaustive scan of the ids
+        NSW,  // single-layer navigable small world graph
+        IVF,  // inverted lists around k-means centroids, scanned exhaustively
+        HNSW, // hnswlib::HierarchicalNSW
+        FROZEN // read-only compact copy of an HNSW graph (VectorMaton::freeze())
+    };
+
+    // M, ef_construction and the current search ef (graph backends; ef also sets the number of
+    // lists an IVF index probes).
+    HnswPolicy::Params params;
+
+    virtual ~StateIndex() {}
+
+    virtual Kind kind() const = 0;
+
+    // Index all of ids (bulk construction, called once on an empty or seeded index).
+    virtual void build(const PostingList& ids) { ids.for_each([&](uint32_t id) { add(id); }); }
+
+    // Index all of ids (empty index) by a bulk construction that can use several threads through
+    // parallel_for; graph backends link the approximate nearest neighbors found by NN-descent.
+    virtual void build_bulk(const PostingList& ids, const ParallelFor& parallel_for);
+
+    // Copy the graph of part, an index of the same backend and degree over some of the ids this
+    // (empty) index will hold, so that only the other ids have to be added: they are linked into
+    // the copy as into any graph under construction. False if part cannot be copied.
+    virtual bool seed(const StateIndex& part);
+
+    // Index all of ids (this index is empty) by the subgraph of global, a graph over all vectors,
+    // induced by ids, every level repaired where pruning left nodes with few links or unreachable.
+    // False if global cannot be used, e.g. it is of another backend.
+    virtual bool derive(const StateIndex& global, const PostingList& ids);
+
+    // Index one more vector. Thread-safe.
+    virtual void add(uint32_t id) = 0;
+
+    // Make room for n vectors in total.
+    virtual void resize(size_t n);
+
+    // Number of vectors the index holds room for (HNSW) or holds.
+    virtual size_t size() const = 0;
+
+    virtual void set_ef(int ef) { params.ef_search = ef; }
+
+    // Point the index to the (possibly reallocated) vector array.
+    virtual void set_data(const float* data) = 0;
+
+    // k nearest indexed vectors to q, closest first: (squared distance, vector id).
+    virtual std::vector<std::pair<float, hnswlib::labeltype>> search(const float* q, size_t k) const = 0;
+
+    // k nearest indexed vectors to q among those allowed, closest first. Graph backends traverse
+    // all vectors as an unfiltered search with this ef does and keep the allowed ones they meet,
+    // so fewer than k can come back: callers widen ef until enough do. Others scan everything.
+    virtual std::vector<std::pair<float, hnswlib::labeltype>> search_filtered(const float* q, size_t k, size_t ef,
+                                                                              const std::function<bool(uint32_t)>& allowed) const;
+
+    virtual size_t size_bytes() const = 0;
+
+    virtual void save(const std::string& path) const = 0;
+
+    static const char* kind_name(Kind kind);
+
+    // Bytes size_bytes() is expected to report for an index of this kind and parameters over n
+    // vectors of dimension dim (HNSW: upper levels by their expected count n / (M - 1)).
+    static size_t estimate_bytes(Kind kind, size_t n, int dim, const HnswPolicy::Params& p);
+
+    // Index saved by save() to path, nullptr if the file cannot be read.
+    static StateIndex* load(Kind kind, const std::string& path, hnswlib::SpaceInterface<float>* space, const float* data, int dim);
+};
+
+class HnswIndex : public StateIndex {
+public:
+    hnswlib::HierarchicalNSW<float>* hnsw;
+
+    HnswIndex(hnswlib::SpaceInterface<float>* space, size_t n, const float* data, const HnswPolicy::Params& p);
+    HnswIndex(hnswlib::SpaceInterface<float>* space, const std::string& path, const float* data);
+    ~HnswIndex() { delete hnsw; }
+
+    Kind kind() const override { return HNSW; }
+    void add(uint32_t id) override { hnsw->addPoint(id); }
+    void resize(size_t n) override { hnsw->resizeIndex(n); }
+    size_t size() const override { return hnsw->max_elements_; }
+    void set_ef(int ef) override;
+    bool seed(const StateIndex& part) override;
+    bool derive(const StateIndex& global, const PostingList& ids) override;
+    void build_bulk(const PostingList& ids, const ParallelFor& parallel_for) override;
+    void set_data(const float* data) override { hnsw->external_data_ = (const char*)data; }
+    std::vector<std::pair<float, hnswlib::labeltype>> search(const float* q, size_t k) const override;
+    std::vector<std::pair<float, hnswlib::labeltype>> search_filtered(const float* q, size_t k, size_t ef,
+                                                                      const std::function<bool(uint32_t)>& allowed) const override;
+    size_t size_bytes() const override { return hnsw->indexFileSize(); }
+    void save(const std::string& path) const override { hnsw->saveIndex(path); }
+
+private:
+    // Repair of one level of a graph not built by insertion: a node of the level with fewer than
+    // min_links links there (or unreachable from the entry point) gets new neighbors from a search
+    // of the level with this ef, chosen by the HNSW heuristic, which link back to it where they have
+    // room (or, to reconnect it, in place of the farthest link of the closest one).
+    void repair_level(int level, size_t ef, size_t min_links);
+};
+
+class FlatIndex : public StateIndex {
+public:
+    FlatIndex(const float* data, int dim) : data(data), dim(dim) {}
+
+    Kind kind() const override { return FLAT; }
+    void add(uint32_t id) override;
+    size_t size() const override { return ids.size(); }
+    void set_data(const float* data) override { this->data = data; }
+    std::vector<std::pair<float, hnswlib::labeltype>> search(const float* q, size_t k) const override;
+    size_t size_bytes() const override { return sizeof(FlatIndex) + sizeof(uint32_t) * ids.capacity(); }
+    void save(const std::string& path) const override;
+    bool load(const std::string& path);
+
+private:
+    const float* data;
+    int dim;
+    std::vector<uint32_t> ids;
+    std::mutex mtx;
+};
+
+// One layer of an HNSW graph: no level assignment or label table; every node keeps up to 2 M links
+// (chosen by the HNSW neighbor heuristic) and searches start at node 0. Concurrent add() calls
+// share the arrays (room is made by resize() or, exclusively, by add()) and lock the links of one
+// node at a time, through a small array of locks shared by the nodes.
+class NswIndex : public StateIndex {
+public:
+    NswIndex(const float* data, int dim, const HnswPolicy::Params& p);
+
+    Kind kind() const override { return NSW; }
+    void add(uint32_t id) override;
+    void resize(size_t n) override;
+    bool seed(const StateIndex& part) override;
+    void build_bulk(const PostingList& ids, const ParallelFor& parallel_for) override;
+    size_t size() const override { return num_nodes; }
+    void set_data(const float* data) override { this->data = data; }
+    std::vector<std::pair<float, hnswlib::labeltype>> search(const float* q, size_t k) const override;
+    size_t size_bytes() const override;
+    void save(const std::string& path) const override;
+    bool load(const std::string& path);
+
+private:
+    static const int kNodeLocks = 16;
+    const float* data;
+    int dim, max_degree;
+    std::atomic<uint32_t> num_nodes{0};
+    std::vector<uint32_t> labels;  // vector id of every node, room for labels.size() nodes
+    std::vector<uint32_t> links;   // max_degree entries per node
+    std::vector<uint16_t> degree;
+    std::shared_mutex room_mtx;    // held shared by add(), exclusively to make room
+    mutable std::mutex node_mtx[kNodeLocks]; // links of node u: node_mtx[u % kNodeLocks]
+
+    const float* vec(uint32_t node) const { return data + (size_t)labels[node] * dim; }
+
+    // Room for n nodes, caller holding room_mtx exclusively (or alone on the index).
+    void make_room(size_t n);
+
+    // The ef nodes closest to q found by a best-first search from node 0, closest first. With
+    // locked, the links of every node are read under its lock (add() running concurrently).
+    std::vector<std::pair<float, uint32_t>> search_nodes(const float* q, size_t ef, bool locked = false) const;
+
+    // Keep at most m of cand (sorted by distance to their common base) by the HNSW heuristic:
+    // a candidate is dropped if it is closer to an already kept one than to the base.
+    void select_neighbors(std::vector<std::pair<float, uint32_t>>& cand, size_t m) const;
+};
+
+// k-means (about sqrt(n) lists, a few Lloyd iterations over all vectors) with exhaustive scans of
+// the ef lists closest to the query (the recall graphs reach at the same ef).
+class IvfIndex : public StateIndex {
+public:
+    IvfIndex(const float* data, int dim, const HnswPolicy::Params& p) : data(data), dim(dim) { params = p; }
+
+    Kind kind() const override { return IVF; }
+    void build(const PostingList& ids) override;
+    void add(uint32_t id) override;
+    size_t size() const override;
+    void set_data(const float* data) override { this->data = data; }
+    std::vector<std::pair<float, hnswlib::labeltype>> search(const float* q, size_t k) const override;
+    size_t size_bytes() const override;
+    void save(const std::string& path) const override;
+    bool load(const std::string& path);
+
+private:
+    static const int kIterations = 8;
+    const float* data;
+    int dim;
+    std::vector<float> centroids; // lists.size() * dim
+    std::vector<std::vector<uint32_t>> lists;
+    std::mutex mtx;
+
+    int nearest_list(const float* v) const;
+};
+
+// Read-only copy of an HNSW graph: no per-node locks, label table or spare capacity, 4-byte labels,
+// and the links of every level in CSR arrays of local node ids (16-bit when there are at most 65536
+// nodes). Searched as hnswlib searches: greedy descent through the upper levels, then a best-first
+// search of level 0 with max(ef, k).
+class FrozenIndex : public StateIndex {
+public:
+    FrozenIndex(hnswlib::SpaceInterface<float>* space, const float* data, int dim);
+    FrozenIndex(const HnswIndex& graph, hnswlib::SpaceInterface<float>* space, const float* data, int dim);
+
+    Kind kind() const override { return FROZEN; }
+    void add(uint32_t id) override { LOG_ERROR("Cannot add vector ", id, " to a frozen graph"); }
+    size_t size() const override { return labels.size(); }
+    void set_data(const float* data) override { this->data = data; }
+    std::vector<std::pair<float, hnswlib::labeltype>> search(const float* q, size_t k) const override;
+    size_t size_bytes() const override;
+    void save(const std::string& path) const override;
+    bool load(const std::string& path);
+
+private:
+    const float* data;
+    int dim;
+    hnswlib::DISTFUNC<float> dist_func;
+    void* dist_param;
+    uint32_t entry_node = 0;
+    int32_t max_level = 0;
+    std::vector<uint32_t> labels;  // vector id of every node
+    // Level 0: the links of node u are links[offsets[u], offsets[u + 1]), in links16 or links32
+    std::vector<uint32_t> offsets;
+    std::vector<uint16_t> links16;
+    std::vector<uint32_t> links32;
+    // Upper levels of the nodes above level 0 (upper_nodes, increasing): from upper_offsets[j],
+    // for each level 1, 2, ... of node upper_nodes[j], the number of links and the links.
+    std::vector<uint32_t> upper_nodes, upper_offsets, upper_links;
+
+    float dist(const float* q, uint32_t u) const { return dist_func(q, data + (size_t)labels[u] * dim, dist_param); }
+
+    template <typename Id>
+    std::vector<std::pair<float, hnswlib::labeltype>> search_level0(const std::vector<Id>& links, const float* q, size_t k) const;
+};
+
+// Backend of a state's index by the number of vectors n it holds: FLAT if n < flat_below, else
+// NSW if n < nsw_below, else IVF if n < ivf_below, else HNSW. The default is HNSW for every state.
+class BackendPolicy {
+public:
+    size_t flat_below = 0, nsw_below = 0, ivf_below = 0;
+
+    BackendPolicy() {}
+
+    // Parse a comma-separated spec, e.g. "flat=500,nsw=5000" ("hnsw" alone is the default).
+    BackendPolicy(const std::string& spec);
+
+    // Spec string that parses back to this policy (single token, used for persistence).
+    std::string spec() const;
+
+    StateIndex::Kind choose(size_t n) const;
+};
+
+#endif
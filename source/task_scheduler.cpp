@@ -0,0 +1,84 @@
+#include "task_scheduler.h"
+#include <algorithm>
+#include <omp.h>
+
+TaskScheduler::TaskScheduler(int num_workers) : workers(std::max(num_workers, 1)) {}
+
+void TaskScheduler::push(int task, long long priority, int worker) {
+    if (worker < 0) {
+        worker = next_worker;
+        next_worker = (next_worker + 1) % workers.size();
+    }
+    Worker& w = workers[worker];
+    w.mtx.lock();
+    w.heap.emplace_back(priority, task);
+    std::push_heap(w.heap.begin(), w.heap.end());
+    w.size.store(w.heap.size(), std::memory_order_release);
+    w.mtx.unlock();
+    queued.fetch_add(1);
+    // A worker going to sleep increments sleeping before checking queued, so one of us sees the other
+    if (sleeping.load() > 0) notify(false);
+}
+
+bool TaskScheduler::pop(int worker, int& task) {
+    int n = workers.size();
+    for (int k = 0; k < n; k++) {
+        Worker& w = workers[(worker + k) % n];
+        if (w.size.load(std::memory_order_acquire) == 0) continue;
+        w.mtx.lock();
+        if (w.heap.empty()) {
+            w.mtx.unlock();
+            continue;
+        }
+        std::pop_heap(w.heap.begin(), w.heap.end());
+        task = w.heap.back().second;
+        w.heap.pop_back();
+        w.size.store(w.heap.size(), std::memory_order_release);
+        w.mtx.unlock();
+        queued.fetch_sub(1);
+        if (k > 0) steals.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+void TaskScheduler::notify(bool all) {
+    // Taking the lock orders the notification after a concurrent waiter's check
+    park_mtx.lock();
+    park_mtx.unlock();
+    if (all) park_cv.notify_all();
+    else park_cv.notify_one();
+}
+
+void TaskScheduler::wake() {
+    epoch.fetch_add(1);
+    notify(true);
+}
+
+void TaskScheduler::run(int num_tasks, const std::function<void(int, int)>& body, const std::function<bool()>& idle) {
+    remaining.store(num_tasks);
+    if (num_tasks == 0) return;
+    #pragma omp parallel num_threads(workers.size())
+    {
+        int worker = omp_get_thread_num();
+        int task;
+        while (remaining.load(std::memory_order_acquire) > 0) {
+            if (pop(worker, task)) {
+                body(task, worker);
+                if (remaining.fetch_sub(1) == 1) notify(true);
+                continue;
+            }
+            unsigned seen = epoch.load();
+            if (idle && idle()) continue;
+            std::unique_lock<std::mutex> lock(park_mtx);
+            sleeping.fetch_add(1);
+            if (queued.load() == 0 && remaining.load() > 0 && epoch.load() == seen) {
+                parks.fetch_add(1, std::memory_order_relaxed);
+                park_cv.wait(lock, [&] {
+                    return queued.load() > 0 || remaining.load() == 0 || epoch.load() != seen;
+                });
+            }
+            sleeping.fetch_sub(1);
+        }
+    }
+}
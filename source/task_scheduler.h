@@ -0,0 +1,58 @@
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Work-stealing executor for a fixed number of integer tasks on OpenMP threads.
+// Every worker owns a ready heap (highest priority first); a worker pops from its own heap,
+// steals the best task of another worker when its heap is empty, and parks on a condition
+// variable when no task is ready anywhere. Dependencies are kept by the caller: a task body
+// pushes the tasks it made ready (e.g. when their remaining-successor counter drops to zero).
+class TaskScheduler {
+public:
+    explicit TaskScheduler(int num_workers);
+
+    int num_workers() const { return workers.size(); }
+
+    // Make task ready. worker is the calling worker inside run(), or -1 to spread tasks over the
+    // workers round robin (before run()).
+    void push(int task, long long priority, int worker = -1);
+
+    // Run until num_tasks bodies have returned. body(task, worker) may push new tasks. A worker
+    // that finds no ready task calls idle() (if given) before parking; idle() returns whether it
+    // did some work.
+    void run(int num_tasks, const std::function<void(int, int)>& body, const std::function<bool()>& idle = nullptr);
+
+    // Wake all parked workers so that they call idle() again (e.g. when it has new work).
+    void wake();
+
+    size_t num_steals() const { return steals.load(); }
+    size_t num_parks() const { return parks.load(); }
+
+private:
+    struct alignas(64) Worker {
+        std::mutex mtx;
+        std::vector<std::pair<long long, int>> heap; // (priority, task)
+        std::atomic<int> size{0};
+    };
+    std::vector<Worker> workers;
+    int next_worker = 0;
+
+    // Hot counters on separate cache lines
+    alignas(64) std::atomic<int> queued{0};    // tasks in all heaps
+    alignas(64) std::atomic<int> remaining{0}; // tasks not finished
+    alignas(64) std::atomic<int> sleeping{0};
+    std::atomic<unsigned> epoch{0};            // bumped by wake()
+    std::mutex park_mtx;
+    std::condition_variable park_cv;
+    std::atomic<size_t> steals{0}, parks{0};
+
+    bool pop(int worker, int& task);
+    void notify(bool all);
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "cost_model.h"
+#include <iostream>
+#include <random>
+
+// Samples of n = 32, 64, ..., max_n timed exactly by the given scan and search costs
+static std::vector<CostModel::Sample> synthetic(double scan_per_vector, double search_base, double search_per_log, int max_n = 4096) {
+    std::vector<CostModel::Sample> samples;
+    for (int n = 32; n <= max_n; n *= 2) {
+        samples.push_back({n, scan_per_vector * n, search_base + search_per_log * std::log2(n), 0.5 * std::log2(n)});
+    }
+    return samples;
+}
+
+static bool near(double a, double b) { return std::abs(a - b) <= 1e-6 * std::max(1.0, std::abs(b)); }
+
+int main() {
+    // The fit recovers the timings' coefficients
+    std::cout << "Testing the fit:" << std::endl;
+    CostModel model;
+    model.samples = synthetic(0.02, 4, 2);
+    model.fit();
+    std::cout << "scan " << model.scan_per_vector << "us per vector, search " << model.search_base << " + " << model.search_per_log
+              << " log2(n) us" << std::endl;
+    assert(near(model.scan_per_vector, 0.02) && near(model.search_base, 4) && near(model.search_per_log, 2));
+
+    // A negative intercept is refitted through the origin
+    CostModel steep;
+    steep.samples = synthetic(0.02, -10, 3);
+    steep.fit();
+    assert(steep.search_base == 0 && steep.search_per_log > 0 && steep.search_per_log < 3);
+    std::cout << "Fit tests passed!" << std::endl;
+
+    // The threshold is the break-even of 0.02 n = 4 + 2 log2(n), on a 5% grid
+    std::cout << "Testing the threshold:" << std::endl;
+    double lo = 32, hi = 4096;
+    while (hi - lo > 1e-3) {
+        double mid = (lo + hi) / 2;
+        if (0.02 * mid > 4 + 2 * std::log2(mid)) hi = mid;
+        else lo = mid;
+    }
+    int threshold = model.choose_threshold(0);
+    std::cout << "break-even " << hi << ", threshold " << threshold << std::endl;
+    assert(threshold >= hi && threshold <= 1.05 * hi + 1);
+    assert(model.wants_graph(threshold) && !model.wants_graph(threshold / 1.05));
+
+    // With a latency target, the scans of up to 50us (2500 vectors) are kept
+    threshold = model.choose_threshold(50);
+    assert(threshold > 2500 && threshold <= 1.05 * 2500 + 1);
+
+    // Not extrapolated past the largest sample: scans of 0.001us per vector never reach a search
+    // within the 4096 sampled vectors, and larger sets get a graph
+    CostModel fast_scan;
+    fast_scan.samples = synthetic(0.001, 4, 2);
+    fast_scan.fit();
+    threshold = fast_scan.choose_threshold(0);
+    assert(threshold > 4096 && threshold <= 1.05 * 4096 + 1);
+    assert(!fast_scan.wants_graph(4096) && fast_scan.wants_graph(4097));
+    fast_scan.latency_target = 10;
+    assert(!fast_scan.wants_graph(9000) && fast_scan.wants_graph(11000));
+    std::cout << "Threshold tests passed!" << std::endl;
+
+    // Per state: a scan of 1400 vectors (28us, slower than a 24.9us search) is under a 30us target
+    // alone but not after 5us of inherited searches
+    std::cout << "Testing per-state decisions:" << std::endl;
+    model.latency_target = 30;
+    assert(!model.wants_graph(1400) && model.wants_graph(1400, 5));
+    // A scan faster than a search stays a scan however many graphs the state searches
+    assert(!model.wants_graph(1000, 100));
+    std::cout << "Per-state tests passed!" << std::endl;
+
+    // Calibration on real vectors: one sample per power of two the sets and queries allow
+    std::cout << "Testing calibration:" << std::endl;
+    int num = 600, dim = 8;
+    std::vector<float> vecs(num * dim);
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    for (float& v : vecs) v = uniform(rng);
+    hnswlib::L2Space space(dim);
+    CostModel calibrated;
+    calibrated.calibrate(vecs, dim, num, &space, HnswPolicy());
+    // 150 queries, sets of up to 450 vectors
+    assert(calibrated.samples.size() == 4 && calibrated.samples.back().n == 256);
+    assert(calibrated.scan_per_vector > 0 && calibrated.search_base >= 0 && calibrated.search_per_log >= 0);
+    calibrated.log();
+
+    // Saved and loaded with the per-state mode
+    calibrated.per_state = true;
+    calibrated.choose_threshold(5);
+    calibrated.save("test_cost_model.in");
+    CostModel loaded;
+    assert(loaded.load("test_cost_model.in"));
+    assert(loaded.per_state && loaded.threshold == calibrated.threshold && loaded.samples.size() == calibrated.samples.size());
+    assert(near(loaded.latency_target, 5) && std::abs(loaded.scan_per_vector - calibrated.scan_per_vector) < 1e-4);
+    std::remove("test_cost_model.in");
+    std::cout << "Calibration tests passed!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "fm_index.h"
+#include "sa.h"
+#include <iostream>
+
+int main() {
+    std::vector<std::string> small = {"banana", "bandana", "ananas"};
+    FMIndex fm;
+    fm.build(small);
+    GeneralizedSuffixAutomaton gsa;
+    for (int i = 0; i < small.size(); i++) gsa.add_string(i, small[i]);
+    for (std::string p : {"", "a", "ana", "ban", "nana", "anas", "dan", "s", "xyz", "bananas"}) {
+        int u = gsa.query(p), v = fm.query(p);
+        assert((u == -1) == (v == -1));
+        if (v == -1) continue;
+        assert(fm.ids(v) == gsa.st[u].ids);
+        std::cout << "Query \"" << p << "\" -> state " << v << " (" << fm.ids(v).size() << " strings)" << std::endl;
+    }
+    // Patterns of a single string share its state, only those of several strings have their own
+    assert(fm.query("dan") == fm.string_state(1) && fm.query("band") == fm.string_state(1));
+    assert(fm.query("s") == fm.string_state(2) && fm.query("nas") == fm.string_state(2));
+    assert(fm.query("ana") < fm.string_state(0));
+    assert(fm.num_states() < gsa.size());
+
+    // Random strings, compared against the GSA
+    std::cout << "Performing extra tests..." << std::endl;
+    std::vector<std::string> data;
+    for (int i = 0; i < 1000; i++) {
+        std::string s = "";
+        for (int j = 0; j < 1000; j++) {
+            s += rand() % 26 + 'a';
+        }
+        data.emplace_back(s);
+    }
+    fm.build(data);
+    gsa.clear();
+    for (int i = 0; i < data.size(); i++) gsa.add_string(i, data[i]);
+    gsa.freeze();
+    std::vector<std::string> patterns;
+    for (int i = 0; i < 1000; i++) {
+        std::string p = data[rand() % data.size()].substr(rand() % 990, 1 + rand() % 10);
+        if (i % 10 == 0) p[rand() % p.size()] = 'A'; // absent
+        patterns.emplace_back(p);
+    }
+    for (const auto& p : patterns) {
+        int u = gsa.query(p), v = fm.query(p);
+        assert((u == -1) == (v == -1));
+        if (v != -1) assert(fm.ids(v) == gsa.st[u].ids);
+    }
+    // Every state comes after its successors, whose ids are subsets
+    auto order = fm.build_order();
+    assert(order.size() == fm.num_states());
+    std::vector<int> pos(order.size()), succ;
+    for (int i = 0; i < order.size(); i++) pos[order[i]] = i;
+    for (int t = 0; t < 200; t++) {
+        int v = order[order.size() - 1 - rand() % 1000];
+        succ.clear();
+        fm.successors(v, succ);
+        auto ids = fm.ids(v).decode();
+        for (int u : succ) {
+            assert(pos[u] < pos[v]);
+            for (auto id : fm.ids(u).decode()) assert(std::binary_search(ids.begin(), ids.end(), id));
+        }
+    }
+    // Taking the ids of a branching node hands them over
+    int root = fm.query("");
+    assert(fm.take_ids(root).size() == data.size() && fm.ids(root).size() == 0);
+    std::cout << "Extra tests passed! States: " << fm.num_states() << " (GSA: " << gsa.size() << ")" << std::endl;
+
+    // Query time and size against the GSA
+    int rounds = 100;
+    unsigned long long start_time = currentTime();
+    long long found = 0;
+    for (int r = 0; r < rounds; r++) {
+        for (const auto& p : patterns) found += gsa.query(p);
+    }
+    unsigned long long gsa_time = currentTime() - start_time;
+    start_time = currentTime();
+    for (int r = 0; r < rounds; r++) {
+        for (const auto& p : patterns) found += fm.query(p);
+    }
+    unsigned long long fm_time = currentTime() - start_time;
+    std::cout << "Query time per pattern: GSA " << 1000.0 * gsa_time / (rounds * patterns.size()) << "ns, FM-index "
+              << 1000.0 * fm_time / (rounds * patterns.size()) << "ns (" << found % 2 << ")" << std::endl;
+    size_t fm_bytes = fm.size_bytes();
+    for (int v = 0; v < fm.num_states(); v++) fm.take_ids(v);
+    std::cout << "Structure bytes: GSA " << gsa.size_bytes() << ", FM-index " << fm_bytes << " (" << fm.size_bytes()
+              << " once the ids are taken)" << std::endl;
+
+    // Token mode
+    std::cout << "Performing token mode tests..." << std::endl;
+    FMIndex tfm;
+    tfm.tokenizer = Tokenizer("whitespace");
+    tfm.normalizer = Normalizer("fold");
+    tfm.build({"the quick brown fox", "The Quick red fox", "brown the quick"});
+    assert(tfm.ids(tfm.query("the QUICK")).decode() == std::vector<uint32_t>({0, 1, 2}));
+    assert(tfm.ids(tfm.query("quick brown")).decode() == std::vector<uint32_t>({0}));
+    assert(tfm.query("qui") == -1);
+    assert(tfm.query("fox the") == -1);
+    std::cout << "Token mode tests passed!" << std::endl;
+
+    return 0;
+}
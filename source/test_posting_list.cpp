@@ -0,0 +1,103 @@
+#include "posting_list.h"
+#include <iostream>
+#include <random>
+
+// Sorted distinct ids: n ids with gaps drawn from [1, max_gap]
+static std::vector<uint32_t> random_ids(std::mt19937& rng, size_t n, uint32_t max_gap, uint32_t start = 0) {
+    std::vector<uint32_t> ids;
+    uint32_t id = start;
+    for (size_t i = 0; i < n; i++) {
+        ids.emplace_back(id);
+        id += 1 + rng() % max_gap;
+    }
+    return ids;
+}
+
+static void check_list(const PostingList& list, const std::vector<uint32_t>& ids) {
+    assert(list.size() == ids.size() && list.decode() == ids);
+    assert(ids.empty() || list.back() == ids.back());
+    std::vector<uint32_t> seen;
+    PostingList::Reader reader(list);
+    uint32_t id;
+    while (reader.next(id)) seen.emplace_back(id);
+    assert(seen == ids);
+    for (size_t i = 0; i < ids.size(); i += 7) {
+        assert(list.contains(ids[i]));
+        if (i + 1 < ids.size() && ids[i] + 1 < ids[i + 1]) assert(!list.contains(ids[i] + 1));
+    }
+    assert(!list.contains(ids.empty() ? 0 : ids.back() + 1));
+}
+
+int main() {
+    std::mt19937 rng(7);
+
+    // Round trips across the inline, tail, packed and bitmap encodings
+    std::cout << "Testing round trips:" << std::endl;
+    for (size_t n : {0, 1, 2, 3, 127, 128, 129, 256, 1000}) {
+        for (uint32_t gap : {1u, 3u, 1000u, 1u << 21}) {
+            auto ids = random_ids(rng, n, gap, gap == 1 ? 5 : 0);
+            PostingList list(ids);
+            check_list(list, ids);
+            // The vector constructor leaves no spare capacity, lists of kInline ids none at all
+            if (n <= PostingList::kInline) assert(list.size_bytes() == 0);
+            PostingList appended;
+            for (auto id : ids) appended.push_back(id);
+            check_list(appended, ids);
+            appended.shrink_to_fit();
+            check_list(appended, ids);
+            assert(appended.size_bytes() <= list.size_bytes() || appended.is_bitmap() != list.is_bitmap());
+            PostingList dense(ids);
+            dense.to_bitmap();
+            check_list(dense, ids);
+        }
+    }
+    // Bit width 32 and ids near the top of the range
+    std::vector<uint32_t> wide;
+    for (int i = 0; i < 300; i++) wide.emplace_back(i % 2 ? 0x7fffffffu + i : i);
+    std::sort(wide.begin(), wide.end());
+    check_list(PostingList(wide), wide);
+    // Dense ids switch to a bitmap by themselves and keep accepting ids
+    auto dense_ids = random_ids(rng, 5000, 3);
+    PostingList dense(dense_ids);
+    assert(dense.is_bitmap() && dense.size_bytes() < sizeof(uint32_t) * dense_ids.size() / 8);
+    dense_ids.emplace_back(dense_ids.back() + 100);
+    dense.push_back(dense_ids.back());
+    check_list(dense, dense_ids);
+    // Appending after shrink_to_fit, copies and moves
+    auto ids = random_ids(rng, 200, 50);
+    PostingList list(std::vector<uint32_t>(ids.begin(), ids.begin() + 2));
+    for (size_t i = 2; i < ids.size(); i++) list.push_back(ids[i]);
+    check_list(list, ids);
+    PostingList copy = list, moved = std::move(copy);
+    check_list(moved, ids);
+    assert(copy.empty() || copy == list);
+    copy = moved;
+    moved.clear();
+    assert(moved.empty() && moved.size_bytes() == 0);
+    check_list(copy, ids);
+    std::cout << "Round trip tests passed!" << std::endl;
+
+    // Merge, difference, equality and hash against std::set_union / std::set_difference
+    std::cout << "Testing merge, difference and equality:" << std::endl;
+    for (int round = 0; round < 200; round++) {
+        auto a = random_ids(rng, rng() % 600, 1 + rng() % 20, rng() % 50);
+        auto b = random_ids(rng, rng() % 600, 1 + rng() % 20, rng() % 50);
+        if (round % 10 == 0) b.assign(a.begin(), a.begin() + a.size() / 2);
+        std::vector<uint32_t> uni, diff;
+        std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(uni));
+        std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(diff));
+        for (int mode = 0; mode < 4; mode++) {
+            PostingList la(a), lb(b);
+            if (mode & 1) la.to_bitmap();
+            if (mode & 2) lb.to_bitmap();
+            check_list(PostingList::merge(la, lb), uni);
+            check_list(PostingList::difference(la, lb), diff);
+            assert((la == lb) == (a == b) && (la == PostingList(a)) && la.hash() == PostingList(a).hash());
+        }
+    }
+    // Lists with the same size and last id that differ inside
+    PostingList x(std::vector<uint32_t>{1, 5, 9}), y(std::vector<uint32_t>{1, 6, 9}), z(std::vector<uint32_t>{1, 5, 9});
+    assert(x != y && x == z && x.hash() != y.hash());
+    std::cout << "Merge, difference and equality tests passed!" << std::endl;
+    return 0;
+}
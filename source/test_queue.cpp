@@ -8,7 +8,82 @@
 #include <unordered_set>
 #include <mutex>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <omp.h>
+
 #include "mpmc_queue.h"  // include your MPMCQueue implementation
+#include "task_scheduler.h"
+
+// Dependency tree shaped like the build_parallel DAG: task t > 0 has parent (t - 1) / FANOUT, a
+// task is ready once all of its children are done, the leaves are ready from the start.
+constexpr int FANOUT = 4;
+
+static void work(int task, int spin, int root_ms) {
+    if (task == 0 && root_ms > 0) {
+        // One long task at the end, like the near-full graph of the root state
+        std::this_thread::sleep_for(std::chrono::milliseconds(root_ms));
+        return;
+    }
+    volatile int x = 0;
+    for (int i = 0; i < spin; i++) x = x + i;
+}
+
+static int num_children(int t, int n) {
+    return std::max(0, std::min(n, FANOUT * t + FANOUT + 1) - (FANOUT * t + 1));
+}
+
+// Returns wall and process CPU seconds.
+static std::pair<double, double> run_mpmc(int n, int threads, int spin, int root_ms) {
+    std::vector<std::atomic<int>> deg(n);
+    MPMCQueue q(1 << (int(log2(n)) + 1));
+    for (int t = 0; t < n; t++) {
+        deg[t] = num_children(t, n);
+        if (deg[t] == 0) q.enqueue(t);
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::clock_t cpu = std::clock();
+    std::atomic<int> consumed{0};
+    #pragma omp parallel num_threads(threads)
+    {
+        int t;
+        while (consumed.load(std::memory_order_acquire) < n) {
+            if (q.dequeue(t)) {
+                consumed.fetch_add(1, std::memory_order_acq_rel);
+                work(t, spin, root_ms);
+                if (t > 0 && deg[(t - 1) / FANOUT].fetch_sub(1) == 1) q.enqueue((t - 1) / FANOUT);
+            } else {
+                #pragma omp flush
+            }
+        }
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return {wall, double(std::clock() - cpu) / CLOCKS_PER_SEC};
+}
+
+static std::pair<double, double> run_scheduler(int n, int threads, int spin, int root_ms, size_t& steals, size_t& parks) {
+    std::vector<std::atomic<int>> deg(n);
+    TaskScheduler scheduler(threads);
+    for (int t = 0; t < n; t++) {
+        deg[t] = num_children(t, n);
+        if (deg[t] == 0) scheduler.push(t, 0);
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::clock_t cpu = std::clock();
+    std::vector<char> done(n, 0);
+    scheduler.run(n, [&](int t, int worker) {
+        assert(!done[t]);
+        done[t] = 1;
+        work(t, spin, root_ms);
+        if (t > 0 && deg[(t - 1) / FANOUT].fetch_sub(1) == 1) scheduler.push((t - 1) / FANOUT, 0, worker);
+    });
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (int t = 0; t < n; t++) assert(done[t]);
+    steals = scheduler.num_steals(), parks = scheduler.num_parks();
+    return {wall, double(std::clock() - cpu) / CLOCKS_PER_SEC};
+}
 
 int main() {
     constexpr size_t QUEUE_CAPACITY = 1 << 14;
@@ -81,5 +156,19 @@ int main() {
     assert(results.size() == static_cast<size_t>(expected));
 
     std::cout << "MPMC queue test PASSED ✅" << std::endl;
+
+    // Contention benchmark: spinning MPMC loop (former build_parallel) vs the task scheduler
+    int bench_threads = std::max(2u, std::thread::hardware_concurrency());
+    struct Workload { const char* name; int n, spin, root_ms; };
+    for (auto w : {Workload{"tiny tasks", 1 << 20, 0, 0}, Workload{"small tasks", 1 << 18, 2000, 0},
+                   Workload{"long root task", 1 << 16, 2000, 300}}) {
+        size_t steals, parks;
+        auto spin = run_mpmc(w.n, bench_threads, w.spin, w.root_ms);
+        auto sched = run_scheduler(w.n, bench_threads, w.spin, w.root_ms, steals, parks);
+        std::cout << w.name << " (" << w.n << " tasks, " << bench_threads << " threads): MPMC spin "
+                  << spin.first << "s wall / " << spin.second << "s CPU, scheduler " << sched.first << "s wall / "
+                  << sched.second << "s CPU (" << steals << " steals, " << parks << " parks)" << std::endl;
+    }
+    std::cout << "Task scheduler test PASSED" << std::endl;
     return 0;
 }
\ No newline at end of file
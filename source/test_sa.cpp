@@ -16,7 +16,7 @@ int main() {
 
     auto print_res = [](GeneralizedSuffixAutomaton* gsa, std::string pat, int id){
         std::vector<uint32_t> res = {};
-        if (id != -1) res = gsa->st[id].ids;
+        if (id != -1) res = gsa->st[id].ids.decode();
         std::cout << "Query \"" << pat << "\" -> {";
         for (size_t i=0;i<res.size();++i) {
             std::cout << res[i];
@@ -57,7 +57,7 @@ int main() {
                 std.emplace_back(j);
             }
         }
-        auto& res = gsa.st[gsa.query(s)].ids;
+        auto res = gsa.st[gsa.query(s)].ids.decode();
         assert(std.size() == res.size());
         for (int j = 0; j < std.size(); j++) {
             assert(std[j] == res[j]);
@@ -65,6 +65,243 @@ int main() {
     }
     std::cout << "Extra tests passed!" << std::endl;
     std::cout << "Total number of string IDs in GSA: " << gsa.size_tot() << std::endl;
+    std::cout << "Bytes of id lists: " << gsa.ids_bytes() << " (uncompressed: " << sizeof(uint32_t) * gsa.size_tot() << ")" << std::endl;
+
+    // Parallel construction tests
+    std::cout << "Performing parallel construction tests..." << std::endl;
+    GeneralizedSuffixAutomaton pgsa;
+    pgsa.build_parallel(data, 4);
+    assert(pgsa.size() == gsa.size());
+    assert(pgsa.size_tot() == gsa.size_tot());
+    for (int i = 0; i < 100; i++) {
+        std::string s = data[rand() % data.size()].substr(rand() % 990, 1 + rand() % 10);
+        int u = gsa.query(s), v = pgsa.query(s);
+        assert(gsa.st[u].ids == pgsa.st[v].ids);
+        assert(gsa.st[u].len == pgsa.st[v].len);
+        assert(gsa.st[gsa.st[u].link].len == pgsa.st[pgsa.st[v].link].len);
+    }
+    std::cout << "Parallel construction tests passed!" << std::endl;
+
+    // External construction tests: ~100 strings per chunk, 10 chunks merged from disk
+    std::cout << "Performing external construction tests..." << std::endl;
+    std::string spill_dir = (std::filesystem::temp_directory_path() / "gsa_test_spill").string();
+    GeneralizedSuffixAutomaton xgsa, xdgsa;
+    bool built = xgsa.build_external(data, 100 * 1000 * 400, spill_dir);
+    xdgsa.set_deferred_ids(true);
+    built = built && xdgsa.build_external(data, 100 * 1000 * 400, spill_dir);
+    assert(built);
+    assert(xgsa.size() == gsa.size() && xgsa.size_tot() == gsa.size_tot());
+    xgsa.freeze();
+    xdgsa.freeze();
+    xdgsa.index_ids();
+    assert(std::filesystem::is_empty(spill_dir));
+    for (int i = 0; i < 100; i++) {
+        std::string s = data[rand() % data.size()].substr(rand() % 990, 1 + rand() % 10);
+        int u = gsa.query(s), v = xgsa.query(s), w = xdgsa.query(s);
+        assert(gsa.st[u].ids == xgsa.st[v].ids && gsa.st[u].ids == xdgsa.materialize_ids(w));
+    }
+    // A spill directory that cannot be created fails the build
+    std::ofstream(spill_dir + "_file") << "not a directory";
+    GeneralizedSuffixAutomaton fgsa;
+    assert(!fgsa.build_external(data, 100 * 1000 * 400, spill_dir + "_file/spill"));
+    std::filesystem::remove(spill_dir + "_file");
+    std::filesystem::remove_all(spill_dir);
+    std::cout << "External construction tests passed!" << std::endl;
+
+    // Frozen layout tests
+    std::cout << "Performing frozen layout tests..." << std::endl;
+    std::vector<std::string> patterns;
+    std::vector<std::vector<uint32_t>> expected;
+    for (int i = 0; i < 100; i++) {
+        std::string s = "";
+        for (int j = 0; j < 1 + i % 4; j++) {
+            s += rand() % 26 + 'a';
+        }
+        patterns.emplace_back(s);
+        int v = gsa.query(s);
+        expected.emplace_back(v == -1 ? std::vector<uint32_t>() : gsa.st[v].ids.decode());
+    }
+    size_t bytes_before = gsa.size_bytes();
+    gsa.freeze();
+    assert(gsa.edge_label.width() == 1); // bytes in char mode
+    for (int i = 0; i < patterns.size(); i++) {
+        int v = gsa.query(patterns[i]);
+        assert(v == -1 ? expected[i].empty() : gsa.st[v].ids.decode() == expected[i]);
+    }
+    auto order = gsa.topo_sort();
+    std::vector<int> pos(order.size());
+    for (int i = 0; i < order.size(); i++) pos[order[i]] = i;
+    for (int i = 0; i < gsa.size(); i++) {
+        gsa.for_each_next(i, [&](GeneralizedSuffixAutomaton::Symbol, int v) {
+            assert(pos[i] < pos[v]);
+        });
+    }
+    std::cout << "Frozen layout tests passed! Structure bytes: " << bytes_before << " -> " << gsa.size_bytes() << std::endl;
+
+    // Deferred id tests
+    std::cout << "Performing deferred id tests..." << std::endl;
+    GeneralizedSuffixAutomaton dgsa, egsa, dpgsa;
+    dgsa.set_deferred_ids(true);
+    egsa.set_deferred_ids(true);
+    dpgsa.set_deferred_ids(true);
+    for (int i = 0; i < data.size(); i++) {
+        dgsa.add_string(i, data[i]);
+        egsa.add_string(i, data[i]);
+    }
+    dpgsa.build_parallel(data, 4);
+    assert(dgsa.size() == gsa.size() && dgsa.size_tot() == 0);
+    dgsa.freeze();
+    dgsa.index_ids();
+    dpgsa.freeze();
+    dpgsa.index_ids();
+    egsa.propagate_ids();
+    assert(!egsa.deferred_ids);
+    assert(egsa.size_tot() == gsa.size_tot());
+    for (int i = 0; i < 100; i++) {
+        std::string s = data[rand() % data.size()].substr(rand() % 990, 1 + rand() % 10);
+        int u = gsa.query(s);
+        assert(dgsa.materialize_ids(dgsa.query(s)) == gsa.st[u].ids);
+        assert(dpgsa.materialize_ids(dpgsa.query(s)) == gsa.st[u].ids);
+        assert(egsa.st[egsa.query(s)].ids == gsa.st[u].ids);
+    }
+    assert(dgsa.materialize_ids(0).size() == data.size());
+    std::cout << "Deferred id tests passed!" << std::endl;
+
+    // Byte alphabet and normalization tests
+    std::cout << "Performing normalization tests..." << std::endl;
+    // The default keeps the 'a'..'z' alphabet of the original automaton
+    GeneralizedSuffixAutomaton agsa;
+    agsa.add_string(0, "Hello, World 42!");
+    agsa.freeze();
+    assert(agsa.dropped_chars == 8 && agsa.alphabet_size == 5);
+    assert(agsa.query("elloorld") != -1 && agsa.query("o, W") == agsa.query("o"));
+    GeneralizedSuffixAutomaton bgsa;
+    bgsa.normalizer = Normalizer("drop=none");
+    assert(Normalizer(bgsa.normalizer.spec()).drop == Normalizer::DROP_NONE && Normalizer("none").identity());
+    bgsa.add_string(0, "Hello, World 42!");
+    bgsa.add_string(1, "snake_case-id.v2");
+    bgsa.add_string(2, "caf\xc3\xa9 cr\xc3\xa8me");
+    bgsa.freeze();
+    assert(bgsa.dropped_chars == 0);
+    assert(bgsa.query("o, W") != -1 && bgsa.st[bgsa.query("o, W")].ids.decode() == std::vector<uint32_t>({0}));
+    assert(bgsa.query("_case-") != -1 && bgsa.st[bgsa.query("_case-")].ids.decode() == std::vector<uint32_t>({1}));
+    assert(bgsa.query("\xc3\xa9 c") != -1 && bgsa.st[bgsa.query("\xc3\xa9 c")].ids.decode() == std::vector<uint32_t>({2}));
+    assert(bgsa.query("hello") == -1);
+
+    GeneralizedSuffixAutomaton ngsa;
+    ngsa.normalizer = Normalizer("fold,digits,utf8,drop=nonalnum");
+    assert(Normalizer(ngsa.normalizer.spec()).spec() == ngsa.normalizer.spec());
+    ngsa.add_string(0, "Hello, World 42!");
+    ngsa.add_string(1, "snake_case-id.v2");
+    ngsa.add_string(2, "caf\xc3\xa9 cr\xc3\xa8me\xff");
+    ngsa.freeze();
+    assert(ngsa.dropped_chars == 4 + 3 + 2);
+    assert(ngsa.st[ngsa.query("HELLOworld")].ids.decode() == std::vector<uint32_t>({0}));
+    assert(ngsa.st[ngsa.query("world 17")].ids.decode() == std::vector<uint32_t>({0}));
+    assert(ngsa.st[ngsa.query("v9")].ids.decode() == std::vector<uint32_t>({1}));
+    assert(ngsa.st[ngsa.query("\xc3\xa9" "cr")].ids.decode() == std::vector<uint32_t>({2}));
+    assert(ngsa.alphabet_size < 40);
+    std::cout << "Normalization tests passed! Alphabet size: " << ngsa.alphabet_size << std::endl;
+
+    // Max pattern length tests
+    std::cout << "Performing max pattern length tests..." << std::endl;
+    const int L = 5;
+    std::vector<std::string> small(data.begin(), data.begin() + 200);
+    GeneralizedSuffixAutomaton full, lgsa, lpgsa;
+    lgsa.max_pattern_length = lpgsa.max_pattern_length = L;
+    lpgsa.set_deferred_ids(true);
+    for (int i = 0; i < small.size(); i++) {
+        full.add_string(i, small[i]);
+        lgsa.add_string(i, small[i]);
+    }
+    lpgsa.build_parallel(small, 4);
+    full.freeze();
+    lgsa.freeze();
+    lpgsa.freeze();
+    lpgsa.index_ids();
+    // Insert strings after pruning as well
+    for (int i = small.size(); i < small.size() + 20; i++) {
+        lgsa.add_string(i, data[i]);
+        full.add_string(i, data[i]);
+    }
+    lgsa.freeze();
+    for (int i = 0; i < 200; i++) {
+        int len = 1 + i % L;
+        std::string p = data[rand() % 220].substr(rand() % (1000 - len), len);
+        int u = full.query(p), v = lgsa.query(p), w = lpgsa.query(p);
+        assert(u != -1 && v != -1);
+        assert(full.st[u].ids == lgsa.st[v].ids);
+        std::vector<uint32_t> expected;
+        for (auto id : full.st[u].ids.decode()) {
+            if (id < small.size()) expected.emplace_back(id);
+        }
+        assert(w == -1 ? expected.empty() : lpgsa.materialize_ids(w).decode() == expected);
+    }
+    assert(lgsa.query(data[0].substr(0, L + 1)) == -1);
+    // Repetitive strings (mutated copies of one string): states are pruned during construction
+    std::string base;
+    for (int j = 0; j < 1000; j++) base += rand() % 20 + 'a';
+    std::vector<std::string> family(300, base);
+    GeneralizedSuffixAutomaton rfull, rgsa;
+    rgsa.max_pattern_length = 2 * L;
+    size_t peak = 0;
+    for (int i = 0; i < family.size(); i++) {
+        for (int m = 0; m < 30; m++) family[i][rand() % 1000] = rand() % 20 + 'a';
+        rfull.add_string(i, family[i]);
+        rgsa.add_string(i, family[i]);
+        peak = std::max(peak, (size_t)rgsa.size());
+    }
+    rfull.freeze();
+    rgsa.freeze();
+    assert(2 * peak < rfull.size());
+    for (int i = 0; i < 1000; i++) {
+        int len = 1 + i % (2 * L);
+        std::string p = family[rand() % family.size()].substr(rand() % (1000 - len), len);
+        assert(rfull.st[rfull.query(p)].ids == rgsa.st[rgsa.query(p)].ids);
+    }
+    std::cout << "Max pattern length tests passed! States: " << full.size() << " -> " << lgsa.size()
+              << ", repetitive strings: " << rfull.size() << " -> " << rgsa.size() << " (at most " << peak << " during construction)" << std::endl;
+
+    // Token mode tests
+    std::cout << "Performing token mode tests..." << std::endl;
+    Tokenizer ident("identifier");
+    assert(ident.split("parseHTTPResponse2_v") == std::vector<std::string>({"parse", "http", "response", "2", "v"}));
+    assert(Tokenizer("whitespace").split("  a\tbb  c ") == std::vector<std::string>({"a", "bb", "c"}));
+    GeneralizedSuffixAutomaton tgsa;
+    tgsa.tokenizer = Tokenizer("whitespace");
+    tgsa.normalizer = Normalizer("fold");
+    tgsa.add_string(0, "the quick brown fox");
+    tgsa.add_string(1, "The Quick red fox");
+    tgsa.add_string(2, "brown the quick");
+    tgsa.freeze();
+    assert(tgsa.tokenizer.vocab.size() == 5);
+    assert(tgsa.st[tgsa.query("the QUICK")].ids.decode() == std::vector<uint32_t>({0, 1, 2}));
+    assert(tgsa.st[tgsa.query("quick brown")].ids.decode() == std::vector<uint32_t>({0}));
+    assert(tgsa.st[tgsa.query("brown the")].ids.decode() == std::vector<uint32_t>({2}));
+    assert(tgsa.query("qui") == -1); // no partial tokens
+    assert(tgsa.query("quick green") == -1); // unknown token
+    assert(tgsa.query("fox the") == -1); // no matches across strings
+    // Parallel token build over words of the test data
+    std::vector<std::string> sentences(100);
+    for (int i = 0; i < sentences.size(); i++) {
+        for (int j = 0; j < 30; j++) sentences[i] += data[i].substr(j * 3, 1 + j % 3) + " ";
+    }
+    GeneralizedSuffixAutomaton tseq, tpar;
+    tseq.tokenizer = tpar.tokenizer = Tokenizer("whitespace");
+    for (int i = 0; i < sentences.size(); i++) tseq.add_string(i, sentences[i]);
+    tpar.build_parallel(sentences, 4);
+    tseq.freeze();
+    assert(tseq.size() == tpar.size() && tseq.size_tot() == tpar.size_tot());
+    for (int i = 0; i < 200; i++) {
+        auto tokens = tseq.tokenizer.split(sentences[rand() % sentences.size()]);
+        int from = rand() % tokens.size(), len = 1 + rand() % 3;
+        std::string p;
+        for (int j = from; j < tokens.size() && j < from + len; j++) p += tokens[j] + " ";
+        int u = tseq.query(p), v = tpar.query(p);
+        assert(u != -1 && v != -1 && tseq.st[u].ids == tpar.st[v].ids);
+    }
+    assert(tseq.tokenizer.vocab.size() > 256 && tseq.edge_label.width() == 2 && tpar.edge_label.width() == 2);
+    std::cout << "Token mode tests passed! Vocabulary size: " << tseq.tokenizer.vocab.size() << ", states: " << tseq.size() << std::endl;
 
     return 0;
 }
@@ -1,5 +1,6 @@
 #include "vectormaton.h"
 #include <iostream>
+#include <random>
 
 int main() {
     std::vector<float> vecs(15);
@@ -88,6 +89,32 @@ int main() {
     std::cout << "2-NNs of {9.0, 10.0, 11.0} associated with 'banana'." << std::endl;
     print_res(pdb2.query(query_vec1, "banana", 2)); // {0}
 
+    // Giant states built by several threads: the wall time stays within the total work done on
+    // one thread (no thread waits by spinning), and drops below it given the cores
+    std::cout << "Testing shared construction of giant states:" << std::endl;
+    {
+        int num = 4000, d = 16, threads = 4;
+        std::vector<float> big_vecs(num * d);
+        std::vector<std::string> big_strs(num);
+        for (size_t i = 0; i < big_vecs.size(); i++) big_vecs[i] = (i * 7919 % 100003) / 100003.0f;
+        for (int i = 0; i < num; i++) big_strs[i] = std::string("ab").substr(i % 2) + char('a' + i % 7);
+        double seconds[2];
+        for (int t = 0; t < 2; t++) {
+            VectorMaton bdb;
+            bdb.set_min_build_threshold(100);
+            bdb.set_parallel_build_cutoff(500);
+            bdb.set_vectors(big_vecs, d);
+            bdb.set_strings(big_strs);
+            unsigned long long start_time = currentTime();
+            bdb.build_parallel(t == 0 ? 1 : threads);
+            seconds[t] = (currentTime() - start_time) / 1e6;
+            assert(bdb.query(big_vecs.data(), "a", 1) == std::vector<int>({0}));
+        }
+        std::cout << "1 thread: " << seconds[0] << "s, " << threads << " threads: " << seconds[1] << "s ("
+                  << std::thread::hardware_concurrency() << " cores)" << std::endl;
+        assert(seconds[1] <= 1.25 * seconds[0] + 0.05);
+    }
+
     // Test insert-build-partial
     std::cout << "Testing insertion for build-partial:" << std::endl;
     VectorMaton pdb3;
@@ -112,5 +139,449 @@ int main() {
     std::cout << "After insertion of {12.0, 13.0, 14.0} with string 'ana':" << std::endl;
     print_res(pdb4.query(query_vec1, "ana", 3)); // {2, 3, 5}
 
+    // Test graphs seeded from successor graphs
+    std::cout << "Testing merged graph construction:" << std::endl;
+    for (std::string spec : {"hnsw", "nsw=100"}) {
+        VectorMaton gdb;
+        gdb.set_min_build_threshold(0);
+        gdb.set_merge_graphs(true);
+        gdb.set_backend_policy(BackendPolicy(spec));
+        gdb.set_vectors(vecs, 3);
+        gdb.set_strings(strings);
+        gdb.build_full();
+        assert(gdb.vertex_num() == db.vertex_num());
+        for (std::string p : {"a", "ana", "nana", "banana"}) assert(gdb.query(query_vec1, p, 5) == db.query(query_vec1, p, 5));
+    }
+
+    VectorMaton ddb;
+    ddb.set_min_build_threshold(0);
+    ddb.set_derive_graphs(true);
+    ddb.set_vectors(vecs, 3);
+    ddb.set_strings(strings);
+    ddb.build_smart();
+    assert(ddb.vertex_num() == pdb.vertex_num());
+    for (std::string p : {"a", "ana", "nana", "banana"}) assert(ddb.query(query_vec1, p, 5) == pdb.query(query_vec1, p, 5));
+
+    // Test graphs bulk-built by NN-descent
+    std::cout << "Testing NN-descent graph construction:" << std::endl;
+    for (std::string spec : {"hnsw", "nsw=100"}) {
+        VectorMaton ndb;
+        ndb.set_min_build_threshold(0);
+        ndb.set_nn_descent_cutoff(1);
+        ndb.set_backend_policy(BackendPolicy(spec));
+        ndb.set_vectors(vecs, 3);
+        ndb.set_strings(strings);
+        ndb.build_parallel(2);
+        for (std::string p : {"a", "ana", "nana", "banana"}) assert(ndb.query(query_vec1, p, 5) == pdb2.query(query_vec1, p, 5));
+    }
+    std::vector<float> points(1000 * 8);
+    for (size_t i = 0; i < points.size(); i++) points[i] = (i * 7919 % 1009) / 1009.0f;
+    std::vector<uint32_t> point_ids(1000);
+    std::iota(point_ids.begin(), point_ids.end(), 0);
+    NNDescent knn(10);
+    knn.build(points.data(), 8, point_ids);
+    size_t found = 0;
+    for (uint32_t i = 0; i < 1000; i++) {
+        std::vector<std::pair<float, uint32_t>> exact;
+        for (uint32_t j = 0; j < 1000; j++) {
+            float d = 0;
+            for (int c = 0; c < 8; c++) d += (points[i * 8 + c] - points[j * 8 + c]) * (points[i * 8 + c] - points[j * 8 + c]);
+            if (j != i) exact.emplace_back(d, j);
+        }
+        std::partial_sort(exact.begin(), exact.begin() + 10, exact.end());
+        for (int e = 0; e < 10; e++) found += knn.neighbors(i)[e].dist <= exact[9].first;
+    }
+    std::cout << "NN-descent found " << found << " of 10000 nearest neighbors in " << knn.iterations << " iterations" << std::endl;
+    assert(found >= 9000);
+
+    // Test states searched in the global graph with a filter
+    std::cout << "Testing filtered search of the global graph:" << std::endl;
+    std::vector<uint32_t> thirds;
+    for (uint32_t id = 0; id < 3000; id += 3) thirds.emplace_back(id);
+    PostingList packed(thirds), dense(thirds);
+    dense.to_bitmap();
+    for (uint32_t id = 0; id < 3010; id++) assert(packed.contains(id) == (id % 3 == 0 && id < 3000) && dense.contains(id) == packed.contains(id));
+    VectorMaton fdb;
+    fdb.set_min_build_threshold(0);
+    fdb.set_filter_selectivity(0.5);
+    fdb.set_vectors(vecs, 3);
+    fdb.set_strings(strings);
+    fdb.build_smart();
+    int a_filtered = fdb.entry(fdb.gsa.query(std::string("a")));
+    // The graph 'a' had is gone: the state graphs (all but the global graph over every vector) have
+    // at least its vertices fewer
+    int a_graph = pdb.entry(pdb.gsa.query(std::string("a")));
+    size_t global_vertices = vecs.size() / 3;
+    assert(fdb.filtered_states[a_filtered] && !fdb.indexes[a_filtered] && pdb.indexes[a_graph]);
+    assert(fdb.vertex_num() - global_vertices + pdb.candidate_ids[a_graph].size() <= pdb.vertex_num());
+    for (std::string p : {"a", "ana", "nana", "banana"}) assert(fdb.query(query_vec1, p, 5) == pdb.query(query_vec1, p, 5));
+    fdb.save_index("test_vectormaton");
+    VectorMaton fdb1;
+    fdb1.set_vectors(vecs, 3);
+    fdb1.set_strings(strings);
+    fdb1.load_index("test_vectormaton");
+    assert(fdb1.filtered_states == fdb.filtered_states);
+    for (std::string p : {"a", "ana", "nana", "banana"}) assert(fdb1.query(query_vec1, p, 5) == pdb.query(query_vec1, p, 5));
+    fdb.insert(new_vec, new_str);
+    print_res(fdb.query(query_vec1, "a", 3)); // {2, 3, 5}
+    // No state holds the 6 vectors a graph needs: the global graph is not built (nor counted)
+    VectorMaton fdb2;
+    fdb2.set_min_build_threshold(6);
+    fdb2.set_filter_selectivity(0.5);
+    fdb2.set_vectors(vecs, 3);
+    fdb2.set_strings(strings);
+    fdb2.build_smart();
+    assert(fdb2.vertex_num() == 0);
+    for (std::string p : {"a", "ana", "nana", "banana"}) assert(fdb2.query(query_vec1, p, 5) == pdb.query(query_vec1, p, 5));
+
+    // Test graphs materialized for a query log
+    std::cout << "Testing query-log-driven graph materialization:" << std::endl;
+    std::ofstream("test_query_log.txt") << "nana\nnana\nban\t3\n";
+    for (bool full : {false, true}) {
+        VectorMaton qdb;
+        qdb.set_min_build_threshold(0);
+        assert(qdb.load_query_log("test_query_log.txt"));
+        qdb.set_vectors(vecs, 3);
+        qdb.set_strings(strings);
+        if (full) qdb.build_full();
+        else qdb.build_smart();
+        int nana = qdb.entry(qdb.gsa.query(std::string("nana"))), a = qdb.entry(qdb.gsa.query(std::string("a")));
+        assert(!qdb.cold_states[nana] && qdb.cold_states[a] && !qdb.indexes[a] && qdb.candidate_ids[a].size() == 5);
+        assert(qdb.vertex_num() < (full ? db : pdb).vertex_num());
+        for (std::string p : {"a", "ana", "nana", "banana"}) assert(qdb.query(query_vec1, p, 5) == pdb.query(query_vec1, p, 5));
+    }
+    std::remove("test_query_log.txt");
+    {
+        // Unlogged states keep their graph where the calibrated cost model finds a scan too slow
+        // ('a', in all 600 strings, is past the largest sample), unless the manual threshold says otherwise
+        std::mt19937 rng(11);
+        std::vector<float> cold_vecs;
+        std::vector<std::string> cold_strs;
+        for (int i = 0; i < 600; i++) {
+            for (int j = 0; j < 3; j++) cold_vecs.emplace_back(rng() % 1000 / 100.0f);
+            std::string str = "a";
+            for (int j = 0; j < 4; j++) str += char('b' + rng() % 3);
+            cold_strs.emplace_back(str);
+        }
+        std::ofstream("test_query_log.txt") << "bcd\n";
+        for (int cold_threshold : {0, 100000}) {
+            VectorMaton cdb;
+            cdb.set_min_build_threshold(0);
+            cdb.set_cold_build_threshold(cold_threshold);
+            assert(cdb.load_query_log("test_query_log.txt"));
+            cdb.set_vectors(cold_vecs, 3);
+            cdb.set_strings(cold_strs);
+            cdb.build_smart();
+            int a = cdb.entry(cdb.gsa.query(std::string("a")));
+            // Small unlogged states are scanned either way
+            assert(std::count(cdb.cold_states.begin(), cdb.cold_states.end(), 1) > 0);
+            if (cold_threshold == 0) assert(!cdb.cold_states[a] && (cdb.indexes[a] || cdb.inherit_states[a] != -1));
+            else assert(cdb.cold_states[a] && !cdb.indexes[a] && cdb.inherit_states[a] == -1);
+        }
+        std::remove("test_query_log.txt");
+    }
+
+    // Test planning without building graphs: the same choices as build_smart
+    std::cout << "Testing plan-only builds:" << std::endl;
+    VectorMaton plan_db;
+    plan_db.set_min_build_threshold(0);
+    plan_db.set_vectors(vecs, 3);
+    plan_db.set_strings(strings);
+    plan_db.plan_build(false);
+    assert(plan_db.indexes.empty() && plan_db.inherit_states == pdb.inherit_states && plan_db.candidate_ids == pdb.candidate_ids);
+
+    // Test graphs demoted to scans to fit a memory budget
+    std::cout << "Testing memory-budgeted builds:" << std::endl;
+    for (bool full : {false, true}) {
+        VectorMaton bdb;
+        bdb.set_min_build_threshold(0);
+        bdb.set_max_fan_in(2);
+        size_t budget = (full ? db : pdb).size() * 3 / 4;
+        bdb.set_memory_budget(budget);
+        bdb.set_vectors(vecs, 3);
+        bdb.set_strings(strings);
+        if (full) bdb.build_full();
+        else bdb.build_smart();
+        assert(bdb.size() <= budget && bdb.vertex_num() < (full ? db : pdb).vertex_num());
+        for (int i = 0; i < bdb.cold_states.size(); i++) {
+            if (bdb.cold_states[i]) assert(!bdb.indexes[i] && (full || bdb.inherit_states[i] == -1));
+        }
+        for (std::string p : {"a", "ana", "nana", "banana"}) assert(bdb.query(query_vec1, p, 5) == pdb.query(query_vec1, p, 5));
+    }
+
+    // Test the adaptive HNSW parameter policy
+    std::cout << "Testing adaptive HNSW parameters:" << std::endl;
+    HnswPolicy policy("adaptive");
+    assert(HnswPolicy(policy.spec()).adaptive && HnswPolicy("m=12,efc=100").spec() == "m=12,efc=100,ef=10");
+    assert(policy.choose(200, 128).M < policy.choose(1000000, 128).M);
+    assert(policy.choose(1000000, 128).M < policy.choose(1000000, 768).M);
+    VectorMaton pdb5;
+    pdb5.set_min_build_threshold(0);
+    pdb5.set_hnsw_policy(policy);
+    pdb5.set_vectors(vecs, 3);
+    pdb5.set_strings(strings);
+    pdb5.build_smart();
+    print_res(pdb5.query(query_vec1, "ana", 3)); // {3, 2, 1}
+
+    // Test the other state index backends
+    std::cout << "Testing state index backends:" << std::endl;
+    assert(BackendPolicy("nsw=500,flat=50").spec() == "flat=50,nsw=500" && BackendPolicy("").spec() == "hnsw");
+    // Values that are not counts are rejected, keeping the default
+    assert(BackendPolicy("nsw=abc,flat=50").spec() == "flat=50" && BackendPolicy("ivf=-3,nsw=5x").spec() == "hnsw");
+    assert(HnswPolicy("m=abc,ef=20").spec() == "m=16,efc=200,ef=20");
+    for (std::string spec : {"flat=100", "nsw=100", "ivf=100"}) {
+        VectorMaton bdb;
+        bdb.set_min_build_threshold(0);
+        bdb.set_backend_policy(BackendPolicy(spec));
+        bdb.set_vectors(vecs, 3);
+        bdb.set_strings(strings);
+        bdb.build_smart();
+        assert(bdb.query(query_vec1, "ana", 3) == std::vector<int>({3, 2, 1}));
+        assert(bdb.query(query_vec1, "nana", 2) == std::vector<int>({2, 1}));
+    }
+    {
+        // NSW insertions from several threads at once: every vector still finds itself
+        int num = 3000, d = 8, threads = 4;
+        std::vector<float> nsw_vecs(num * d);
+        for (size_t i = 0; i < nsw_vecs.size(); i++) nsw_vecs[i] = (i * 7919 % 100003) / 100003.0f;
+        HnswPolicy::Params p;
+        p.M = 8, p.ef_construction = 64, p.ef_search = 32;
+        NswIndex index(nsw_vecs.data(), d, p);
+        index.resize(num / 2); // the other half is made room for by add()
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                for (int i = t; i < num; i += threads) index.add(i);
+            });
+        }
+        for (auto& w : workers) w.join();
+        assert(index.size() == (size_t)num);
+        int found = 0;
+        for (int i = 0; i < num; i++) found += index.search(nsw_vecs.data() + (size_t)i * d, 1)[0].second == (size_t)i;
+        std::cout << "NSW built by " << threads << " threads: " << found << "/" << num << " vectors find themselves" << std::endl;
+        assert(found >= num * 0.99);
+    }
+    {
+        // A graph derived from a global one keeps every level connected from its entry point,
+        // the upper levels included
+        int num = 3000, d = 8;
+        std::vector<float> hvecs(num * d);
+        std::mt19937 rng(3);
+        std::uniform_real_distribution<float> uniform(0, 1);
+        for (float& v : hvecs) v = uniform(rng);
+        HnswPolicy::Params p;
+        p.M = 4, p.ef_construction = 64, p.ef_search = 32;
+        hnswlib::L2Space hspace(d);
+        HnswIndex global(&hspace, num, hvecs.data(), p);
+        for (int i = 0; i < num; i++) global.add(i);
+        PostingList ids;
+        for (int i = 0; i < num; i += 5) ids.push_back(i);
+        HnswIndex derived(&hspace, ids.size(), hvecs.data(), p);
+        assert(derived.derive(global, ids));
+        hnswlib::HierarchicalNSW<float>* h = derived.hnsw;
+        for (int level = 0; level <= h->maxlevel_; level++) {
+            std::vector<char> reached(h->cur_element_count, 0);
+            std::vector<hnswlib::tableint> stack(1, h->enterpoint_node_);
+            reached[h->enterpoint_node_] = 1;
+            while (!stack.empty()) {
+                hnswlib::linklistsizeint* ll = h->get_linklist_at_level(stack.back(), level);
+                stack.pop_back();
+                const hnswlib::tableint* adj = (const hnswlib::tableint*)(ll + 1);
+                for (int e = 0; e < h->getListCount(ll); e++) {
+                    if (!reached[adj[e]]) reached[adj[e]] = 1, stack.emplace_back(adj[e]);
+                }
+            }
+            for (size_t u = 0; u < h->cur_element_count; u++) assert(reached[u] || h->element_levels_[u] < level);
+        }
+        // As many vectors find themselves as in a graph built by insertion
+        HnswIndex inserted(&hspace, ids.size(), hvecs.data(), p);
+        inserted.build(ids);
+        int found = 0, found_inserted = 0;
+        ids.for_each([&](uint32_t i) {
+            found += derived.search(hvecs.data() + (size_t)i * d, 1)[0].second == i;
+            found_inserted += inserted.search(hvecs.data() + (size_t)i * d, 1)[0].second == i;
+        });
+        std::cout << "Derived HNSW of " << ids.size() << " vectors over " << h->maxlevel_ + 1 << " levels: " << found
+                  << " find themselves (" << found_inserted << " built by insertion)" << std::endl;
+        assert(found >= found_inserted - (int)ids.size() / 100);
+    }
+    std::cout << "State index backend tests passed!" << std::endl;
+
+    // Test inheriting several disjoint graphs ('a' inherits 'ab' and 'ac')
+    std::cout << "Testing multi-source inheritance:" << std::endl;
+    VectorMaton mdb;
+    mdb.set_min_build_threshold(0);
+    mdb.set_max_fan_in(2);
+    mdb.set_vectors(std::vector<float>(vecs.begin(), vecs.begin() + 12), 3);
+    mdb.set_strings({"ab", "ac", "ab", "ac"});
+    mdb.build_smart();
+    int a_state = mdb.entry(mdb.gsa.query(std::string("a")));
+    assert(mdb.inherit_states[a_state] != -1 && mdb.extra_inherit_states[a_state].size() == 1 && mdb.candidate_ids[a_state].empty());
+    assert(mdb.query(query_vec1, "a", 4) == std::vector<int>({3, 2, 1, 0}));
+    mdb.insert(new_vec, "ac");
+    assert(mdb.query(query_vec1, "a", 3) == std::vector<int>({3, 2, 4}));
+    assert(mdb.query(query_vec1, "ac", 3) == std::vector<int>({3, 4, 1}));
+    VectorMaton mdb1;
+    mdb1.set_min_build_threshold(0);
+    mdb1.set_max_fan_in(2);
+    mdb1.set_plan_inheritance(true);
+    mdb1.set_vectors(std::vector<float>(vecs.begin(), vecs.begin() + 12), 3);
+    mdb1.set_strings({"ab", "ac", "ab", "ac"});
+    mdb1.build_smart();
+    assert(mdb1.vertex_num() == 4 && mdb1.query(query_vec1, "a", 4) == std::vector<int>({3, 2, 1, 0}));
+    {
+        // Insertions into states inheriting up to 4 graphs each: every vector containing a
+        // pattern is found once, also where it joined several graphs one state inherits
+        std::mt19937 rng(5);
+        std::vector<float> dag_vecs;
+        std::vector<std::string> dag_strs;
+        auto random_entry = [&]() {
+            for (int j = 0; j < 3; j++) dag_vecs.emplace_back(rng() % 1000 / 100.0f);
+            std::string str;
+            for (int j = 0; j < 6; j++) str += char('a' + rng() % 4);
+            dag_strs.emplace_back(str);
+        };
+        for (int i = 0; i < 60; i++) random_entry();
+        VectorMaton ddb;
+        ddb.set_min_build_threshold(0);
+        ddb.set_max_fan_in(4);
+        ddb.set_vectors(dag_vecs, 3);
+        ddb.set_strings(dag_strs);
+        ddb.build_smart();
+        for (int i = 0; i < 20; i++) {
+            random_entry();
+            ddb.insert(std::vector<float>(dag_vecs.end() - 3, dag_vecs.end()), dag_strs.back());
+        }
+        for (std::string p : {"a", "b", "ab", "ca", "dd", "abc", "bad"}) {
+            std::vector<int> expected;
+            for (int i = 0; i < (int)dag_strs.size(); i++) {
+                if (dag_strs[i].find(p) != std::string::npos) expected.emplace_back(i);
+            }
+            std::vector<int> res = ddb.query(query_vec1, p, dag_strs.size());
+            std::sort(res.begin(), res.end());
+            assert(res == expected);
+        }
+    }
+    {
+        // Greedy inheritance is not optimal with one graph per state. 'ab' (18 ids) greedily
+        // inherits 'abc' (10) and keeps a graph of 8; 'a' and 'xa' then inherit 10 ids each. Kept
+        // whole, 'ab' costs 10 vertices more and saves both of them 8: 6 fewer graph vertices.
+        std::vector<float> plan_vecs;
+        std::vector<std::string> plan_strs;
+        auto add = [&](const std::string& str, int copies) {
+            for (int i = 0; i < copies; i++) {
+                for (int j = 0; j < 3; j++) plan_vecs.emplace_back(plan_strs.size() * 0.37f + j);
+                plan_strs.emplace_back(str);
+            }
+        };
+        add("xabc", 10);
+        add("xabz", 8);
+        add("ay", 3);
+        add("xaw", 3);
+        VectorMaton gdb, pdb;
+        for (VectorMaton* db : {&gdb, &pdb}) {
+            db->set_min_build_threshold(0);
+            db->set_vectors(plan_vecs, 3);
+            db->set_strings(plan_strs);
+        }
+        pdb.set_plan_inheritance(true);
+        gdb.build_smart();
+        pdb.build_smart();
+        int ab_state = pdb.entry(pdb.gsa.query(std::string("ab")));
+        assert(gdb.inherit_states[ab_state] != -1 && gdb.candidate_ids[ab_state].size() == 8);
+        assert(pdb.inherit_states[ab_state] == -1 && pdb.candidate_ids[ab_state].size() == 18);
+        assert(gdb.vertex_num() == 57 && pdb.vertex_num() == 51);
+        for (std::string p : {"a", "xa", "ab", "abc", "b", "x"}) {
+            std::vector<int> res = pdb.query(query_vec1, p, plan_strs.size());
+            std::sort(res.begin(), res.end());
+            std::vector<int> expected = gdb.query(query_vec1, p, plan_strs.size());
+            std::sort(expected.begin(), expected.end());
+            assert(res == expected);
+        }
+    }
+    std::cout << "Multi-source inheritance tests passed!" << std::endl;
+
+    // Test states with the same ids sharing one entry ('nan' and 'nana' occur in the same strings)
+    std::cout << "Testing shared id sets:" << std::endl;
+    for (bool full : {false, true}) {
+        VectorMaton sdb;
+        sdb.set_min_build_threshold(0);
+        sdb.set_vectors(vecs, 3);
+        sdb.set_strings(strings);
+        if (full) sdb.build_full();
+        else sdb.build_smart();
+        int nan = sdb.gsa.query(std::string("nan")), nana = sdb.gsa.query(std::string("nana"));
+        assert(nan != nana && sdb.entry(nan) == sdb.entry(nana));
+        for (std::string p : {"a", "n", "na", "nan", "nana", "banana"}) assert(sdb.query(query_vec1, p, 5) == db.query(query_vec1, p, 5));
+        sdb.save_index("test_vectormaton");
+        VectorMaton sdb1;
+        sdb1.set_vectors(vecs, 3);
+        sdb1.set_strings(strings);
+        sdb1.load_index("test_vectormaton");
+        assert(sdb1.shared_states == sdb.shared_states && sdb1.query(query_vec1, "nana", 5) == sdb.query(query_vec1, "nana", 5));
+        // The new vector goes to 'nan' only: the two stop sharing
+        sdb.insert(new_vec, "nan");
+        auto res_nan = sdb.query(query_vec1, "nan", 5), res_nana = sdb.query(query_vec1, "nana", 5);
+        assert(res_nan.size() == 4 && std::count(res_nan.begin(), res_nan.end(), 5) == 1);
+        assert(res_nana.size() == 3 && std::count(res_nana.begin(), res_nana.end(), 5) == 0);
+    }
+    {
+        // Parallel builds share every id set once, as a sequential build does, whichever state of a
+        // set is built first: repeated builds with 4 threads share as many states
+        std::mt19937 rng(9);
+        std::vector<float> share_vecs;
+        std::vector<std::string> share_strs;
+        for (int i = 0; i < 300; i++) {
+            for (int j = 0; j < 3; j++) share_vecs.emplace_back(rng() % 1000 / 100.0f);
+            std::string str;
+            for (int j = 0; j < 8; j++) str += char('a' + rng() % 4);
+            share_strs.emplace_back(str);
+        }
+        auto num_sharing = [](VectorMaton& db) {
+            int num = 0;
+            for (int i = 0; i < (int)db.shared_states.size(); i++) num += db.entry(i) != i;
+            return num;
+        };
+        VectorMaton sdb;
+        sdb.set_min_build_threshold(10);
+        sdb.set_vectors(share_vecs, 3);
+        sdb.set_strings(share_strs);
+        sdb.build_smart();
+        int expected = num_sharing(sdb);
+        assert(expected > 0);
+        for (int k = 0; k < 6; k++) {
+            VectorMaton pdb6;
+            pdb6.set_min_build_threshold(10);
+            pdb6.set_vectors(share_vecs, 3);
+            pdb6.set_strings(share_strs);
+            if (k % 2) pdb6.build_full(4);
+            else pdb6.build_parallel(4);
+            assert(num_sharing(pdb6) == expected);
+            for (std::string p : {"a", "bd", "cab", "dada"}) assert(pdb6.query(query_vec1, p, 5) == sdb.query(query_vec1, p, 5) || k % 2);
+        }
+    }
+    std::cout << "Shared id set tests passed!" << std::endl;
+
+    // Test frozen graphs: same results in less memory, saved and loaded as such, no insertions
+    std::cout << "Testing frozen graphs:" << std::endl;
+    VectorMaton zdb;
+    zdb.set_min_build_threshold(0);
+    zdb.set_vectors(vecs, 3);
+    zdb.set_strings(strings);
+    zdb.build_full();
+    size_t unfrozen_size = zdb.size();
+    zdb.freeze();
+    assert(zdb.size() < unfrozen_size && zdb.indexes[zdb.entry(zdb.gsa.query(std::string("a")))]->kind() == StateIndex::FROZEN);
+    for (std::string p : {"a", "n", "ana", "nana", "banana"}) assert(zdb.query(query_vec1, p, 5) == db.query(query_vec1, p, 5));
+    zdb.save_index("test_vectormaton");
+    VectorMaton zdb1;
+    zdb1.set_vectors(vecs, 3);
+    zdb1.set_strings(strings);
+    zdb1.load_index("test_vectormaton");
+    for (std::string p : {"a", "n", "ana", "nana", "banana"}) assert(zdb1.query(query_vec1, p, 5) == db.query(query_vec1, p, 5));
+    zdb1.insert(new_vec, new_str);
+    assert(zdb1.query(query_vec1, "ana", 5) == db.query(query_vec1, "ana", 5));
+    std::cout << "Frozen graph tests passed!" << std::endl;
+
     return 0;
 }
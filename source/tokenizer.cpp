@@ -0,0 +1,104 @@
+#include "tokenizer.h"
+#include <cctype>
+
+Tokenizer::Tokenizer(const std::string& spec) {
+    if (spec == "chars" || spec == "") mode = CHARS;
+    else if (spec == "whitespace") mode = WHITESPACE;
+    else if (spec == "identifier") mode = IDENTIFIER;
+    else LOG_WARN("Unknown tokenizer '", spec, "', using chars");
+}
+
+std::string Tokenizer::spec() const {
+    switch (mode) {
+        case WHITESPACE: return "whitespace";
+        case IDENTIFIER: return "identifier";
+        default: return "chars";
+    }
+}
+
+std::vector<std::string> Tokenizer::split(const std::string& s) const {
+    std::vector<std::string> tokens;
+    std::string cur;
+    auto flush = [&]() {
+        if (!cur.empty()) tokens.emplace_back(cur), cur.clear();
+    };
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+        if (mode == WHITESPACE) {
+            if (std::isspace(c)) flush(); else cur += char(c);
+            continue;
+        }
+        // IDENTIFIER: "parseHTTPResponse2_v" -> parse, http, response, 2, v
+        if (!std::isalnum(c)) {
+            flush();
+            continue;
+        }
+        if (!cur.empty()) {
+            unsigned char prev = s[i - 1];
+            bool digit_boundary = std::isdigit(prev) != std::isdigit(c);
+            bool camel = std::islower(prev) && std::isupper(c);
+            bool acronym_end = std::isupper(prev) && std::isupper(c) && i + 1 < s.size() && std::islower((unsigned char)s[i + 1]);
+            if (digit_boundary || camel || acronym_end) flush();
+        }
+        cur += char(std::tolower(c));
+    }
+    flush();
+    return tokens;
+}
+
+uint32_t Tokenizer::find(const std::string& token) const {
+    auto it = ids.find(token);
+    return it == ids.end() ? kUnknown : it->second;
+}
+
+uint32_t Tokenizer::insert(const std::string& token) {
+    auto it = ids.find(token);
+    if (it != ids.end()) return it->second;
+    uint32_t id = vocab.size();
+    vocab.emplace_back(token);
+    ids.emplace(token, id);
+    return id;
+}
+
+void Tokenizer::set_vocab(const std::vector<std::string>& tokens) {
+    vocab = tokens;
+    ids.clear();
+    for (uint32_t i = 0; i < vocab.size(); i++) ids.emplace(vocab[i], i);
+}
+
+size_t Tokenizer::encode(const std::string& s, const Normalizer& normalizer, std::vector<uint32_t>& out) const {
+    out.clear();
+    std::string normalized;
+    size_t dropped = 0;
+    if (chars()) {
+        if (!normalizer.identity()) dropped = normalizer.apply(s, normalized);
+        for (char c : normalizer.identity() ? s : normalized) out.emplace_back((unsigned char)c);
+        return dropped;
+    }
+    for (const auto& token : split(s)) {
+        dropped += normalizer.apply(token, normalized);
+        if (!normalized.empty()) out.emplace_back(find(normalized));
+    }
+    return dropped;
+}
+
+size_t Tokenizer::encode_new(const std::string& s, const Normalizer& normalizer, std::vector<uint32_t>& out) {
+    if (chars()) return encode(s, normalizer, out);
+    out.clear();
+    std::string normalized;
+    size_t dropped = 0;
+    for (const auto& token : split(s)) {
+        dropped += normalizer.apply(token, normalized);
+        if (!normalized.empty()) out.emplace_back(insert(normalized));
+    }
+    return dropped;
+}
+
+std::string Tokenizer::canonical(const std::string& s, const Normalizer& normalizer) const {
+    std::string res = " ", normalized;
+    for (const auto& token : split(s)) {
+        normalizer.apply(token, normalized);
+        if (!normalized.empty()) res += normalized + " ";
+    }
+    return res;
+}
@@ -0,0 +1,59 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include "headers.h"
+#include "normalizer.h"
+
+// Splits strings into tokens for the token-level automaton and keeps the token dictionary.
+// In token mode the automaton is built over token ids, so patterns match contiguous token
+// sequences instead of arbitrary character substrings.
+class Tokenizer {
+public:
+    enum Mode {
+        CHARS,      // no tokenization, every byte is a symbol (default)
+        WHITESPACE, // tokens are separated by whitespace
+        IDENTIFIER  // split at non-alphanumerics, camelCase and letter/digit boundaries, lowercased
+    };
+    static const uint32_t kUnknown = 0xffffffff;
+
+    Mode mode = CHARS;
+    std::vector<std::string> vocab; // token id -> token
+
+    Tokenizer() {}
+
+    // Parse a mode name: chars, whitespace or identifier.
+    Tokenizer(const std::string& spec);
+
+    // Mode name that parses back to this tokenizer.
+    std::string spec() const;
+
+    bool chars() const { return mode == CHARS; }
+
+    // Split s into tokens.
+    std::vector<std::string> split(const std::string& s) const;
+
+    // Id of a token, kUnknown if it is not in the dictionary.
+    uint32_t find(const std::string& token) const;
+
+    // Id of a token, adding it to the dictionary if needed.
+    uint32_t insert(const std::string& token);
+
+    // Replace the dictionary (e.g. when loading an index).
+    void set_vocab(const std::vector<std::string>& tokens);
+
+    // Symbols of s: its normalized bytes in CHARS mode, otherwise the ids of its normalized tokens
+    // (kUnknown for tokens not in the dictionary). Returns the number of dropped characters.
+    size_t encode(const std::string& s, const Normalizer& normalizer, std::vector<uint32_t>& out) const;
+
+    // Same as encode(), but new tokens are added to the dictionary.
+    size_t encode_new(const std::string& s, const Normalizer& normalizer, std::vector<uint32_t>& out);
+
+    // The normalized tokens of s joined as " t1 t2 ... tn ", so that plain substring search over
+    // canonical strings is exactly contiguous token-sequence matching.
+    std::string canonical(const std::string& s, const Normalizer& normalizer) const;
+
+private:
+    std::unordered_map<std::string, uint32_t> ids;
+};
+
+#endif
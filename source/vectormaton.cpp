@@ -10,14 +10,39 @@ void VectorMaton::set_strings(const std::vector<std::string>& strings) {
     strs = strings;
 }
 
-void VectorMaton::build_gsa() {
+bool VectorMaton::build_gsa() {
     LOG_DEBUG("Building Generalized Suffix Automaton (GSA)");
     unsigned long long start_time = currentTime();
-    for (int i = 0; i < num_elements; i++) {
-        gsa.add_string(i, strs[i]);
+    gsa.set_deferred_ids(deferred_ids);
+    if (gsa_spill_dir != "") {
+        if (!gsa.build_external(strs, gsa_memory_budget, gsa_spill_dir, num_elements)) return false;
+    }
+    else if (gsa_threads > 1) {
+        gsa.build_parallel(strs, gsa_threads, num_elements);
+    }
+    else {
+        for (int i = 0; i < num_elements; i++) {
+            gsa.add_string(i, strs[i]);
+        }
+    }
+    gsa.freeze();
+    encode_long_strings(true);
+    if (gsa.dropped_chars > 0) {
+        LOG_INFO("Normalizer '", gsa.normalizer.spec(), "' dropped ", gsa.dropped_chars, " non-indexable characters");
+    }
+    LOG_DEBUG("GSA alphabet size: ", gsa.alphabet_size);
+    if (!gsa.tokenizer.chars()) {
+        LOG_INFO("Tokenizer '", gsa.tokenizer.spec(), "' vocabulary size: ", gsa.tokenizer.vocab.size());
+    }
+    if (deferred_ids) {
+        gsa.index_ids();
+        LOG_DEBUG("GSA built in ", timeFormatting(currentTime() - start_time).str(), ", id sets deferred");
+        LOG_DEBUG("Total GSA states: ", std::to_string(gsa.size()));
+        return true;
     }
     LOG_DEBUG("GSA built in ", timeFormatting(currentTime() - start_time).str());
     LOG_DEBUG("Total GSA states: ", std::to_string(gsa.size()), ", total string IDs in GSA: ", std::to_string(gsa.size_tot()));
+    LOG_DEBUG("GSA id lists: ", gsa.ids_bytes(), " bytes (", sizeof(uint32_t) * (size_t)gsa.size_tot(), " bytes uncompressed)");
 
     // Print GSA statistics
     // auto stats = gsa.get_statistics();
@@ -27,378 +52,1404 @@ void VectorMaton::build_gsa() {
     //               ", median vector set size = ", stat.mid,
     //               ", average vector set size = ", stat.avg);
     // }
+    return true;
+}
+
+bool VectorMaton::build_pattern_index() {
+    if (!use_fm_index) {
+        return build_gsa();
+    }
+    LOG_DEBUG("Building FM-index");
+    fm.normalizer = gsa.normalizer;
+    fm.tokenizer = gsa.tokenizer;
+    fm.build(strs, num_elements);
+    if (fm.dropped_chars > 0) {
+        LOG_INFO("Normalizer '", fm.normalizer.spec(), "' dropped ", fm.dropped_chars, " non-indexable characters");
+    }
+    LOG_DEBUG("Total FM-index states: ", fm.num_states(), ", structure size: ", fm.size_bytes(), " bytes");
+    return true;
+}
+
+PatternIndex& VectorMaton::pattern_index() {
+    if (use_fm_index) return fm;
+    return gsa;
+}
+
+StateIndex* VectorMaton::new_index(size_t n) {
+    HnswPolicy::Params p = hnsw_policy.choose(n, dim);
+    switch (backend_policy.choose(n)) {
+        case StateIndex::FLAT:
+            return new FlatIndex(vecs.data(), dim);
+        case StateIndex::NSW: {
+            NswIndex* index = new NswIndex(vecs.data(), dim, p);
+            index->resize(n);
+            return index;
+        }
+        case StateIndex::IVF:
+            return new IvfIndex(vecs.data(), dim, p);
+        default:
+            return new HnswIndex(space, n, vecs.data(), p);
+    }
+}
+
+bool VectorMaton::calibrate_cost_model() {
+    if (!space) {
+        space = new hnswlib::L2Space(dim);
+    }
+    unsigned long long start_time = currentTime();
+    cost_model.calibrate(vecs, dim, num_elements, space, hnsw_policy);
+    if (cost_model.samples.empty()) return false;
+    cost_model.log();
+    LOG_INFO("Cost model calibrated in ", timeFormatting(currentTime() - start_time).str());
+    return true;
+}
+
+void VectorMaton::calibrate_threshold() {
+    if (!calibrate_cost_model()) {
+        LOG_WARN("Too few vectors to calibrate the cost model, keeping build threshold ", min_build_threshold);
+        return;
+    }
+    min_build_threshold = cost_model.choose_threshold(cost_model.latency_target);
+    LOG_INFO("Minimum build threshold set to ", min_build_threshold);
+}
+
+void VectorMaton::calibrate_cold_scans() {
+    if (cold_build_threshold > 0 || !cost_model.samples.empty()) return;
+    if (!calibrate_cost_model()) LOG_WARN("Too few vectors to calibrate the cost model, states no logged query searches are scanned");
+}
+
+bool VectorMaton::cold_needs_graph(size_t n) const {
+    if (cold_build_threshold > 0) return n >= (size_t)cold_build_threshold;
+    return !cost_model.samples.empty() && cost_model.wants_graph(n);
+}
+
+int VectorMaton::find_shared(uint64_t hash, const PostingList& ids) {
+    std::vector<int> owners;
+    id_set_mtx.lock();
+    auto it = id_set_owners.find(hash);
+    if (it != id_set_owners.end()) owners = it->second;
+    id_set_mtx.unlock();
+    // Hash collisions are told apart by comparing the ids, outside the lock
+    for (int owner : owners) {
+        if (candidate_ids[owner].size() <= ids.size() && state_ids(owner) == ids) return owner;
+    }
+    return -1;
+}
+
+void VectorMaton::store_shared(int i, uint64_t hash) {
+    std::lock_guard<std::mutex> lock(id_set_mtx);
+    id_set_owners[hash].emplace_back(i);
+}
+
+bool VectorMaton::share_ids(int i, const PostingList& ids) {
+    uint64_t hash = ids.hash();
+    int owner = find_shared(hash, ids);
+    if (owner == -1) {
+        store_shared(i, hash);
+        return false;
+    }
+    shared_states[i] = owner;
+    return true;
+}
+
+int VectorMaton::claim_shared(int i, uint64_t hash, const PostingList& ids) {
+    std::lock_guard<std::mutex> lock(id_set_mtx);
+    std::vector<int>& owners = id_set_owners[hash];
+    for (int owner : owners) {
+        auto pending = pending_id_sets.find(owner);
+        if (pending != pending_id_sets.end() ? pending->second == ids
+                                             : candidate_ids[owner].size() <= ids.size() && state_ids(owner) == ids) {
+            return owner;
+        }
+    }
+    owners.emplace_back(i);
+    pending_id_sets.emplace(i, ids);
+    return -1;
+}
+
+bool VectorMaton::follow_shared(int i, int owner) {
+    std::lock_guard<std::mutex> lock(id_set_mtx);
+    if (!pending_id_sets.count(owner)) return false;
+    id_set_followers[owner].emplace_back(i);
+    return true;
+}
+
+std::vector<int> VectorMaton::finish_shared(int i) {
+    std::lock_guard<std::mutex> lock(id_set_mtx);
+    pending_id_sets.erase(i);
+    auto it = id_set_followers.find(i);
+    if (it == id_set_followers.end()) return {};
+    std::vector<int> followers = std::move(it->second);
+    id_set_followers.erase(it);
+    return followers;
+}
+
+void VectorMaton::report_shared() {
+    std::unordered_map<uint64_t, std::vector<int>>().swap(id_set_owners);
+    std::unordered_map<int, PostingList>().swap(pending_id_sets);
+    std::unordered_map<int, std::vector<int>>().swap(id_set_followers);
+    sharers_valid = false;
+    size_t num_shared = 0, with_graph = 0, ids = 0;
+    for (int i = 0; i < shared_states.size(); i++) {
+        if (entry(i) == i) continue;
+        num_shared++;
+        with_graph += indexes[entry(i)] != nullptr;
+        ids += state_ids(entry(i)).size();
+    }
+    LOG_INFO("Shared id sets: ", num_shared, " of ", shared_states.size(), " states (", ids, " ids) share the candidate ids of a state with the same ids, ",
+             with_graph, " of them its graph");
+}
+
+PostingList VectorMaton::state_ids(int i) const {
+    PostingList ids = candidate_ids[i];
+    for_each_inherited(i, [&](int t) { ids = PostingList::merge(ids, candidate_ids[t]); });
+    return ids;
+}
+
+std::vector<int> VectorMaton::successor_graphs(const std::vector<int>& succ) const {
+    // Graphs of the successors: those they inherit, then their own
+    std::vector<int> graphs;
+    for (int v : succ) {
+        v = entry(v);
+        for_each_inherited(v, [&](int t) {
+            graphs.emplace_back(t);
+        });
+        if (has_graph(v)) graphs.emplace_back(v); // v has (or gets) a graph
+    }
+    return graphs;
+}
+
+PostingList VectorMaton::inherit_graphs(int i, const PostingList& ids, std::vector<int> graphs) {
+    // Largest first, ties keep the given order
+    std::stable_sort(graphs.begin(), graphs.end(), [&](int a, int b) {
+        return candidate_ids[a].size() > candidate_ids[b].size();
+    });
+    // Take them greedily while they are disjoint from the ones taken (their ids are all in ids)
+    PostingList rest;
+    std::vector<int> taken;
+    for (int t : graphs) {
+        if ((int)taken.size() >= max_fan_in) break;
+        if (std::find(taken.begin(), taken.end(), t) != taken.end()) continue;
+        PostingList next = PostingList::difference(taken.empty() ? ids : rest, candidate_ids[t]);
+        if ((taken.empty() ? ids.size() : rest.size()) - next.size() != candidate_ids[t].size()) continue;
+        taken.emplace_back(t);
+        rest = std::move(next);
+    }
+    if (taken.empty()) return ids;
+    inherit_states[i] = taken[0];
+    if (taken.size() > 1) extra_inherit_states[i].assign(taken.begin() + 1, taken.end());
+    return rest;
+}
+
+void VectorMaton::build_global_graph(int cores, bool planned) {
+    delete global_graph; // of an earlier build
+    global_graph = nullptr;
+    // Without derive_graphs only filtered states search it: those planned, or any state that may be
+    // filtered while building (the root holds all ids, every other state a subset)
+    bool filters = planned ? std::count(filtered_states.begin(), filtered_states.end(), 1) > 0 : use_filter(num_elements);
+    if (!derive_graphs && !filters) {
+        if (filter_selectivity > 0) LOG_INFO("No state searches the global graph with a filter, not building it");
+        return;
+    }
+    LOG_INFO("Building the global graph over ", num_elements, " vectors");
+    unsigned long long start_time = currentTime();
+    global_graph = new HnswIndex(space, num_elements, vecs.data(), hnsw_policy.choose(num_elements, dim));
+    #pragma omp parallel for num_threads(cores) schedule(dynamic, 64)
+    for (int i = 0; i < num_elements; i++) {
+        global_graph->add(i);
+    }
+    LOG_INFO("Global graph built in ", timeFormatting(currentTime() - start_time).str());
+}
+
+void VectorMaton::release_global_graph() {
+    size_t num_filtered = std::count(filtered_states.begin(), filtered_states.end(), 1);
+    if (filter_selectivity > 0) LOG_INFO("States searched in the global graph with a filter: ", num_filtered);
+    if (num_filtered > 0) return;
+    delete global_graph;
+    global_graph = nullptr;
+}
+
+bool VectorMaton::use_filter(size_t n) const {
+    return filter_selectivity > 0 && n >= min_build_threshold && n >= filter_selectivity * num_elements;
+}
+
+void VectorMaton::filter_state(int i, PostingList ids) {
+    candidate_ids[i] = std::move(ids);
+    candidate_ids[i].to_bitmap();
+    filtered_states[i] = 1;
+}
+
+std::vector<std::pair<float, hnswlib::labeltype>> VectorMaton::search_filtered(int i, const float* vec, int k) {
+    // Start from the search ef scaled by the inverse selectivity, so that about ef of the vectors
+    // met are the state's, and double it until k of them are met
+    const PostingList& ids = candidate_ids[i];
+    size_t want = std::min<size_t>(k, ids.size());
+    global_graph->set_data(vecs.data());
+    auto allowed = [&](uint32_t id) { return ids.contains(id); };
+    for (size_t ef = std::max<size_t>(global_graph->params.ef_search, k) * num_elements / std::max<size_t>(ids.size(), 1); ef < num_elements; ef *= 2) {
+        auto res = global_graph->search_filtered(vec, k, ef, allowed);
+        if (res.size() >= want) return res;
+    }
+    // Wider than the whole graph: scan the state
+    std::vector<std::pair<float, hnswlib::labeltype>> res;
+    ids.for_each([&](uint32_t id) { res.emplace_back(squared_distance(vecs.data() + (size_t)id * dim, vec, dim), id); });
+    std::sort(res.begin(), res.end());
+    if (res.size() > k) res.resize(k);
+    return res;
+}
+
+std::vector<char> VectorMaton::logged_states() {
+    PatternIndex& index = pattern_index();
+    std::vector<char> logged(index.num_states(), 0);
+    size_t found = 0, num_logged = 0;
+    for (const auto& q : query_log) {
+        int v = index.query(q.first);
+        if (!use_fm_index && gsa.max_pattern_length > 0) {
+            // A long pattern queries one of its windows (query_long): log them all
+            auto p = gsa.encode(q.first);
+            int L = gsa.max_pattern_length;
+            for (size_t w = 0; p.size() > L && w + L <= p.size(); w++) {
+                v = gsa.query(std::vector<GeneralizedSuffixAutomaton::Symbol>(p.begin() + w, p.begin() + w + L));
+                if (v != -1) logged[entry(v)] = 1;
+            }
+        }
+        if (v != -1) logged[entry(v)] = 1, found++;
+    }
+    for (char l : logged) num_logged += l;
+    LOG_INFO("Query log: ", found, " of ", query_log.size(), " patterns found, on ", num_logged, " of ", logged.size(), " states");
+    return logged;
+}
+
+size_t VectorMaton::drop_cold_graphs() {
+    PatternIndex& index = pattern_index();
+    int n = index.num_states();
+    std::vector<char> logged = logged_states();
+    std::vector<int> order = index.build_order();
+    // Ids of state i with those of the graphs it inherits (queries do not search further)
+    std::vector<size_t> num_ids(n, 0);
+    for (int i : order) {
+        num_ids[i] = candidate_ids[i].size();
+        for_each_inherited(i, [&](int t) { num_ids[i] += candidate_ids[t].size(); });
+    }
+    calibrate_cold_scans();
+    // Graphs searched by logged queries, or of states too large to scan (cold_needs_graph),
+    // and the graphs they inherit (predecessors come last in the build order)
+    auto searches_graphs = [&](int i) { return has_graph(i) || inherit_states[i] != -1; };
+    std::vector<char> needed(n, 0);
+    for (int k = n - 1; k >= 0; k--) {
+        int i = order[k];
+        if (!searches_graphs(i)) continue;
+        if (logged[i] || cold_needs_graph(num_ids[i])) needed[i] = 1;
+        if (needed[i]) for_each_inherited(i, [&](int t) { needed[t] = 1; });
+    }
+    // The others hold all of their ids for a scan instead
+    std::vector<PostingList> all_ids(n);
+    cold_states.assign(n, 0);
+    size_t dropped = 0, num_dropped = 0;
+    for (int i : order) {
+        if (!searches_graphs(i) || needed[i]) continue;
+        all_ids[i] = candidate_ids[i];
+        for_each_inherited(i, [&](int t) { all_ids[i] = PostingList::merge(all_ids[i], candidate_ids[t]); });
+        if (has_graph(i)) {
+            dropped += candidate_ids[i].size();
+            num_dropped++;
+        }
+        cold_states[i] = 1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!cold_states[i]) continue;
+        candidate_ids[i] = std::move(all_ids[i]);
+        inherit_states[i] = -1;
+        if (!extra_inherit_states.empty()) extra_inherit_states[i].clear();
+    }
+    LOG_INFO("Query log: ", num_dropped, " graphs (", dropped, " vertices) dropped, their states are scanned");
+    return dropped;
+}
+
+size_t VectorMaton::fit_memory_budget(const std::function<bool(int)>& graph) {
+    PatternIndex& index = pattern_index();
+    int n = candidate_ids.size();
+    if (!space) {
+        space = new hnswlib::L2Space(dim);
+    }
+    if (cost_model.samples.empty()) cost_model.calibrate(vecs, dim, num_elements, space, hnsw_policy);
+    // Without a calibrated model, a scan costs its number of vectors and searches are free
+    bool calibrated = !cost_model.samples.empty();
+    auto scan_us = [&](size_t m) { return calibrated ? cost_model.scan_latency(m) : double(m); };
+    auto search_us = [&](size_t m) { return calibrated ? cost_model.search_latency(m) : 0.0; };
+    auto graph_bytes = [&](size_t m) {
+        return (double)StateIndex::estimate_bytes(backend_policy.choose(m), m, dim, hnsw_policy.choose(m, dim));
+    };
+    // Query weight of a state: its logged frequency, uniform without a query log
+    std::vector<double> weight(n, query_log.empty() ? 1.0 : 0.0);
+    for (const auto& q : query_log) {
+        int v = index.query(q.first);
+        if (v != -1) weight[entry(v)] += q.second;
+    }
+    // Estimated size(): pattern index, id lists, planned graphs and the global graph of filtered states
+    double total = index.size_bytes() + sizeof(int) * (n * 3 + shared_states.size()), id_bytes = 0, stored_ids = 0;
+    bool any_filtered = false;
+    for (int i = 0; i < n; i++) {
+        id_bytes += candidate_ids[i].size_bytes();
+        stored_ids += candidate_ids[i].size();
+        if (graph(i)) total += graph_bytes(candidate_ids[i].size());
+        any_filtered |= filtered(i);
+    }
+    for (const auto& extra : extra_inherit_states) {
+        total += sizeof(extra) + sizeof(int) * extra.capacity();
+    }
+    double bytes_per_id = stored_ids > 0 ? id_bytes / stored_ids : sizeof(uint32_t);
+    total += id_bytes;
+    if (any_filtered) total += StateIndex::estimate_bytes(StateIndex::HNSW, num_elements, dim, hnsw_policy.choose(num_elements, dim));
+    double planned = total;
+    if (total <= memory_budget) {
+        LOG_INFO("Memory budget: the planned index takes about ", size_t(total), " of ", memory_budget, " bytes");
+        return 0;
+    }
+
+    if (cold_states.empty()) cold_states.assign(n, 0);
+    std::vector<std::vector<int>> users(n);
+    for (int i = 0; i < n; i++) {
+        for_each_inherited(i, [&](int t) { users[t].emplace_back(i); });
+    }
+    auto inherited = [&](int v) {
+        std::vector<int> res;
+        for_each_inherited(v, [&](int t) { res.emplace_back(t); });
+        return res;
+    };
+    auto set_inherited = [&](int v, const std::vector<int>& res) {
+        inherit_states[v] = res.empty() ? -1 : res[0];
+        if (!extra_inherit_states.empty()) extra_inherit_states[v].assign(res.begin() + std::min<size_t>(res.size(), 1), res.end());
+    };
+    // A state's ids are its own and those of the graphs it inherits (queries do not search further)
+    auto num_ids = [&](int v) {
+        size_t res = candidate_ids[v].size();
+        for_each_inherited(v, [&](int t) { res += candidate_ids[t].size(); });
+        return res;
+    };
+    auto all_ids = [&](int v) {
+        PostingList res = candidate_ids[v];
+        for_each_inherited(v, [&](int t) { res = PostingList::merge(res, candidate_ids[t]); });
+        return res;
+    };
+    // Expected latency of a query on state v: a search of its graph or a scan, plus its inherited graphs
+    auto latency = [&](int v) {
+        double us = graph(v) ? search_us(candidate_ids[v].size()) : scan_us(candidate_ids[v].size());
+        for_each_inherited(v, [&](int t) { us += search_us(candidate_ids[t].size()); });
+        return weight[v] * us;
+    };
+    // Latency added and bytes saved by demoting the graph of state i
+    auto effect = [&](int i) {
+        size_t m = candidate_ids[i].size(), all = num_ids(i);
+        double cost = weight[i] * scan_us(all) - latency(i);
+        double saved = graph_bytes(m) - (all - m) * bytes_per_id;
+        for (int j : users[i]) {
+            size_t mj = candidate_ids[j].size();
+            if (graph(j)) {
+                cost += weight[j] * (search_us(mj + m) - search_us(mj) - search_us(m));
+                saved -= graph_bytes(mj + m) - graph_bytes(mj) + m * bytes_per_id;
+            }
+            else {
+                size_t all_j = num_ids(j);
+                cost += weight[j] * scan_us(all_j) - latency(j);
+                saved -= (all_j - mj) * bytes_per_id;
+            }
+        }
+        return std::make_pair(cost, saved);
+    };
+    // Scan all ids of v, no longer searching the graphs it inherits
+    auto demote = [&](int v) {
+        std::vector<int> from = inherited(v);
+        candidate_ids[v] = all_ids(v);
+        if (!from.empty()) set_inherited(v, {});
+        for (int t : from) users[t].erase(std::find(users[t].begin(), users[t].end(), v));
+        cold_states[v] = 1;
+        return from;
+    };
+
+    // Lazy greedy: an entry is stale once its state was pushed again
+    typedef std::tuple<double, double, int, int> Entry; // cost per byte saved, -bytes saved, state, version
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+    std::vector<int> version(n, 0);
+    auto push = [&](int i) {
+        version[i]++;
+        if (!graph(i)) return;
+        auto [cost, saved] = effect(i);
+        if (saved > 0) heap.emplace(cost / saved, -saved, i, version[i]);
+    };
+    for (int i = 0; i < n; i++) push(i);
+    size_t demoted = 0, num_demoted = 0, largest = 0;
+    while (total > memory_budget && !heap.empty()) {
+        auto [ratio, neg_saved, i, ver] = heap.top();
+        heap.pop();
+        if (ver != version[i]) continue;
+        total += neg_saved;
+        size_t m = candidate_ids[i].size();
+        demoted += m;
+        num_demoted++;
+        largest = std::max(largest, m);
+        std::vector<int> affected = users[i];
+        for (int j : users[i]) {
+            if (graph(j)) {
+                // j indexes the demoted graph's ids itself (the graphs i inherits hold others of j's ids)
+                std::vector<int> res = inherited(j);
+                res.erase(std::find(res.begin(), res.end(), i));
+                set_inherited(j, res);
+                candidate_ids[j] = PostingList::merge(candidate_ids[j], candidate_ids[i]);
+                affected.insert(affected.end(), users[j].begin(), users[j].end());
+            }
+            else {
+                for (int t : demote(j)) {
+                    if (t != i) affected.emplace_back(t);
+                }
+                LOG_DEBUG("Memory budget: state ", j, " (", candidate_ids[j].size(), " ids) scanned, its inherited graph was demoted");
+            }
+        }
+        users[i].clear();
+        std::vector<int> from = demote(i);
+        affected.insert(affected.end(), from.begin(), from.end());
+        LOG_DEBUG("Memory budget: graph of state ", i, " (", m, " vertices) demoted, the state scans ", candidate_ids[i].size(), " ids");
+        for (int v : affected) push(v);
+        push(i);
+    }
+    if (total > memory_budget) {
+        LOG_WARN("Memory budget: ", memory_budget, " bytes is below the index without graphs, about ", size_t(total), " bytes");
+    }
+    LOG_INFO("Memory budget: ", num_demoted, " graphs (", demoted, " vertices, the largest of ", largest, ") demoted to scans, estimated index size ",
+             size_t(planned), " -> ", size_t(total), " of ", memory_budget, " bytes");
+    return demoted;
+}
+
+bool VectorMaton::wants_graph(int i, size_t n) const {
+    if (!cold_states.empty() && cold_states[i]) return false;
+    if (!cost_model.per_state || cost_model.samples.empty()) return n >= (size_t)min_build_threshold;
+    double inherited_us = 0;
+    for_each_inherited(i, [&](int t) { inherited_us += cost_model.search_latency(candidate_ids[t].size()); });
+    return cost_model.wants_graph(n, inherited_us);
+}
+
+void VectorMaton::report_workload(size_t dropped) {
+    if (query_log.empty()) return;
+    if (cost_model.samples.empty()) cost_model.calibrate(vecs, dim, num_elements, space, hnsw_policy);
+    if (cost_model.samples.empty()) return;
+    // Projected latency of one query on state i: a scan of its ids or a search of its graph, plus
+    // a search of every graph it inherits
+    auto latency = [&](int i) {
+        size_t n = candidate_ids[i].size();
+        double us = indexes[i] ? cost_model.search_latency(n) : cost_model.scan_latency(n);
+        if (filtered(i)) us = cost_model.search_latency(num_elements) * num_elements / std::max<size_t>(n, 1);
+        for_each_inherited(i, [&](int t) { us += cost_model.search_latency(candidate_ids[t].size()); });
+        return us;
+    };
+    double total = 0, weight = 0, worst = 0;
+    for (const auto& q : query_log) {
+        int v = pattern_index().query(q.first);
+        if (v == -1) continue;
+        total += q.second * latency(entry(v));
+        weight += q.second;
+    }
+    size_t vertices = 0;
+    double bytes = 0;
+    for (int i = 0; i < indexes.size(); i++) {
+        if (indexes[i]) {
+            vertices += candidate_ids[i].size();
+            bytes += indexes[i]->size_bytes();
+        }
+        if (!cold_states.empty() && cold_states[i]) worst = std::max(worst, latency(i));
+    }
+    double build_us = 0;
+    for (const auto& sample : cost_model.samples) build_us += sample.build_us / cost_model.samples.size();
+    LOG_INFO("Query log workload: projected ", total / std::max(weight, 1.0), "us per logged query, up to ", worst,
+             "us on a state whose graph was dropped; about ", timeFormatting((unsigned long long)(dropped * build_us)).str(),
+             " of construction and ", size_t(dropped * bytes / std::max<size_t>(vertices, 1)), " bytes of graphs saved");
+}
+
+bool VectorMaton::load_query_log(const std::string& path) {
+    std::ifstream f(path);
+    if (!f) return false;
+    std::unordered_map<std::string, double> freq;
+    std::string line;
+    while (std::getline(f, line)) {
+        size_t tab = line.rfind('\t');
+        if (tab == std::string::npos) freq[line] += 1;
+        else freq[line.substr(0, tab)] += std::atof(line.c_str() + tab + 1);
+    }
+    query_log.assign(freq.begin(), freq.end());
+    std::sort(query_log.begin(), query_log.end());
+    return true;
+}
+
+PostingList VectorMaton::seed_index(StateIndex* index, const PostingList& ids, std::vector<int> graphs) {
+    if (global_graph && index->derive(*global_graph, ids)) return PostingList();
+    if (!merge_graphs) return ids;
+    std::stable_sort(graphs.begin(), graphs.end(), [&](int a, int b) {
+        return candidate_ids[a].size() > candidate_ids[b].size();
+    });
+    // Copy one graph, the largest of the same backend whose ids are all in ids; the other graphs'
+    // vertices are inserted as new ones
+    for (int t : graphs) {
+        if (!indexes[t] || indexes[t]->kind() != index->kind() || candidate_ids[t].empty()) continue;
+        if (candidate_ids[t].size() > ids.size()) continue;
+        PostingList rest = PostingList::difference(ids, candidate_ids[t]);
+        if (ids.size() - rest.size() != candidate_ids[t].size()) continue;
+        // Seeding copies links and labels only: the graph's data pointer is not needed (nor written,
+        // as successor graphs are read by concurrent builds)
+        if (index->seed(*indexes[t])) return rest;
+    }
+    return ids;
+}
+
+size_t VectorMaton::plan_inheritance() {
+    cold_states.clear();
+    PatternIndex& index = pattern_index();
+    int n = index.num_states();
+    std::vector<int> order = index.build_order();
+    std::vector<int> succ_begin(n + 1, 0), succ;
+    for (int i = 0; i < n; i++) {
+        index.successors(i, succ);
+        succ_begin[i + 1] = succ.size();
+    }
+    auto successors = [&](int i) {
+        return std::vector<int>(succ.begin() + succ_begin[i], succ.begin() + succ_begin[i + 1]);
+    };
+    // Graph vertices and inherited graphs per state with a graph
+    auto report = [&](const char* name) {
+        size_t vertices = 0, graphs = 0, inherited = 0;
+        for (int i = 0; i < n; i++) {
+            if (!has_graph(i)) continue;
+            vertices += candidate_ids[i].size();
+            graphs++;
+            for_each_inherited(i, [&](int) { inherited++; });
+        }
+        LOG_INFO("Inheritance plan (", name, "): ", graphs, " graphs, ", vertices, " graph vertices, a query on a state with a graph searches ",
+                 std::fixed, std::setprecision(2), graphs ? 1.0 + double(inherited) / graphs : 0.0, std::defaultfloat, " graphs on average");
+        return vertices;
+    };
+
+    // Greedy plan, as build_smart
+    shared_states.assign(n, -1);
+    inherit_states.assign(n, -1);
+    extra_inherit_states.assign(max_fan_in > 1 ? n : 0, {});
+    filtered_states.assign(filter_selectivity > 0 ? n : 0, 0);
+    candidate_ids.assign(n, PostingList());
+    std::vector<size_t> num_ids(n);
+    for (int i : order) {
+        PostingList ids = index.take_ids(i);
+        num_ids[i] = ids.size();
+        if (share_ids(i, ids)) continue;
+        if (use_filter(ids.size())) filter_state(i, std::move(ids));
+        else if (!wants_graph(i, ids.size())) candidate_ids[i] = std::move(ids);
+        else candidate_ids[i] = inherit_graphs(i, ids, successor_graphs(successors(i)));
+    }
+    size_t greedy = report("greedy");
+    std::vector<int> greedy_inherit = inherit_states;
+    std::vector<std::vector<int>> greedy_extra = extra_inherit_states;
+    std::vector<PostingList> greedy_ids = candidate_ids;
+    // All ids of state i: its residual and the graphs it inherits in the greedy plan
+    auto full_ids = [&](int i) {
+        PostingList ids = greedy_ids[i];
+        if (greedy_inherit[i] != -1) ids = PostingList::merge(ids, greedy_ids[greedy_inherit[i]]);
+        if (!greedy_extra.empty()) {
+            for (int t : greedy_extra[i]) ids = PostingList::merge(ids, greedy_ids[t]);
+        }
+        return ids;
+    };
+    auto vertices = [&]() {
+        size_t res = 0;
+        for (int i = 0; i < n; i++) {
+            if (has_graph(i)) res += candidate_ids[i].size();
+        }
+        return res;
+    };
+
+    // Greedy is not optimal: a graph only holds the ids its state does not inherit, so the more a
+    // state inherits, the less its predecessors can. Plan greedily again with the states of whole
+    // inheriting nothing, their graphs holding all of their ids.
+    auto replan = [&](const std::vector<char>& whole) {
+        inherit_states.assign(n, -1);
+        if (max_fan_in > 1) extra_inherit_states.assign(n, {});
+        for (int i : order) {
+            if (entry(i) != i || filtered(i)) continue;
+            PostingList ids = full_ids(i);
+            if (whole[i] || !wants_graph(i, ids.size())) candidate_ids[i] = std::move(ids);
+            else candidate_ids[i] = inherit_graphs(i, ids, successor_graphs(successors(i)));
+        }
+        return vertices();
+    };
+    // A state v that inherits keeps its whole graph if, to first order, its predecessors would
+    // cover more ids by inheriting it whole than it covers by inheriting (each predecessor p
+    // covering num_ids[v] instead of what it inherits now). Planning again checks the estimate;
+    // states are added over a few rounds while the plan improves.
+    const int kWholeRounds = 4;
+    std::vector<char> whole(n, 0);
+    size_t best = greedy;
+    for (int round = 0; round < kWholeRounds; round++) {
+        std::vector<double> gain(n, 0);
+        std::vector<int> seen;
+        for (int p = 0; p < n; p++) {
+            if (entry(p) != p || filtered(p) || (inherit_states[p] == -1 && !has_graph(p))) continue;
+            double covered = 0;
+            for_each_inherited(p, [&](int t) { covered += candidate_ids[t].size(); });
+            seen.clear();
+            for (int k = succ_begin[p]; k < succ_begin[p + 1]; k++) {
+                int v = entry(succ[k]);
+                if (std::find(seen.begin(), seen.end(), v) != seen.end()) continue;
+                seen.emplace_back(v);
+                if (whole[v] || inherit_states[v] == -1 || !has_graph(v)) continue;
+                gain[v] += std::max(0.0, num_ids[v] - covered);
+            }
+        }
+        std::vector<char> next = whole;
+        bool changed = false;
+        for (int v = 0; v < n; v++) {
+            if (gain[v] > double(num_ids[v]) - candidate_ids[v].size()) next[v] = 1, changed = true;
+        }
+        if (!changed) break;
+        size_t planned = replan(next);
+        if (planned >= best) {
+            replan(whole);
+            break;
+        }
+        best = planned;
+        whole = std::move(next);
+    }
+    if (best < greedy) report("whole graphs");
+    if (max_fan_in == 1) {
+        LOG_INFO("Inheritance plan: ", best, " graph vertices predicted vs. ", greedy, " greedy (",
+                 std::fixed, std::setprecision(1), 100.0 * best / std::max<size_t>(greedy, 1), "%)", std::defaultfloat);
+        return best;
+    }
+
+    // A state can inherit the graph of any state below it, not only those its successors took:
+    // plan again choosing among the kCandidates largest graphs below every state (the id set of a
+    // state is its residual plus the graphs it inherits in the greedy plan)
+    const size_t kCandidates = 8 * max_fan_in;
+    std::vector<PostingList> whole_ids = candidate_ids;
+    std::vector<int> whole_inherit = inherit_states;
+    std::vector<std::vector<int>> whole_extra = extra_inherit_states;
+    inherit_states.assign(n, -1);
+    extra_inherit_states.assign(n, {});
+    std::vector<std::vector<int>> below(n);
+    for (int i : order) {
+        if (entry(i) != i) {
+            below[i] = below[entry(i)];
+            continue;
+        }
+        if (!wants_graph(i, num_ids[i]) || filtered(i)) continue;
+        std::vector<int> graphs;
+        for (int k = succ_begin[i]; k < succ_begin[i + 1]; k++) {
+            graphs.insert(graphs.end(), below[succ[k]].begin(), below[succ[k]].end());
+        }
+        std::sort(graphs.begin(), graphs.end(), [&](int a, int b) {
+            return candidate_ids[a].size() > candidate_ids[b].size() || (candidate_ids[a].size() == candidate_ids[b].size() && a < b);
+        });
+        graphs.erase(std::unique(graphs.begin(), graphs.end()), graphs.end());
+        candidate_ids[i] = inherit_graphs(i, full_ids(i), graphs);
+        if (has_graph(i)) {
+            graphs.insert(std::upper_bound(graphs.begin(), graphs.end(), i, [&](int a, int b) {
+                return candidate_ids[a].size() > candidate_ids[b].size();
+            }), i);
+        }
+        if (graphs.size() > kCandidates) graphs.resize(kCandidates);
+        below[i] = std::move(graphs);
+    }
+    size_t planned = report("planned");
+    if (planned >= best) {
+        inherit_states = std::move(whole_inherit);
+        extra_inherit_states = std::move(whole_extra);
+        candidate_ids = std::move(whole_ids);
+        planned = best;
+    }
+    LOG_INFO("Inheritance plan: ", planned, " graph vertices predicted vs. ", greedy, " greedy (",
+             std::fixed, std::setprecision(1), 100.0 * planned / std::max<size_t>(greedy, 1), "%)", std::defaultfloat);
+    return planned;
+}
+
+bool VectorMaton::build_planned(int cores) {
+    if (!build_pattern_index()) return false;
+    int n = pattern_index().num_states();
+    plan_inheritance();
+    size_t dropped = query_log.empty() ? 0 : drop_cold_graphs();
+    if (memory_budget > 0) dropped += fit_memory_budget([&](int i) { return has_graph(i); });
+    indexes.assign(n, nullptr);
+    if (!space) {
+        space = new hnswlib::L2Space(dim);
+    }
+    build_global_graph(cores, true);
+    // Graphs no longer depend on each other: build them largest first
+    std::vector<int> graphs;
+    for (int i = 0; i < n; i++) {
+        if (has_graph(i)) graphs.emplace_back(i);
+    }
+    TaskScheduler scheduler(cores);
+    for (int i : graphs) {
+        scheduler.push(i, candidate_ids[i].size());
+    }
+    std::atomic<int> built_graphs = 0;
+    std::mutex mtx;
+    int ten_percent = std::max<int>(graphs.size() / 10, 1);
+    scheduler.run(graphs.size(), [&](int i, int) {
+        indexes[i] = new_index(candidate_ids[i].size());
+        indexes[i]->build(seed_index(indexes[i], candidate_ids[i], {}));
+        int built = built_graphs.fetch_add(1) + 1;
+        if (built % ten_percent == 0) {
+            mtx.lock();
+            LOG_DEBUG("Built graphs: ", built, "/", graphs.size());
+            mtx.unlock();
+        }
+    });
+    report_shared();
+    release_global_graph();
+    report_workload(dropped);
+    if (memory_budget > 0) LOG_INFO("Memory budget: the index takes ", size(), " of ", memory_budget, " bytes");
+    gsa.set_deferred_ids(false); // later insertions maintain ids eagerly
+    return true;
 }
 
 void VectorMaton::clear_gsa() {
     for (int i = 0; i < gsa.st.size(); i++) {
-        gsa.st[i].ids = std::vector<uint32_t>();
+        gsa.st[i].ids.clear();
+    }
+}
+
+void VectorMaton::unshare_ids() {
+    if (shared_states.empty()) return;
+    if (!sharers_valid) {
+        sharers.clear();
+        for (int i = 0; i < shared_states.size(); i++) {
+            if (shared_states[i] != -1) sharers[shared_states[i]].emplace_back(i);
+        }
+        sharers_valid = true;
+    }
+    // The ids of i and its entry differ from now on: give i its own copy, without inheritance
+    auto unshare = [&](int i, int owner) {
+        shared_states[i] = -1;
+        PostingList ids = state_ids(owner);
+        if (!cold_states.empty()) cold_states[i] = cold_states[owner];
+        if (filtered(owner)) filter_state(i, std::move(ids));
+        else {
+            candidate_ids[i] = std::move(ids);
+            if (has_graph(i)) {
+                indexes[i] = new_index(candidate_ids[i].size());
+                indexes[i]->build(candidate_ids[i]);
+            }
+        }
+    };
+    std::unordered_set<int> affected(gsa.affected_states.begin(), gsa.affected_states.end());
+    for (int state : gsa.affected_states) {
+        int owner = shared_states[state];
+        if (owner != -1 && !affected.count(owner)) {
+            unshare(state, owner);
+            auto& list = sharers[owner];
+            list.erase(std::find(list.begin(), list.end(), state));
+        }
+        auto it = sharers.find(state);
+        if (it == sharers.end()) continue;
+        std::vector<int> kept;
+        for (int i : it->second) {
+            if (affected.count(i)) kept.emplace_back(i);
+            else unshare(i, state);
+        }
+        it->second = std::move(kept);
     }
 }
 
 void VectorMaton::insert(const std::vector<float>& vec, const std::string& str) {
     if (static_cast<int>(vec.size()) != dim) return;
+    if (use_fm_index) {
+        LOG_ERROR("Insertion is only supported with the GSA pattern index");
+        return;
+    }
+    if (frozen) {
+        LOG_ERROR("Cannot insert into a frozen index");
+        return;
+    }
     vecs.insert(vecs.end(), vec.begin(), vec.end());
     strs.emplace_back(str);
     num_elements++;
     gsa.add_string(num_elements - 1, str);
-    // Expand inherit_states, size_ids, candidate_ids and hnsws for the new states
+    encode_long_strings(false);
+    if (global_graph) {
+        global_graph->set_data(vecs.data());
+        global_graph->resize(num_elements);
+        global_graph->add(num_elements - 1);
+    }
+    // Expand inherit_states, size_ids, candidate_ids and indexes for the new states
     while (candidate_ids.size() < gsa.st.size()) {
         int new_state = candidate_ids.size(), num_ids = gsa.st[new_state].ids.size();
         if (inherit_states.size() > 0) inherit_states.emplace_back(-1);
-        candidate_ids.emplace_back(std::vector<int>());
-        hnsws.emplace_back(nullptr);
+        if (extra_inherit_states.size() > 0) extra_inherit_states.emplace_back();
+        if (filtered_states.size() > 0) filtered_states.emplace_back(0);
+        if (cold_states.size() > 0) cold_states.emplace_back(0);
+        if (shared_states.size() > 0) shared_states.emplace_back(-1);
+        candidate_ids.emplace_back();
+        indexes.emplace_back(nullptr);
+    }
+    unshare_ids();
+    covers_stamp.resize(candidate_ids.size(), 0);
+    covers_memo.resize(candidate_ids.size(), 0);
+    if (++insert_stamp == 0) {
+        std::fill(covers_stamp.begin(), covers_stamp.end(), 0);
+        insert_stamp = 1;
     }
     for (int state : gsa.affected_states) {
+        if (entry(state) != state) {
+            // Still has the ids of its entry, which gets the new vector
+            gsa.st[state].ids.clear();
+            continue;
+        }
         if (candidate_ids[state].empty()) {
             // For brand new states, construct index directly (without inheriting from children)
-            candidate_ids[state].resize(gsa.st[state].ids.size());
-            for (int j = 0; j < candidate_ids[state].size(); j++) {
-                candidate_ids[state][j] = gsa.st[state].ids[j];
+            candidate_ids[state] = std::move(gsa.st[state].ids);
+            gsa.st[state].ids.clear();
+            if (global_graph && use_filter(candidate_ids[state].size())) {
+                filter_state(state, std::move(candidate_ids[state]));
             }
-            gsa.st[state].ids = std::vector<uint32_t>();
-            if (candidate_ids[state].size() >= min_build_threshold) {
-                int M = 16, ef_construction = 200;
-                hnsws[state] = new hnswlib::HierarchicalNSW<float>(space, candidate_ids[state].size(), vecs.data(), M, ef_construction);
-                for (int id : candidate_ids[state]) {
-                    hnsws[state]->addPoint(id);
-                }
+            else if (has_graph(state)) {
+                indexes[state] = new_index(candidate_ids[state].size());
+                indexes[state]->build(candidate_ids[state]);
             }
         }
         else if (inherit_states.size() == 0 || inherit_states[state] == -1) {
             // For old states without inheritance, if it is not processed before, add the new vector to candidate list and index
             if (candidate_ids[state].back() != num_elements - 1) {
-                candidate_ids[state].emplace_back(num_elements - 1);
-                gsa.st[state].ids = std::vector<uint32_t>();
-                if (hnsws[state]) {
-                    hnsws[state]->resizeIndex(candidate_ids[state].size());
-                    hnsws[state]->addPoint(num_elements - 1);
+                candidate_ids[state].push_back(num_elements - 1);
+                gsa.st[state].ids.clear();
+                if (indexes[state]) {
+                    indexes[state]->set_data(vecs.data());
+                    indexes[state]->resize(candidate_ids[state].size());
+                    indexes[state]->add(num_elements - 1);
                 }
-                else if (candidate_ids[state].size() >= min_build_threshold) {
-                    int M = 16, ef_construction = 200;
-                    hnsws[state] = new hnswlib::HierarchicalNSW<float>(space, candidate_ids[state].size(), vecs.data(), M, ef_construction);
-                    for (int id : gsa.st[state].ids) {
-                        hnsws[state]->addPoint(id);
-                    }
+                else if (has_graph(state)) {
+                    indexes[state] = new_index(candidate_ids[state].size());
+                    indexes[state]->build(candidate_ids[state]);
                 }
             }
         }
         else {
             // For old states with inheritance, if it is not processed before, process it and its inherited states recursively
             if (candidate_ids[state].back() != num_elements - 1) {
-                int now = state;
-                std::vector<int> to_process = {now};
-                while (inherit_states[now] != -1 && gsa.st[now].ids.size() > 0 && gsa.st[now].ids.back() == num_elements - 1) {
-                    now = inherit_states[now];
-                    to_process.emplace_back(now);
-                }
-                for (int i = to_process.size() - 1; i >= 0; i--) {
-                    int s = to_process[i];
-                    if (gsa.st[s].ids.size() > 0 && gsa.st[s].ids.back() == num_elements - 1) {
-                        gsa.st[s].ids = std::vector<uint32_t>();
-                        if (inherit_states[s] != -1 && candidate_ids[inherit_states[s]].size() > 0 && candidate_ids[inherit_states[s]].back() == num_elements - 1) {
-                            continue;
-                        }
-                        candidate_ids[s].emplace_back(num_elements - 1);
-                        if (hnsws[s]) {
-                            hnsws[s]->resizeIndex(candidate_ids[s].size());
-                            hnsws[s]->addPoint(num_elements - 1);
-                        }
-                        else if (candidate_ids[s].size() >= min_build_threshold) {
-                            int M = 16, ef_construction = 200;
-                            hnsws[s] = new hnswlib::HierarchicalNSW<float>(space, candidate_ids[s].size(), vecs.data(), M, ef_construction);
-                            for (int id : gsa.st[s].ids) {
-                                hnsws[s]->addPoint(id);
-                            }
-                        }
+                // Whether the new vector is indexed by the graph of s or a graph it inherits, once per
+                // state: the inherited states form a DAG whose paths can be exponentially many
+                std::function<bool(int)> covers = [&](int s) {
+                    if (covers_stamp[s] == insert_stamp) return bool(covers_memo[s]);
+                    bool covered = !candidate_ids[s].empty() && candidate_ids[s].back() == num_elements - 1;
+                    if (!covered) for_each_inherited(s, [&](int t) { covered = covered || covers(t); });
+                    covers_stamp[s] = insert_stamp;
+                    covers_memo[s] = covered;
+                    return covered;
+                };
+                std::function<void(int)> process = [&](int s) {
+                    if (gsa.st[s].ids.size() == 0 || gsa.st[s].ids.back() != num_elements - 1) return;
+                    gsa.st[s].ids.clear();
+                    bool covered = false;
+                    for_each_inherited(s, [&](int t) {
+                        process(t);
+                        covered = covered || covers(t);
+                    });
+                    if (covered) return;
+                    candidate_ids[s].push_back(num_elements - 1);
+                    if (indexes[s]) {
+                        indexes[s]->set_data(vecs.data());
+                        indexes[s]->resize(candidate_ids[s].size());
+                        indexes[s]->add(num_elements - 1);
                     }
-                }
+                    else if (has_graph(s)) {
+                        indexes[s] = new_index(candidate_ids[s].size());
+                        indexes[s]->build(candidate_ids[s]);
+                    }
+                };
+                process(state);
             }
         }
     }
 }
 
-void VectorMaton::build_parallel(int cores) {
-    build_gsa();
+bool VectorMaton::build_parallel(int cores) {
+    if (use_fm_index) {
+        LOG_WARN("Parallel build needs the GSA pattern index, building sequentially");
+        return build_smart();
+    }
+    if (cost_model.per_state) calibrate_threshold();
+    if (plan_graphs || !query_log.empty() || memory_budget > 0) {
+        return build_planned(cores);
+    }
+    if (!build_gsa()) return false;
     gsa.build_reverse();
+    cold_states.clear();
+    int n = gsa.st.size();
 
     // Smart build will inherit info from children
-    inherit_states.assign(gsa.st.size(), -1);
-    candidate_ids.assign(gsa.st.size(), std::vector<int>());
-    int* largest_state = new int[gsa.st.size()];
-    for (int i = 0; i < gsa.st.size(); i++) {
-        largest_state[i] = -1;
-    }
+    inherit_states.assign(n, -1);
+    extra_inherit_states.assign(max_fan_in > 1 ? n : 0, {});
+    filtered_states.assign(filter_selectivity > 0 ? n : 0, 0);
+    candidate_ids.assign(n, PostingList());
+    shared_states.assign(n, -1);
 
-    hnsws.assign(gsa.st.size(), nullptr);
-    for (int i = 0; i < gsa.st.size(); i++) {
-        hnsws[i] = nullptr;
+    indexes.assign(n, nullptr);
+    for (int i = 0; i < n; i++) {
+        indexes[i] = nullptr;
     }
     if (!space) {
         space = new hnswlib::L2Space(dim);
     }
-    MPMCQueue q(1 << (int(log2(gsa.st.size())) + 1));
-    std::atomic<int> num_init = 0;
-    #pragma omp parallel for num_threads(cores)
-    for (int i = 0; i < gsa.st.size(); i++) {
+    build_global_graph(cores);
+
+    // Priority of a state: the id count along the heaviest chain from it to the root (a state
+    // becomes ready only after all of its successors). Ready states are built in decreasing
+    // priority, so the chains ending in the huge states near the root start first.
+    std::vector<long long> priority(n, 0);
+    std::vector<int> order = gsa.build_order();
+    for (int k = n - 1; k >= 0; k--) {
+        int i = order[k];
+        long long chain = 0;
+        for (auto prev : gsa.reverse_next[i]) {
+            chain = std::max(chain, priority[prev]);
+        }
+        priority[i] = chain + (deferred_ids ? gsa.num_marks(i) : gsa.st[i].ids.size());
+    }
+    std::vector<int>().swap(order);
+    TaskScheduler scheduler(cores);
+    int num_init = 0;
+    for (int i = 0; i < n; i++) {
         if (gsa.deg[i] == 0) {
-            if (!q.enqueue(i)) {
-                LOG_WARN("Enqueue failed for GSA state ", i);
-            }
+            scheduler.push(i, priority[i]);
             num_init++;
         }
     }
-    LOG_DEBUG("Initial boundary states: ", num_init, ", initial queue size: ", q.size(), ", match: ", num_init == q.size() ? "yes" : "no");
+    LOG_DEBUG("Initial boundary states: ", num_init);
+
+    // HNSW and NSW graphs of at least parallel_build_cutoff vectors are shared: idle threads join
+    // the owner in inserting their points (concurrent add() on one graph). The phases of bulk
+    // (NN-descent) builds are shared the same way.
+    struct SharedBuild {
+        const std::function<void(size_t)>* body;
+        size_t size;
+        std::atomic<size_t> next{0};
+        std::atomic<int> helpers{0}; // joined under shared_mtx while the job is listed
+        std::mutex mtx;
+        std::condition_variable done;
+        void run() {
+            for (size_t k = next.fetch_add(1); k < size; k = next.fetch_add(1)) {
+                (*body)(k);
+            }
+        }
+        void leave() {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (helpers.fetch_sub(1, std::memory_order_acq_rel) == 1) done.notify_all();
+        }
+        void wait_helpers() {
+            std::unique_lock<std::mutex> lock(mtx);
+            done.wait(lock, [&] { return helpers.load(std::memory_order_acquire) == 0; });
+        }
+    };
+    std::vector<SharedBuild*> shared;
+    std::mutex shared_mtx;
+    int num_shared = 0, num_bulk = 0;
+    ParallelFor shared_for = [&](size_t size, const std::function<void(size_t)>& body) {
+        SharedBuild* job = new SharedBuild();
+        job->body = &body;
+        job->size = size;
+        shared_mtx.lock();
+        shared.emplace_back(job);
+        shared_mtx.unlock();
+        scheduler.wake();
+        job->run();
+        shared_mtx.lock();
+        shared.erase(std::find(shared.begin(), shared.end(), job));
+        shared_mtx.unlock();
+        // No helper can join any more, wait for the work in flight
+        job->wait_helpers();
+        delete job;
+    };
+    std::atomic<size_t> copied_vertices = 0;
+    auto build_graph = [&](int i, const PostingList& ids, const std::vector<int>& graphs) {
+        indexes[i] = new_index(ids.size());
+        PostingList rest = seed_index(indexes[i], ids, graphs);
+        copied_vertices += ids.size() - rest.size();
+        if (nn_descent_cutoff > 0 && rest.size() == ids.size() && ids.size() >= nn_descent_cutoff) {
+            unsigned long long start_time = currentTime();
+            if (cores == 1) indexes[i]->build_bulk(ids, sequential_for);
+            else indexes[i]->build_bulk(ids, shared_for);
+            LOG_DEBUG("Bulk built the ", StateIndex::kind_name(indexes[i]->kind()), " of state ", i, " (", ids.size(), " vectors) in ",
+                      timeFormatting(currentTime() - start_time).str());
+            shared_mtx.lock();
+            num_bulk++;
+            shared_mtx.unlock();
+            return;
+        }
+        if (cores == 1 || parallel_build_cutoff <= 0 || rest.size() < parallel_build_cutoff ||
+            (indexes[i]->kind() != StateIndex::HNSW && indexes[i]->kind() != StateIndex::NSW)) {
+            indexes[i]->build(rest);
+            return;
+        }
+        std::vector<uint32_t> points = rest.decode();
+        std::function<void(size_t)> add = [&](size_t k) { indexes[i]->add(points[k]); };
+        shared_mtx.lock();
+        num_shared++;
+        shared_mtx.unlock();
+        shared_for(points.size(), add);
+    };
 
     int cur = 0, ten_percent = gsa.size_tot() / 10, tot_vertices = gsa.size_tot();
+    if (deferred_ids) {
+        // Id set sizes are unknown until materialized: report progress in states
+        ten_percent = n / 10, tot_vertices = n;
+    }
     std::atomic<int> consumed = 0, built_vertices = 0;
     std::mutex mtx;
-    #pragma omp parallel num_threads(cores)
-    {
-        int i = 0;
-        while (true) {
-            int c = consumed.load(std::memory_order_acquire);
-            if (c >= gsa.st.size())
-                break;
-
-            if (q.dequeue(i)) {
-                int prev = consumed.fetch_add(1, std::memory_order_acq_rel);
-                if (prev < gsa.st.size()) {
-                    auto& st = gsa.st[i];
-                    int prev_built = built_vertices.fetch_add(st.ids.size(), std::memory_order_acq_rel);
-                    if (prev_built >= cur) {
-                        mtx.lock();
-                        if (prev_built >= cur) {
-                            cur += ten_percent;
-                            LOG_DEBUG("Built states ", prev, "/", gsa.st.size(), " Built vertices: ", prev_built, "/", tot_vertices);
-                        }
-                        mtx.unlock();
-                    }
-                    if (st.ids.size() < min_build_threshold) {
-                        int num_ids = st.ids.size();
-                        candidate_ids[i].resize(num_ids);
-                        for (int j = 0; j < num_ids; j++) {
-                            candidate_ids[i][j] = st.ids[j];
-                        }
-                        st.ids = std::vector<uint32_t>();
-                        // Enqueue
-                        for (auto prev : gsa.reverse_next[i]) {
-                            int val = gsa.deg[prev].fetch_sub(1);
-                            if (val == 1) {
-                                q.enqueue(prev);
-                            }
-                        }
-                        continue;
-                    }
-                    // First find a successor with largest built graph
-                    int target_sc = -1;
-                    for (auto ch : st.next) {
-                        if (largest_state[ch.second] != -1 && (target_sc == -1 || candidate_ids[largest_state[ch.second]].size() > candidate_ids[target_sc].size())) {
-                            target_sc = largest_state[ch.second];
-                        }
-                    }
-                    inherit_states[i] = target_sc;
-                    if (target_sc == -1) {
-                        // No successor has built a graph, built the graph with all vector ids
-                        int M = 16, ef_construction = 200;
-                        hnsws[i] = new hnswlib::HierarchicalNSW<float>(space, st.ids.size(), vecs.data(), M, ef_construction);
-                        int num_ids = st.ids.size();
-                        candidate_ids[i].resize(num_ids);
-                        for (int j = 0; j < num_ids; j++) {
-                            int id = st.ids[j];
-                            hnsws[i]->addPoint(id);
-                            candidate_ids[i][j] = id;
-                        }
-                        largest_state[i] = i;
-                        st.ids = std::vector<uint32_t>();
-                    }
-                    else {
-                        // Found the largest successor, inherit from this successor
-                        inherit_states[i] = target_sc;
-                        largest_state[i] = target_sc;
-                        // Find remaining vertices
-                        int l = 0, r = 0, cnt = 0;
-                        int num_ids = st.ids.size() - candidate_ids[target_sc].size();
-                        candidate_ids[i].resize(num_ids);
-                        while (l < st.ids.size() || r < candidate_ids[target_sc].size()) {
-                            if (r == candidate_ids[target_sc].size()) {
-                                candidate_ids[i][cnt++] = st.ids[l++];
-                            }
-                            else {
-                                if (st.ids[l] == candidate_ids[target_sc][r]) {
-                                    l++, r++;
-                                }
-                                else {
-                                    candidate_ids[i][cnt++] = st.ids[l++];
-                                }
-                            }
-                        }
-                        // Only build when meeting requirements
-                        if (candidate_ids[i].size() >= min_build_threshold) {
-                            int M = 16, ef_construction = 200;
-                            hnsws[i] = new hnswlib::HierarchicalNSW<float>(space, candidate_ids[i].size(), vecs.data(), M, ef_construction);
-                            for (int j = 0; j < candidate_ids[i].size(); j++) {
-                                int id = candidate_ids[i][j];
-                                hnsws[i]->addPoint(id);
-                            }
-                            if (candidate_ids[i].size() > candidate_ids[target_sc].size()) {
-                                // Update largest state
-                                largest_state[i] = i;
-                            }
-                        }
-                        st.ids = std::vector<uint32_t>();
-                    }
-
-                    // Enqueue
-                    for (auto prev : gsa.reverse_next[i]) {
-                        int val = gsa.deg[prev].fetch_sub(1);
-                        if (val == 1) {
-                            q.enqueue(prev);
-                        }
-                    }
-                }
-            } else {
-                #pragma omp flush
+    auto help = [&]() {
+        shared_mtx.lock();
+        SharedBuild* job = shared.empty() ? nullptr : shared.back();
+        if (job) job->helpers.fetch_add(1, std::memory_order_acq_rel);
+        shared_mtx.unlock();
+        if (!job) return false;
+        job->run();
+        job->leave();
+        return true;
+    };
+    // Predecessors of state s whose successors are all built become ready
+    auto release = [&](int s, int worker) {
+        for (auto prev : gsa.reverse_next[s]) {
+            if (gsa.deg[prev].fetch_sub(1) == 1) {
+                scheduler.push(prev, priority[prev], worker);
             }
         }
-    }
+    };
+    scheduler.run(n, [&](int i, int worker) {
+        int prev = consumed.fetch_add(1, std::memory_order_acq_rel);
+        auto& st = gsa.st[i];
+        if (deferred_ids) st.ids = gsa.materialize_ids(i);
+        int prev_built = built_vertices.fetch_add(deferred_ids ? 1 : st.ids.size(), std::memory_order_acq_rel);
+        if (prev_built >= cur) {
+            mtx.lock();
+            if (prev_built >= cur) {
+                cur += ten_percent;
+                LOG_DEBUG("Built states ", prev, "/", n, " Built vertices: ", prev_built, "/", tot_vertices);
+            }
+            mtx.unlock();
+        }
+        // A state with the ids of another shares its entry. The first state with an id set owns it
+        // from before its graph is built, so a state with the same ids shares it even while it is
+        // built; the predecessors of such a state only become ready once the owner is final.
+        uint64_t hash = st.ids.hash();
+        int owner = claim_shared(i, hash, st.ids);
+        if (owner != -1) {
+            shared_states[i] = owner;
+            st.ids.clear();
+            if (!follow_shared(i, owner)) release(i, worker);
+            return;
+        }
+        if (use_filter(st.ids.size())) {
+            filter_state(i, std::move(st.ids));
+            st.ids.clear();
+        }
+        else if (!wants_graph(i, st.ids.size())) {
+            candidate_ids[i] = std::move(st.ids);
+            st.ids.clear();
+        }
+        else {
+            // Inherit the largest graphs of the successors, index the remaining vertices
+            std::vector<int> succ;
+            gsa.for_each_next(i, [&](GeneralizedSuffixAutomaton::Symbol, int v) {
+                succ.emplace_back(v);
+            });
+            std::vector<int> graphs = successor_graphs(succ);
+            candidate_ids[i] = inherit_graphs(i, st.ids, graphs);
+            st.ids.clear();
+            // Only build when meeting requirements
+            if (has_graph(i)) {
+                build_graph(i, candidate_ids[i], graphs);
+            }
+        }
+        for (int follower : finish_shared(i)) release(follower, worker);
+        release(i, worker);
+    }, help);
+    LOG_DEBUG("Scheduler steals: ", scheduler.num_steals(), ", parks: ", scheduler.num_parks());
+    LOG_DEBUG("Graphs built by several threads: ", num_shared);
+    if (nn_descent_cutoff > 0) LOG_INFO("Graphs built by NN-descent: ", num_bulk);
+    if (merge_graphs || derive_graphs) LOG_INFO("Graph vertices copied from other graphs: ", copied_vertices.load());
+    report_shared();
+    release_global_graph();
+    gsa.set_deferred_ids(false); // later insertions maintain ids eagerly
+    return true;
 }
 
-void VectorMaton::build_smart() {
-    build_gsa();
+bool VectorMaton::build_smart() {
+    if (cost_model.per_state) calibrate_threshold();
+    if (plan_graphs || !query_log.empty() || memory_budget > 0) {
+        return build_planned(1);
+    }
+    if (!build_pattern_index()) return false;
+    cold_states.clear();
+    PatternIndex& index = pattern_index();
+    int num_states = index.num_states();
     
     // Smart build will inherit info from children
-    inherit_states.assign(gsa.st.size(), -1);
-    candidate_ids.assign(gsa.st.size(), std::vector<int>());
-    int* largest_state = new int[gsa.st.size()];
-    for (int i = 0; i < gsa.st.size(); i++) {
-        largest_state[i] = -1;
-    }
+    shared_states.assign(num_states, -1);
+    inherit_states.assign(num_states, -1);
+    extra_inherit_states.assign(max_fan_in > 1 ? num_states : 0, {});
+    filtered_states.assign(filter_selectivity > 0 ? num_states : 0, 0);
+    candidate_ids.assign(num_states, PostingList());
 
-    hnsws.assign(gsa.st.size(), nullptr);
-    for (int i = 0; i < gsa.st.size(); i++) {
-        hnsws[i] = nullptr;
+    indexes.assign(num_states, nullptr);
+    for (int i = 0; i < num_states; i++) {
+        indexes[i] = nullptr;
     }
     if (!space) {
         space = new hnswlib::L2Space(dim);
     }
-    int cur = 0, ten_percent = gsa.size_tot() / 10, built_vertices = 0, tot_vertices = gsa.size_tot();
-    auto topo_order = gsa.topo_sort();
-    for (int i = topo_order.size() - 1; i >= 0; i--) {
+    build_global_graph(gsa_threads);
+    // Id set sizes are known up front only for an eagerly built GSA, otherwise report progress in states
+    bool count_ids = !use_fm_index && !deferred_ids;
+    int cur = 0, built_vertices = 0, tot_vertices = count_ids ? gsa.size_tot() : num_states, ten_percent = tot_vertices / 10;
+    auto order = index.build_order();
+    std::vector<int> succ;
+    size_t copied_vertices = 0;
+    for (int t = 0; t < order.size(); t++) {
+        int i = order[t];
         if (built_vertices >= cur) {
             cur += ten_percent;
-            LOG_DEBUG("Building HNSW for state ", gsa.st.size() - i, "/", gsa.st.size(), " Built vertices: ", built_vertices, "/", tot_vertices);
+            LOG_DEBUG("Building HNSW for state ", t + 1, "/", num_states, " Built vertices: ", built_vertices, "/", tot_vertices);
         }
-        built_vertices += gsa.st[i].ids.size();
-        auto& st = gsa.st[i];
-        if (st.ids.size() < min_build_threshold) {
-            candidate_ids[i].resize(st.ids.size());
-            for (int j = 0; j < st.ids.size(); j++) {
-                candidate_ids[i][j] = st.ids[j];
-            }
-            st.ids = std::vector<uint32_t>();
+        PostingList ids = index.take_ids(i);
+        built_vertices += count_ids ? ids.size() : 1;
+        if (share_ids(i, ids)) continue;
+        if (use_filter(ids.size())) {
+            filter_state(i, std::move(ids));
             continue;
         }
-        // First find a successor with largest built graph
-        int target_sc = -1;
-        for (auto ch : st.next) {
-            if (largest_state[ch.second] != -1 && (target_sc == -1 || candidate_ids[largest_state[ch.second]].size() > candidate_ids[target_sc].size())) {
-                target_sc = largest_state[ch.second];
-            }
-        }
-        inherit_states[i] = target_sc;
-        if (target_sc == -1) {
-            // No successor has built a graph, built the graph with all vector ids
-            int M = 16, ef_construction = 200;
-            hnsws[i] = new hnswlib::HierarchicalNSW<float>(space, st.ids.size(), vecs.data(), M, ef_construction);
-            int num_ids = st.ids.size();
-            candidate_ids[i].resize(num_ids);
-            for (int j = 0; j < num_ids; j++) {
-                int id = st.ids[j];
-                hnsws[i]->addPoint(id);
-                candidate_ids[i][j] = id;
-            }
-            largest_state[i] = i;
-            st.ids = std::vector<uint32_t>();
+        if (!wants_graph(i, ids.size())) {
+            candidate_ids[i] = std::move(ids);
+            continue;
         }
-        else {
-            // Found the largest successor, inherit from this successor
-            inherit_states[i] = target_sc;
-            largest_state[i] = target_sc;
-            // Find remaining vertices
-            int l = 0, r = 0, cnt = 0;
-            int num_ids = st.ids.size() - candidate_ids[target_sc].size();
-            candidate_ids[i].resize(num_ids);
-            while (l < st.ids.size() || r < candidate_ids[target_sc].size()) {
-                if (r == candidate_ids[target_sc].size()) {
-                    candidate_ids[i][cnt++] = st.ids[l++];
-                }
-                else {
-                    if (st.ids[l] == candidate_ids[target_sc][r]) {
-                        l++, r++;
-                    }
-                    else {
-                        candidate_ids[i][cnt++] = st.ids[l++];
-                    }
-                }
-            }
-            // Only build when meeting requirements
-            if (candidate_ids[i].size() >= min_build_threshold) {
-                int M = 16, ef_construction = 200;
-                hnsws[i] = new hnswlib::HierarchicalNSW<float>(space, candidate_ids[i].size(), vecs.data(), M, ef_construction);
-                for (int j = 0; j < candidate_ids[i].size(); j++) {
-                    int id = candidate_ids[i][j];
-                    hnsws[i]->addPoint(id);
-                }
-                if (candidate_ids[i].size() > candidate_ids[target_sc].size()) {
-                    // Update largest state
-                    largest_state[i] = i;
-                }
-            }
-            st.ids = std::vector<uint32_t>();
+        // Inherit the largest graphs of the successors, index the remaining vertices
+        succ.clear();
+        index.successors(i, succ);
+        std::vector<int> graphs = successor_graphs(succ);
+        candidate_ids[i] = inherit_graphs(i, ids, graphs);
+        // Only build when meeting requirements
+        if (has_graph(i)) {
+            indexes[i] = new_index(candidate_ids[i].size());
+            PostingList rest = seed_index(indexes[i], candidate_ids[i], graphs);
+            copied_vertices += candidate_ids[i].size() - rest.size();
+            indexes[i]->build(rest);
         }
     }
+    if (merge_graphs || derive_graphs) LOG_INFO("Graph vertices copied from other graphs: ", copied_vertices);
+    report_shared();
 
-    delete [] largest_state;
+    release_global_graph();
+    gsa.set_deferred_ids(false); // later insertions maintain ids eagerly
     // clear_gsa();
+    return true;
 }
 
-void VectorMaton::build_full() {
-    build_gsa();
-    candidate_ids.assign(gsa.st.size(), std::vector<int>());
+void VectorMaton::plan_full() {
+    PatternIndex& index = pattern_index();
+    int n = index.num_states();
+    shared_states.assign(n, -1);
+    candidate_ids.assign(n, PostingList());
+    cold_states.assign(n, 0);
+    filtered_states.assign(filter_selectivity > 0 ? n : 0, 0);
+    for (int i = 0; i < n; i++) {
+        PostingList ids = index.take_ids(i);
+        if (share_ids(i, ids)) continue;
+        if (use_filter(ids.size())) filter_state(i, std::move(ids));
+        else candidate_ids[i] = std::move(ids);
+    }
+    // A state is logged if a logged query resolves to it through a state sharing its entry
+    std::vector<char> logged = query_log.empty() ? std::vector<char>() : logged_states();
+    if (!logged.empty()) calibrate_cold_scans();
+    for (int i = 0; i < n && !logged.empty(); i++) {
+        size_t m = candidate_ids[i].size();
+        cold_states[i] = entry(i) == i && !filtered(i) && !logged[i] && !cold_needs_graph(m);
+    }
+    if (memory_budget > 0) fit_memory_budget([&](int i) { return !filtered(i) && !cold_states[i] && entry(i) == i; });
+}
+
+bool VectorMaton::plan_build(bool full, int cores) {
+    if (cost_model.per_state) calibrate_threshold();
+    unsigned long long start_time = currentTime();
+    if (!build_pattern_index()) return false;
+    LOG_INFO("Plan: pattern index built in ", timeFormatting(currentTime() - start_time).str());
+    int n = pattern_index().num_states();
+    std::function<bool(int)> graph;
+    if (full) {
+        plan_full();
+        graph = [&](int i) { return !filtered(i) && !cold_states[i] && entry(i) == i; };
+    }
+    else {
+        plan_inheritance();
+        if (!query_log.empty()) drop_cold_graphs();
+        if (memory_budget > 0) fit_memory_budget([&](int i) { return has_graph(i); });
+        graph = [&](int i) { return has_graph(i); };
+    }
+    std::unordered_map<uint64_t, std::vector<int>>().swap(id_set_owners);
+    size_t num_shared = 0;
+    for (int i = 0; i < shared_states.size(); i++) num_shared += entry(i) != i;
+    if (!space) {
+        space = new hnswlib::L2Space(dim);
+    }
+    if (cost_model.samples.empty()) {
+        cost_model.calibrate(vecs, dim, num_elements, space, hnsw_policy);
+        if (cost_model.samples.empty()) LOG_WARN("Too few vectors to calibrate the cost model, no construction time predicted");
+        else cost_model.log();
+    }
+    // Graphs; in build_parallel one of at least parallel_build_cutoff vectors is built by all threads
+    size_t graphs = 0, vertices = 0, largest = 0;
+    double graph_bytes = 0, build_us = 0, critical_us = 0;
+    bool any_filtered = false;
+    for (int i = 0; i < n; i++) {
+        any_filtered |= filtered(i);
+        if (!graph(i)) continue;
+        size_t m = candidate_ids[i].size();
+        graphs++;
+        vertices += m;
+        largest = std::max(largest, m);
+        graph_bytes += StateIndex::estimate_bytes(backend_policy.choose(m), m, dim, hnsw_policy.choose(m, dim));
+        double us = cost_model.build_time(m);
+        build_us += us;
+        critical_us = std::max(critical_us, !full && parallel_build_cutoff > 0 && m >= parallel_build_cutoff ? us / cores : us);
+    }
+    // The global graph is built by all threads before the others
+    double global_us = 0;
+    if (derive_graphs || any_filtered) global_us = cost_model.build_time(num_elements);
+    if (any_filtered) graph_bytes += StateIndex::estimate_bytes(StateIndex::HNSW, num_elements, dim, hnsw_policy.choose(num_elements, dim));
+    // The other components as size() reports them
+    size_t pattern_bytes = pattern_index().size_bytes(), id_bytes = sizeof(int) * (n * 3 + shared_states.size());
+    for (int i = 0; i < n; i++) {
+        id_bytes += candidate_ids[i].size_bytes();
+    }
+    for (const auto& extra : extra_inherit_states) {
+        id_bytes += sizeof(extra) + sizeof(int) * extra.capacity();
+    }
+    LOG_INFO("Plan: ", graphs, " graphs, ", vertices, " graph vertices (the largest graph has ", largest, "), ", num_shared, " of ", n,
+             " states share the entry of a state with the same ids");
+    LOG_INFO("Plan: estimated index size ", size_t(graph_bytes) + pattern_bytes + id_bytes, " bytes: graphs ", size_t(graph_bytes), ", ",
+             use_fm_index ? "FM-index " : "suffix automaton ", pattern_bytes, ", candidate ids ", id_bytes);
+    LOG_INFO("Plan: estimated graph construction ", timeFormatting((unsigned long long)(global_us + build_us)).str(), " on one thread, ",
+             timeFormatting((unsigned long long)(global_us / cores + std::max(build_us / cores, critical_us))).str(), " with ", cores, " threads");
+    return true;
+}
+
+bool VectorMaton::build_full(int cores) {
+    if (!build_pattern_index()) return false;
+    PatternIndex& index = pattern_index();
+    int num_states = index.num_states();
+    // A memory budget needs the size of every state, a query log the states that share the entry of
+    // a logged one: take all ids and choose the graphs first
+    bool sized = memory_budget > 0 || !query_log.empty();
+    if (sized) plan_full();
+    else {
+        shared_states.assign(num_states, -1);
+        candidate_ids.assign(num_states, PostingList());
+        filtered_states.assign(filter_selectivity > 0 ? num_states : 0, 0);
+    }
+    if (!sized) cold_states.clear();
 
     // Build graph index
-    hnsws.assign(gsa.st.size(), nullptr);
-    for (int i = 0; i < gsa.st.size(); i++) {
-        hnsws[i] = nullptr;
+    indexes.assign(num_states, nullptr);
+    for (int i = 0; i < num_states; i++) {
+        indexes[i] = nullptr;
     }
     if (!space) {
         space = new hnswlib::L2Space(dim);
     }
-    int cur = 0, ten_percent = gsa.size_tot() / 10, built_vertices = 0, tot_vertices = gsa.size_tot();
-    for (int i = gsa.st.size() - 1; i >= 0; i--) {
-        if (built_vertices >= cur) {
-            cur += ten_percent;
-            LOG_DEBUG("Building HNSW for state ", gsa.st.size() - i, "/", gsa.st.size(), " Built vertices: ", built_vertices, "/", tot_vertices);
+    build_global_graph(cores, sized);
+    // Id set sizes are known up front only for an eagerly built GSA, otherwise report progress in states
+    bool count_ids = !use_fm_index && !deferred_ids;
+    int cur = 0, tot_vertices = count_ids ? gsa.size_tot() : num_states, ten_percent = tot_vertices / 10;
+    std::atomic<int> built_states = 0, built_vertices = 0;
+    std::atomic<size_t> copied_vertices = 0, dropped = 0;
+    std::mutex mtx;
+    // States are independent: every state is a ready task from the start, low state ids first
+    // (in an ordered GSA, the large states of short patterns). Graphs seeded from a successor's
+    // graph (merge_graphs) wait for their successors instead: states are built in waves by their
+    // height above the sinks.
+    std::vector<std::vector<int>> waves(1);
+    if (merge_graphs) {
+        std::vector<int> height(num_states, 0), succ;
+        for (int i : index.build_order()) {
+            succ.clear();
+            index.successors(i, succ);
+            for (int v : succ) height[i] = std::max(height[i], height[v] + 1);
+            if (height[i] >= waves.size()) waves.resize(height[i] + 1);
         }
-        built_vertices += gsa.st[i].ids.size();
-        auto& st = gsa.st[i];
-        candidate_ids[i].resize(st.ids.size());
-        for (int j = 0; j < st.ids.size(); j++) {
-            candidate_ids[i][j] = st.ids[j];
+        for (int i = num_states - 1; i >= 0; i--) waves[height[i]].emplace_back(i);
+    }
+    else {
+        for (int i = num_states - 1; i >= 0; i--) waves[0].emplace_back(i);
+    }
+    TaskScheduler scheduler(cores);
+    auto place = [&](int i, PostingList ids) {
+        if (use_filter(ids.size())) {
+            filter_state(i, std::move(ids));
+            return;
+        }
+        if (!cold_states.empty() && cold_states[i]) {
+            // Every graph of a full build is its own: only logged states (and large ones) need theirs
+            dropped += ids.size();
+            candidate_ids[i] = std::move(ids);
+            return;
+        }
+        indexes[i] = new_index(ids.size());
+        std::vector<int> succ;
+        if (merge_graphs) index.successors(i, succ);
+        PostingList rest = seed_index(indexes[i], ids, succ);
+        copied_vertices += ids.size() - rest.size();
+        indexes[i]->build(rest);
+        candidate_ids[i] = std::move(ids);
+    };
+    auto body = [&](int i, int) {
+        PostingList ids = sized ? std::move(candidate_ids[i]) : index.take_ids(i);
+        int prev = built_states.fetch_add(1), prev_built = built_vertices.fetch_add(count_ids ? ids.size() : 1);
+        if (prev_built >= cur) {
+            mtx.lock();
+            if (prev_built >= cur) {
+                cur += ten_percent;
+                LOG_DEBUG("Building HNSW for state ", prev + 1, "/", num_states, " Built vertices: ", prev_built, "/", tot_vertices);
+            }
+            mtx.unlock();
         }
-        int M = 16, ef_construction = 200;
-        hnsws[i] = new hnswlib::HierarchicalNSW<float>(space, st.ids.size(), vecs.data(), M, ef_construction);
-        for (auto id : st.ids) {
-            hnsws[i]->addPoint(id);
+        if (sized) {
+            // plan_full chose the shared entries
+            if (entry(i) == i) place(i, std::move(ids));
+            return;
         }
-        st.ids = std::vector<uint32_t>();
+        // A state with the ids of another shares its entry, also while the owner is built (the
+        // waves keep its readers until after)
+        int owner = claim_shared(i, ids.hash(), ids);
+        if (owner != -1) {
+            shared_states[i] = owner;
+            return;
+        }
+        place(i, std::move(ids));
+        finish_shared(i);
+    };
+    for (const auto& wave : waves) {
+        for (int i : wave) {
+            scheduler.push(i, num_states - i);
+        }
+        scheduler.run(wave.size(), body);
     }
+    if (merge_graphs || derive_graphs) LOG_INFO("Graph vertices copied from other graphs: ", copied_vertices.load());
+    report_shared();
+    release_global_graph();
+    report_workload(dropped);
+    if (memory_budget > 0) LOG_INFO("Memory budget: the index takes ", size(), " of ", memory_budget, " bytes");
+    gsa.set_deferred_ids(false); // later insertions maintain ids eagerly
     
     // clear_gsa();
+    return true;
 }
 
 void VectorMaton::load_index(const char* input_folder) {
     namespace fs = std::filesystem;
+    if (use_fm_index) {
+        LOG_ERROR("Saved indexes are only supported with the GSA pattern index");
+        return;
+    }
     fs::path in_path(input_folder);
 
     fs::path gsa_file = in_path / "gsa.in";
@@ -407,6 +1458,8 @@ void VectorMaton::load_index(const char* input_folder) {
     std::vector<char> filename(tmp.begin(), tmp.end());
     filename.push_back('\0');
     gsa = GeneralizedSuffixAutomaton(filename.data());
+    gsa.freeze(false); // state ids are referenced by the saved graphs, keep them
+    encode_long_strings(true);
 
     fs::path internal_file = in_path / "internal.in";
     LOG_DEBUG("Loading VectorMaton internal data from ", internal_file.string());
@@ -419,37 +1472,138 @@ void VectorMaton::load_index(const char* input_folder) {
     for (int i = 0; i < gsa.st.size(); i++) {
         f >> size_ids[i];
     }
-    candidate_ids.assign(gsa.st.size(), std::vector<int>());
+    candidate_ids.assign(gsa.st.size(), PostingList());
     for (int i = 0; i < gsa.st.size(); i++) {
-        candidate_ids[i].resize(size_ids[i]);
         for (int j = 0; j < size_ids[i]; j++) {
-            f >> candidate_ids[i][j];
+            uint32_t id;
+            f >> id;
+            candidate_ids[i].push_back(id);
         }
     }
     delete [] size_ids;
+    extra_inherit_states.clear();
+    size_t num_extra;
+    if (f >> num_extra) {
+        extra_inherit_states.assign(gsa.st.size(), {});
+        for (int i = 0; i < gsa.st.size(); i++) {
+            if (i > 0) f >> num_extra;
+            extra_inherit_states[i].resize(num_extra);
+            for (int& t : extra_inherit_states[i]) f >> t;
+        }
+    }
     f.close();
 
+    fs::path calibration_file = in_path / "calibration.in";
+    if (fs::exists(calibration_file) && cost_model.load(calibration_file.string())) {
+        min_build_threshold = cost_model.threshold;
+        cost_model.log();
+    }
+
+    // Backends other than HNSW (older indexes have no such file, all of their graphs are HNSW)
+    frozen = false;
+    std::unordered_map<int, StateIndex::Kind> kinds;
+    fs::path backends_file = in_path / "backends.in";
+    if (fs::exists(backends_file)) {
+        std::ifstream bf(backends_file.string());
+        std::string key, spec;
+        bf >> key >> spec;
+        backend_policy = BackendPolicy(spec);
+        int i, kind;
+        while (bf >> i >> kind) {
+            kinds[i] = StateIndex::Kind(kind);
+            frozen |= kinds[i] == StateIndex::FROZEN;
+        }
+        LOG_DEBUG("State index backends: ", backend_policy.spec());
+    }
+
     LOG_DEBUG("Loading HNSW data");
     space = new hnswlib::L2Space(dim);
-    hnsws.assign(gsa.st.size(), nullptr);
+    indexes.assign(gsa.st.size(), nullptr);
     for (int i = 0; i < gsa.st.size(); i++) {
-        std::string s = "hnsw";
+        auto it = kinds.find(i);
+        StateIndex::Kind kind = it == kinds.end() ? StateIndex::HNSW : it->second;
+        std::string s = StateIndex::kind_name(kind);
         s += std::to_string(i);
         std::vector<char> buf(s.begin(), s.end());
         buf.push_back('\0');
-        fs::path hnsw_file = in_path / buf.data();
-        std::string tmp = hnsw_file.string();
-        if (fs::exists(hnsw_file)) {
-            hnsws[i] = new hnswlib::HierarchicalNSW<float>(space, tmp, vecs.data());
+        fs::path index_file = in_path / buf.data();
+        std::string tmp = index_file.string();
+        if (fs::exists(index_file)) {
+            indexes[i] = StateIndex::load(kind, tmp, space, vecs.data(), dim);
         }
         else {
-            hnsws[i] = nullptr;
+            indexes[i] = nullptr;
         }
     }
+
+    cold_states.clear();
+    fs::path cold_file = in_path / "cold.in";
+    if (fs::exists(cold_file)) {
+        std::ifstream cf(cold_file.string());
+        std::string key;
+        cf >> key >> cold_build_threshold;
+        cold_states.assign(gsa.st.size(), 0);
+        int i;
+        while (cf >> i) {
+            cold_states[i] = 1;
+        }
+    }
+
+    shared_states.clear();
+    sharers_valid = false;
+    fs::path shared_file = in_path / "shared.in";
+    if (fs::exists(shared_file)) {
+        std::ifstream sf(shared_file.string());
+        shared_states.assign(gsa.st.size(), -1);
+        int i, owner;
+        while (sf >> i >> owner) {
+            shared_states[i] = owner;
+        }
+    }
+
+    filtered_states.clear();
+    delete global_graph;
+    global_graph = nullptr;
+    fs::path filtered_file = in_path / "filtered.in";
+    if (fs::exists(filtered_file)) {
+        global_graph = StateIndex::load(StateIndex::HNSW, (in_path / "global_hnsw").string(), space, vecs.data(), dim);
+        std::ifstream ff(filtered_file.string());
+        std::string key;
+        ff >> key >> filter_selectivity;
+        filtered_states.assign(gsa.st.size(), 0);
+        int i;
+        while (ff >> i) {
+            filtered_states[i] = 1;
+            candidate_ids[i].to_bitmap();
+        }
+        if (!global_graph) {
+            LOG_ERROR("Cannot load the global graph of the filtered states");
+            filtered_states.clear();
+        }
+    }
+
+    // HNSW parameters: the policy for later graphs, and the default search ef of each graph
+    // (M and ef_construction are part of the graph files). Older indexes have no such file.
+    fs::path params_file = in_path / "params.in";
+    if (fs::exists(params_file)) {
+        std::ifstream pf(params_file.string());
+        std::string key, spec;
+        pf >> key >> spec;
+        hnsw_policy = HnswPolicy(spec);
+        int i, M, ef_construction, ef_search;
+        while (pf >> i >> M >> ef_construction >> ef_search) {
+            if (i >= 0 && i < indexes.size() && indexes[i]) indexes[i]->set_ef(ef_search);
+        }
+        LOG_DEBUG("HNSW parameter policy: ", hnsw_policy.spec());
+    }
 }
 
 void VectorMaton::save_index(const char* output_folder) {
     namespace fs = std::filesystem;
+    if (use_fm_index) {
+        LOG_ERROR("Saved indexes are only supported with the GSA pattern index");
+        return;
+    }
     fs::path out_path(output_folder);
 
     if (!fs::exists(out_path)) {
@@ -467,7 +1621,7 @@ void VectorMaton::save_index(const char* output_folder) {
     LOG_DEBUG("Saving VectorMaton internal data from ", internal_file.string());
     std::ofstream f(internal_file.string());
     for (int i = 0; i < gsa.st.size(); i++) {
-        f << inherit_states[i] << " ";
+        f << (inherit_states.empty() ? -1 : inherit_states[i]) << " "; // build_full inherits nothing
     }
     f << "\n";
     for (int i = 0; i < gsa.st.size(); i++) {
@@ -475,23 +1629,78 @@ void VectorMaton::save_index(const char* output_folder) {
     }
     f << "\n";
     for (int i = 0; i < gsa.st.size(); i++) {
-        for (int j = 0; j < candidate_ids[i].size(); j++) {
-            f << candidate_ids[i][j] << " ";
-        }
+        candidate_ids[i].for_each([&](uint32_t id) {
+            f << id << " ";
+        });
         f << "\n";
     }
+    // Further inherited states (max_fan_in > 1): count and ids of each state
+    if (!extra_inherit_states.empty()) {
+        for (int i = 0; i < gsa.st.size(); i++) {
+            f << extra_inherit_states[i].size();
+            for (int t : extra_inherit_states[i]) f << " " << t;
+            f << "\n";
+        }
+    }
     f.close();
 
     LOG_DEBUG("Saving HNSW data");
+    fs::path backends_file = out_path / "backends.in";
+    std::ofstream bf(backends_file.string());
+    bf << "policy " << backend_policy.spec() << "\n";
     for (int i = 0; i < gsa.st.size(); i++) {
-        if (hnsws[i]) {
-            std::string s = "hnsw";
+        if (indexes[i]) {
+            std::string s = StateIndex::kind_name(indexes[i]->kind());
             s += std::to_string(i);
             std::vector<char> buf(s.begin(), s.end());
             buf.push_back('\0');
-            fs::path hnsw_file = out_path / buf.data();
-            std::string tmp = hnsw_file.string();
-            hnsws[i]->saveIndex(tmp);
+            fs::path index_file = out_path / buf.data();
+            std::string tmp = index_file.string();
+            indexes[i]->save(tmp);
+            if (indexes[i]->kind() != StateIndex::HNSW) {
+                bf << i << " " << int(indexes[i]->kind()) << "\n";
+            }
+        }
+    }
+
+    if (!cost_model.samples.empty()) {
+        cost_model.save((out_path / "calibration.in").string());
+    }
+
+    // States no logged query reaches keep building no graph on insertions
+    if (!cold_states.empty()) {
+        std::ofstream cf((out_path / "cold.in").string());
+        cf << "threshold " << cold_build_threshold << "\n";
+        for (int i = 0; i < gsa.st.size(); i++) {
+            if (cold_states[i]) cf << i << "\n";
+        }
+    }
+
+    // States sharing the entry of another: "state entry" lines
+    if (!shared_states.empty()) {
+        std::ofstream sf((out_path / "shared.in").string());
+        for (int i = 0; i < gsa.st.size(); i++) {
+            if (entry(i) != i) sf << i << " " << entry(i) << "\n";
+        }
+    }
+
+    // Filtered states and the graph they search
+    if (global_graph) {
+        global_graph->save((out_path / "global_hnsw").string());
+        std::ofstream ff((out_path / "filtered.in").string());
+        ff << "selectivity " << filter_selectivity << "\n";
+        for (int i = 0; i < gsa.st.size(); i++) {
+            if (filtered(i)) ff << i << "\n";
+        }
+    }
+
+    fs::path params_file = out_path / "params.in";
+    std::ofstream pf(params_file.string());
+    pf << "policy " << hnsw_policy.spec() << "\n";
+    for (int i = 0; i < gsa.st.size(); i++) {
+        if (indexes[i]) {
+            const auto& p = indexes[i]->params;
+            pf << i << " " << p.M << " " << p.ef_construction << " " << p.ef_search << "\n";
         }
     }
 }
@@ -499,20 +1708,15 @@ void VectorMaton::save_index(const char* output_folder) {
 size_t VectorMaton::size() {
     size_t total_size = 0;
     size_t hnsw_size = 0;
-    for (int i = 0; i < gsa.st.size(); i++) {
-        auto hnsw = hnsws[i];
-        if (!hnsw) continue;
-        hnsw_size += hnsw->indexFileSize();
+    for (int i = 0; i < indexes.size(); i++) {
+        if (!indexes[i]) continue;
+        hnsw_size += indexes[i]->size_bytes();
     }
+    if (global_graph) hnsw_size += global_graph->size_bytes();
     LOG_DEBUG("HNSW size: ", hnsw_size, " bytes.");
     total_size += hnsw_size;
-    size_t sa_size = 0;
-    for (auto& s : gsa.st) {
-        sa_size += s.next.bucket_count() * sizeof(void*);
-        sa_size += (sizeof(std::pair<char, int>) + sizeof(void*)) * s.next.size(); // size of adjacency map
-        sa_size += sizeof(s.len) + sizeof(s.link); // size of len and link
-    }
-    LOG_DEBUG("Suffix automaton size: ", sa_size, " bytes.");
+    size_t sa_size = pattern_index().size_bytes();
+    LOG_DEBUG(use_fm_index ? "FM-index size: " : "Suffix automaton size: ", sa_size, " bytes.");
     total_size += sa_size;
     size_t string_size = 0, vector_size = 0;
     for (int i = 0; i < num_elements; i++) {
@@ -523,10 +1727,14 @@ size_t VectorMaton::size() {
     // LOG_DEBUG("Vector size: ", vector_size, " bytes.");
     // total_size += string_size + vector_size;
     // Auxiliary components
-    size_t aux_size = sizeof(int) * gsa.st.size() * 3;
-    for (int i = 0; i < gsa.st.size(); i++) {
-        aux_size += sizeof(int) * candidate_ids[i].size();
+    size_t aux_size = sizeof(int) * candidate_ids.size() * 3;
+    for (int i = 0; i < candidate_ids.size(); i++) {
+        aux_size += candidate_ids[i].size_bytes();
+    }
+    for (const auto& extra : extra_inherit_states) {
+        aux_size += sizeof(extra) + sizeof(int) * extra.capacity();
     }
+    aux_size += sizeof(int) * shared_states.size();
     LOG_DEBUG("Auxiliary components' size: ", aux_size, " bytes.");
     total_size += aux_size;
     return total_size;
@@ -534,50 +1742,223 @@ size_t VectorMaton::size() {
 
 size_t VectorMaton::vertex_num() {
     size_t total_vertices = 0;
-    for (int i = 0; i < gsa.st.size(); i++) {
-        if (!hnsws[i]) continue;
+    for (int i = 0; i < indexes.size(); i++) {
+        if (!indexes[i]) continue;
         total_vertices += candidate_ids[i].size();
-        if (candidate_ids[i].size() != hnsws[i]->max_elements_) {
+        if (candidate_ids[i].size() != indexes[i]->size()) {
             LOG_ERROR("Vertex number for state ", i, " does not match!");
         }
     }
+    if (global_graph) total_vertices += global_graph->size();
     return total_vertices;
 }
 
 void VectorMaton::set_ef(int ef) {
-    for (int i = 0; i < gsa.st.size(); i++) {
-        if (hnsws[i]) hnsws[i]->setEf(ef);
+    for (int i = 0; i < indexes.size(); i++) {
+        if (indexes[i]) indexes[i]->set_ef(ef);
+    }
+    if (global_graph) global_graph->set_ef(ef);
+}
+
+void VectorMaton::freeze() {
+    unsigned long long start_time = currentTime();
+    size_t num_frozen = 0, before = 0, after = 0;
+    for (int i = 0; i < indexes.size(); i++) {
+        if (!indexes[i] || indexes[i]->kind() != StateIndex::HNSW) continue;
+        StateIndex* index = new FrozenIndex(*(HnswIndex*)indexes[i], space, vecs.data(), dim);
+        before += indexes[i]->size_bytes();
+        after += index->size_bytes();
+        delete indexes[i];
+        indexes[i] = index;
+        num_frozen++;
     }
+    frozen = true;
+    LOG_INFO("Froze ", num_frozen, " graphs in ", timeFormatting(currentTime() - start_time).str(), ": ", before, " bytes before, ", after, " after");
 }
 
 void VectorMaton::set_min_build_threshold(int threshold) {
     min_build_threshold = threshold;
 }
 
+void VectorMaton::set_hnsw_policy(const HnswPolicy& policy) {
+    hnsw_policy = policy;
+}
+
+void VectorMaton::set_backend_policy(const BackendPolicy& policy) {
+    backend_policy = policy;
+}
+
+void VectorMaton::set_auto_threshold(double latency_target) {
+    cost_model.per_state = true;
+    cost_model.latency_target = latency_target;
+}
+
+void VectorMaton::set_nn_descent_cutoff(int cutoff) {
+    nn_descent_cutoff = cutoff;
+}
+
+void VectorMaton::set_derive_graphs(bool derive) {
+    derive_graphs = derive;
+}
+
+void VectorMaton::set_filter_selectivity(double selectivity) {
+    filter_selectivity = selectivity;
+}
+
+void VectorMaton::set_cold_build_threshold(int threshold) {
+    cold_build_threshold = threshold;
+}
+
+void VectorMaton::set_memory_budget(size_t bytes) {
+    memory_budget = bytes;
+}
+
+void VectorMaton::set_merge_graphs(bool merge) {
+    merge_graphs = merge;
+}
+
+void VectorMaton::set_plan_inheritance(bool plan) {
+    plan_graphs = plan;
+}
+
+void VectorMaton::set_max_fan_in(int fan_in) {
+    max_fan_in = std::max(fan_in, 1);
+}
+
+void VectorMaton::set_parallel_build_cutoff(int cutoff) {
+    parallel_build_cutoff = cutoff;
+}
+
+void VectorMaton::set_gsa_threads(int threads) {
+    gsa_threads = threads;
+}
+
+void VectorMaton::set_external_gsa(const std::string& spill_dir, size_t memory_budget) {
+    gsa_spill_dir = spill_dir;
+    gsa_memory_budget = memory_budget;
+}
+
+void VectorMaton::set_deferred_ids(bool deferred) {
+    deferred_ids = deferred;
+}
+
+void VectorMaton::set_normalizer(const Normalizer& normalizer) {
+    gsa.normalizer = normalizer;
+}
+
+void VectorMaton::set_tokenizer(const Tokenizer& tokenizer) {
+    gsa.tokenizer = tokenizer;
+}
+
+void VectorMaton::set_max_pattern_length(int length) {
+    gsa.max_pattern_length = length;
+}
+
+void VectorMaton::set_pattern_index(const std::string& name) {
+    if (name != "gsa" && name != "fm") {
+        LOG_WARN("Unknown pattern index '", name, "', using gsa");
+    }
+    use_fm_index = name == "fm";
+}
+
+void VectorMaton::encode_long_strings(bool all) {
+    if (all) long_begin.assign(1, 0), long_bytes.clear(), long_tokens.clear();
+    if (use_fm_index || gsa.max_pattern_length <= 0) return;
+    std::vector<GeneralizedSuffixAutomaton::Symbol> t;
+    for (size_t id = long_begin.size() - 1; id < (size_t)num_elements; id++) {
+        t = gsa.encode(strs[id]);
+        if (gsa.tokenizer.chars()) {
+            for (auto c : t) long_bytes.push_back(char(c));
+            long_begin.emplace_back(long_bytes.size());
+        }
+        else {
+            long_tokens.insert(long_tokens.end(), t.begin(), t.end());
+            long_begin.emplace_back(long_tokens.size());
+        }
+    }
+}
+
+bool VectorMaton::long_string_contains(uint32_t id, const std::vector<GeneralizedSuffixAutomaton::Symbol> &p) const {
+    if (gsa.tokenizer.chars()) {
+        auto begin = long_bytes.begin() + long_begin[id], end = long_bytes.begin() + long_begin[id + 1];
+        return std::search(begin, end, p.begin(), p.end(), [](char a, GeneralizedSuffixAutomaton::Symbol c) {
+            return (unsigned char)a == c;
+        }) != end;
+    }
+    auto begin = long_tokens.begin() + long_begin[id], end = long_tokens.begin() + long_begin[id + 1];
+    return std::search(begin, end, p.begin(), p.end()) != end;
+}
+
+std::vector<int> VectorMaton::query_long(const float* vec, const std::vector<GeneralizedSuffixAutomaton::Symbol> &p, int k) {
+    // p is longer than max_pattern_length: look up every length-L window, take the state with
+    // the fewest ids (local ids plus those of the inherited graphs) and verify them against strs
+    int L = gsa.max_pattern_length, best = -1;
+    size_t best_size = 0;
+    for (size_t w = 0; w + L <= p.size(); w++) {
+        int v = gsa.query(std::vector<GeneralizedSuffixAutomaton::Symbol>(p.begin() + w, p.begin() + w + L));
+        if (v == -1) return {};
+        v = entry(v);
+        size_t sz = candidate_ids[v].size();
+        for_each_inherited(v, [&](int t) { sz += candidate_ids[t].size(); });
+        if (best == -1 || sz < best_size) best = v, best_size = sz;
+    }
+    std::vector<std::pair<float, int>> local_res;
+    auto verify = [&](uint32_t id) {
+        if (long_string_contains(id, p)) local_res.emplace_back(squared_distance(vecs.data() + (size_t)id * dim, vec, dim), id);
+    };
+    candidate_ids[best].for_each(verify);
+    for_each_inherited(best, [&](int t) { candidate_ids[t].for_each(verify); });
+    // Inserted vectors can be in several inherited lists
+    std::sort(local_res.begin(), local_res.end());
+    local_res.erase(std::unique(local_res.begin(), local_res.end()), local_res.end());
+    std::vector<int> results;
+    for (int j = 0; j < local_res.size() && j < k; j++) results.emplace_back(local_res[j].second);
+    return results;
+}
+
 std::vector<int> VectorMaton::query(const float* vec, const std::string &s, int k) {
-    int i = gsa.query(s);
+    if (!use_fm_index && gsa.max_pattern_length > 0) {
+        auto p = gsa.encode(s);
+        if (p.size() > gsa.max_pattern_length) return query_long(vec, p, k);
+    }
+    int i = pattern_index().query(s);
     if (i == -1) return {};
+    i = entry(i);
     std::vector<std::pair<float, hnswlib::labeltype>> local_res;
-    if (!hnsws[i]) {
-        // No graph built on this state, brute-force
-        for (int j = 0; j < candidate_ids[i].size(); j++) {
-            int id = candidate_ids[i][j];
-            local_res.emplace_back(distance(vecs.data() + id * dim, vec, dim), id);
-        }
+    if (filtered(i)) {
+        local_res = search_filtered(i, vec, k);
+    }
+    else if (!indexes[i]) {
+        // No graph built on this state, brute-force (squared distances: merged with the inherited graphs' results)
+        local_res.reserve(candidate_ids[i].size());
+        candidate_ids[i].for_each([&](uint32_t id) {
+            local_res.emplace_back(squared_distance(vecs.data() + (size_t)id * dim, vec, dim), id);
+        });
         std::sort(local_res.begin(), local_res.end());
         if (local_res.size() > k) local_res.resize(k);
     }
     else {
-        hnsws[i]->external_data_ = (const char*)vecs.data();
-        local_res = hnsws[i]->searchKnnCloserFirst(vec, k);
+        indexes[i]->set_data(vecs.data());
+        local_res = indexes[i]->search(vec, k);
     }
     std::vector<std::pair<float, hnswlib::labeltype>> inherit_res;
-    if (inherit_states.size() > 0 && inherit_states[i] != -1) {
-        if (!hnsws[inherit_states[i]]) {
-            LOG_ERROR("HNSW for state ", i, "'s inherited state ", inherit_states[i], " should have been built but is not built!");
+    int num_inherited = 0;
+    for_each_inherited(i, [&](int t) {
+        if (!indexes[t]) {
+            LOG_ERROR("HNSW for state ", i, "'s inherited state ", t, " should have been built but is not built!");
         }
-        hnsws[inherit_states[i]]->external_data_ = (const char*)vecs.data();
-        inherit_res = hnsws[inherit_states[i]]->searchKnnCloserFirst(vec, k);
+        indexes[t]->set_data(vecs.data());
+        auto res = indexes[t]->search(vec, k);
+        inherit_res.insert(inherit_res.end(), res.begin(), res.end());
+        num_inherited++;
+    });
+    if (num_inherited > 1) {
+        // The inherited graphs are disjoint when built, their closest k are among the closest k of
+        // each. An inserted vector can join several of them (its string holds each of their
+        // patterns): keep it once.
+        std::sort(inherit_res.begin(), inherit_res.end());
+        inherit_res.erase(std::unique(inherit_res.begin(), inherit_res.end()), inherit_res.end());
+        if (inherit_res.size() > k) inherit_res.resize(k);
     }
     std::vector<int> results;
     int l = 0, r = 0;
@@ -601,8 +1982,9 @@ std::vector<int> VectorMaton::query(const float* vec, const std::string &s, int
 }
 
 VectorMaton::~VectorMaton() {
-    for (int i = 0; i < gsa.st.size(); i++) {
-        if (hnsws[i]) delete hnsws[i];
+    for (int i = 0; i < indexes.size(); i++) {
+        if (indexes[i]) delete indexes[i];
     }
+    delete global_graph;
     delete space;
 }
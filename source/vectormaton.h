@@ -3,7 +3,11 @@
 
 #include "headers.h"
 #include "sa.h"
-#include "mpmc_queue.h"
+#include "fm_index.h"
+#include "task_scheduler.h"
+#include "hnsw_policy.h"
+#include "state_index.h"
+#include "cost_model.h"
 
 class VectorMaton {
     private:
@@ -11,28 +15,195 @@ class VectorMaton {
         std::vector<std::string> strs;
         int dim = 0, num_elements = 0;
         int min_build_threshold = 200; // minimum number of vectors to build HNSW/NSW
-        void build_gsa();
+        CostModel cost_model; // with cost_model.per_state, calibrated at build time and deciding which states get graphs
+        HnswPolicy hnsw_policy; // HNSW parameters of each graph, by its size
+        BackendPolicy backend_policy; // index backend of each state, by its size
+        int max_fan_in = 1; // maximum number of disjoint successor graphs a state inherits
+        bool merge_graphs = false; // start graphs from a copy of the largest successor graph they contain
+        bool derive_graphs = false; // derive graphs from the subgraph of global_graph induced by their ids
+        double filter_selectivity = 0; // states holding at least this fraction of all vectors search global_graph with a membership filter (0 = never)
+        StateIndex* global_graph = nullptr; // HNSW over all vectors, during builds with derive_graphs and kept for filtered states
+        bool plan_graphs = false; // build_smart/build_parallel: plan all inheritance (plan_inheritance) before building any graph
+        std::vector<std::pair<std::string, double>> query_log; // logged query patterns and their frequencies
+        int cold_build_threshold = 0; // with a query log: states no logged query searches keep their graph from this many ids (0 = by the cost model)
+        size_t memory_budget = 0; // bytes the index (size()) may take: graphs are demoted to scans until its estimate fits (0 = unbounded)
+        int nn_descent_cutoff = 0; // build_parallel: graphs of at least this many vectors are bulk built by NN-descent (0 = never)
+        int parallel_build_cutoff = 10000; // build_parallel: graphs of at least this many vectors are built by all idle threads (0 = never)
+        int gsa_threads = 1; // threads used to construct the GSA (1 = sequential add_string) and, in build_smart, the global graph
+        std::string gsa_spill_dir = ""; // if set, construct the GSA out of core (GeneralizedSuffixAutomaton::build_external)
+        size_t gsa_memory_budget = 0;
+        bool deferred_ids = false; // materialize GSA id sets per state during the build instead of in the GSA
+        bool use_fm_index = false; // states come from fm instead of gsa (build_smart/build_full and queries only)
+        // False (logged) if the pattern index cannot be built (external GSA spill I/O).
+        bool build_gsa();
+        bool build_pattern_index();
+        PatternIndex& pattern_index();
+        StateIndex* new_index(size_t n); // empty index for n vectors, backend and parameters from the policies
+        bool calibrate_cost_model(); // false if there are too few vectors
+        void calibrate_threshold();
+        // States whose graphs the successors succ have or inherit (may repeat).
+        std::vector<int> successor_graphs(const std::vector<int>& succ) const;
+        // Inherit up to max_fan_in pairwise disjoint graphs among those of states below state i in
+        // graphs (largest first) and return the ids of the state (ids) that none of them covers.
+        PostingList inherit_graphs(int i, const PostingList& ids, std::vector<int> graphs);
+        // With derive_graphs, or with filter_selectivity where some state is filtered (planned: as
+        // filtered_states has them, else may be while building)
+        void build_global_graph(int cores, bool planned = false);
+        void release_global_graph(); // unless a state is filtered
+        // Whether a state of n ids is filtered: it builds no graph, its queries search global_graph
+        // for its ids (candidate_ids, in bitmap form).
+        bool use_filter(size_t n) const;
+        void filter_state(int i, PostingList ids);
+        bool filtered(int i) const { return !filtered_states.empty() && filtered_states[i]; }
+        // 1 for the states the query log patterns query. The pattern index must be built.
+        std::vector<char> logged_states();
+        // Whether a state of n ids that no logged query searches keeps a graph: from cold_build_threshold
+        // ids if set, else where the cost model's scan of n ids exceeds its latency target and a search.
+        bool cold_needs_graph(size_t n) const;
+        void calibrate_cold_scans(); // the cost model for cold_needs_graph, unless set or calibrated
+        // Keep only the planned graphs that logged queries search (or inherit), and those of states
+        // cold_needs_graph keeps; the other states get all of their ids, no graph and no inheritance
+        // (cold_states). Returns the number of graph vertices dropped.
+        size_t drop_cold_graphs();
+        // Whether state i needs a graph over n of its ids, on top of the graphs it inherits: never if
+        // it is cold, else by the cost model (cost_model.per_state) or if n >= min_build_threshold.
+        bool wants_graph(int i, size_t n) const;
+        bool has_graph(int i) const { return wants_graph(i, candidate_ids[i].size()) && !filtered(i) && entry(i) == i; }
+        // Content-addressed id sets (during builds): states owning an id set, by its hash
+        std::unordered_map<uint64_t, std::vector<int>> id_set_owners;
+        // Parallel builds: the ids of owners not yet final, and the states sharing their entry meanwhile
+        std::unordered_map<int, PostingList> pending_id_sets;
+        std::unordered_map<int, std::vector<int>> id_set_followers;
+        std::mutex id_set_mtx;
+        // The owner of an id set equal to ids, whose hash is hash, or -1. Thread-safe.
+        int find_shared(uint64_t hash, const PostingList& ids);
+        // Register state i as the owner of its id set once its candidate ids, inheritance and graph
+        // are final. Thread-safe.
+        void store_shared(int i, uint64_t hash);
+        // Parallel builds: the owner of an id set equal to ids (hash), final or not, else state i becomes
+        // its owner before it is built, pending until finish_shared(i). Thread-safe.
+        int claim_shared(int i, uint64_t hash, const PostingList& ids);
+        // Whether state i, sharing the entry of owner, waits for it: false if owner is already final.
+        bool follow_shared(int i, int owner);
+        // Owner i is final: returns the states that waited for it. Thread-safe.
+        std::vector<int> finish_shared(int i);
+        // Sequential builds, where a state is final before the next one is taken: whether state i has
+        // the ids of an earlier state, whose entry it then shares, else it becomes their owner.
+        bool share_ids(int i, const PostingList& ids);
+        void report_shared(); // and release id_set_owners
+        // Ids of state i: its candidate ids and those of the graphs it inherits.
+        PostingList state_ids(int i) const;
+        // Before an insertion: a state sharing the entry of another gets its own copy of their ids
+        // (and its own graph) unless the new vector goes to both or neither (gsa.affected_states).
+        void unshare_ids();
+        // States sharing the entry of each state, built on the first insertion (sharers_valid)
+        std::unordered_map<int, std::vector<int>> sharers;
+        bool sharers_valid = false;
+        // insert(): whether the new vector is covered by the graph of a state or one it inherits,
+        // computed for the insertion numbered covers_stamp[s] (one visit per state and insertion)
+        std::vector<uint32_t> covers_stamp;
+        std::vector<char> covers_memo;
+        uint32_t insert_stamp = 0;
+        bool frozen = false; // some graphs are FrozenIndex copies (freeze())
+        // Demote planned graphs (graph(i)) to scans of all of their state's ids (cold_states), least
+        // expected query latency added per byte saved first, until the estimated index size fits
+        // memory_budget. A graph inheriting a demoted graph indexes its ids instead; a state without
+        // a graph inheriting it is demoted too. Returns the number of graph vertices demoted.
+        size_t fit_memory_budget(const std::function<bool(int)>& graph);
+        // Log the projected latency of the logged queries and what the dropped graphs would have cost.
+        void report_workload(size_t dropped);
+        std::vector<std::pair<float, hnswlib::labeltype>> search_filtered(int i, const float* vec, int k);
+        // Seed the empty index: derive it from global_graph (derive_graphs) or, with merge_graphs,
+        // copy the largest index among graphs (states) whose ids are all in ids. A single graph is copied,
+        // not a merge of several. Returns the ids still to add.
+        PostingList seed_index(StateIndex* index, const PostingList& ids, std::vector<int> graphs);
+        // Assign inherit_states, extra_inherit_states and candidate_ids of every state without building
+        // a graph: greedily, as build_smart, then keeping whole the graphs of states whose predecessors
+        // would inherit more of them than the states inherit, then (max_fan_in > 1) choosing among the
+        // largest graphs of all states below instead of those taken by the successors. Logs the plans,
+        // keeps the one with fewest graph vertices and returns that number. The pattern index must be built.
+        size_t plan_inheritance();
+        bool build_planned(int cores); // plan_inheritance, then build the graphs with cores threads
+        // build_full's choice of graphs before building any: take the ids of every state, mark
+        // filtered and (query log) cold states, then fit_memory_budget.
+        void plan_full();
+        // Call f on every state whose graph state v inherits.
+        template <typename F>
+        void for_each_inherited(int v, F f) const {
+            if (inherit_states.empty() || inherit_states[v] == -1) return;
+            f(inherit_states[v]);
+            if (!extra_inherit_states.empty()) {
+                for (int t : extra_inherit_states[v]) f(t);
+            }
+        }
         void clear_gsa();
+        std::vector<int> query_long(const float* vec, const std::vector<GeneralizedSuffixAutomaton::Symbol> &p, int k);
+        // With max_pattern_length, strs as the GSA encodes them, for query_long to verify candidates:
+        // string id is long_bytes (char mode) or long_tokens [long_begin[id], long_begin[id + 1]).
+        std::string long_bytes;
+        std::vector<GeneralizedSuffixAutomaton::Symbol> long_tokens;
+        std::vector<size_t> long_begin = {0};
+        void encode_long_strings(bool all); // all strings, or those added since the last call
+        bool long_string_contains(uint32_t id, const std::vector<GeneralizedSuffixAutomaton::Symbol> &p) const;
 
     public:
         std::vector<int> inherit_states = {}; // inherited state id
-        std::vector<std::vector<int>> candidate_ids = {}; // maintained vector ids in this state (others are inherited from inherit_states)
+        std::vector<std::vector<int>> extra_inherit_states = {}; // further inherited state ids (max_fan_in > 1), disjoint from each other and inherit_states when built
+        std::vector<PostingList> candidate_ids = {}; // maintained vector ids in this state (others are inherited from inherit_states)
         GeneralizedSuffixAutomaton gsa;
+        FMIndex fm;
         hnswlib::L2Space* space = nullptr;
-        std::vector<hnswlib::HierarchicalNSW<float>*> hnsws;
+        std::vector<StateIndex*> indexes; // index of the candidate_ids of each state, nullptr if too small
+        std::vector<char> filtered_states = {}; // 1 for states answered by a filtered search of global_graph (filter_selectivity > 0)
+        std::vector<char> cold_states = {}; // 1 for states left without a graph by the query log or the memory budget
+        std::vector<int> shared_states = {}; // state with the same ids whose candidate_ids, index and inheritance a state uses, -1 for its own
+
+        // The state whose candidate_ids, index and inheritance state i uses (shared_states)
+        int entry(int i) const { return shared_states.empty() || shared_states[i] == -1 ? i : shared_states[i]; }
 
         void set_vectors(const std::vector<float>& vectors, int dimension);
         void set_strings(const std::vector<std::string>& strings);
-        void build_parallel(int cores=8);
-        void build_smart();
-        void build_full();
+        // The build_* and plan_build methods return false (logged) if the pattern index cannot be
+        // built, e.g. on an I/O error of an external GSA build.
+        bool build_parallel(int cores=8);
+        bool build_smart();
+        bool build_full(int cores=1);
+        // Choose the graphs of build_full (full) or build_smart/build_parallel, query log and memory
+        // budget included, without building any, and log the predicted index: graphs, vertices, the
+        // bytes of every component of size() and the construction time (calibrated) with cores threads.
+        bool plan_build(bool full, int cores=1);
         void insert(const std::vector<float>& vec, const std::string& str);
+        // Replace every HNSW graph of a state by its read-only compact copy (FrozenIndex), after
+        // build_*/load_index and the insertions: later insertions are refused.
+        void freeze();
         void load_index(const char* input_folder);
         void save_index(const char* output_folder);
         size_t size();
         size_t vertex_num();
         void set_ef(int ef);
         void set_min_build_threshold(int threshold);
+        void set_auto_threshold(double latency_target); // microseconds per query, 0 = break-even
+        void set_hnsw_policy(const HnswPolicy& policy);
+        void set_backend_policy(const BackendPolicy& policy);
+        void set_max_fan_in(int fan_in);
+        void set_plan_inheritance(bool plan);
+        void set_merge_graphs(bool merge);
+        void set_derive_graphs(bool derive);
+        void set_filter_selectivity(double selectivity);
+        // Patterns, one per line, repeated or followed by a tab and a frequency (e.g. the string
+        // queries). False if the file cannot be read.
+        bool load_query_log(const std::string& path);
+        void set_cold_build_threshold(int threshold);
+        void set_memory_budget(size_t bytes);
+        void set_parallel_build_cutoff(int cutoff);
+        void set_nn_descent_cutoff(int cutoff);
+        void set_gsa_threads(int threads);
+        void set_external_gsa(const std::string& spill_dir, size_t memory_budget);
+        void set_deferred_ids(bool deferred);
+        void set_normalizer(const Normalizer& normalizer);
+        void set_tokenizer(const Tokenizer& tokenizer);
+        void set_max_pattern_length(int length);
+        void set_pattern_index(const std::string& name); // "gsa" (default) or "fm"
         std::vector<int> query(const float* vec, const std::string &s, int k);
 
         VectorMaton() {}